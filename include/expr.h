@@ -1,8 +1,13 @@
 #ifndef EXPR_H
 #define EXPR_H
 
+#include <stdint.h>
+#include <stdio.h>
 #include <cglm/cglm.h>
 
+/// The starting value of an FNV-1a hash, for hashBytes.
+#define FNV_OFFSET 0xcbf29ce484222325ull
+
 typedef enum {
     // Values
     TOKEN_LITERAL,
@@ -50,14 +55,125 @@ typedef enum {
 
 typedef struct {
     TokenType type;
-    float value;  // Undefined unless type == TOKEN_LITERAL
+    float value;   // Undefined unless type == TOKEN_LITERAL
+    int position;  // Offset of the token in the source string
 } Token;
 
+typedef double dvec3[3];
+
+typedef enum { AXIS_X = 1 << 0, AXIS_Y = 1 << 1, AXIS_Z = 1 << 2 } AxisMask;
+
+// Ways of evaluating an expression. BACKEND_AUTO picks one from a cost model.
+typedef enum {
+    BACKEND_AUTO,
+    BACKEND_INTERPRETER,  // One point at a time
+    BACKEND_BATCH,        // Each token is applied to a block of points at once
+} ExprBackend;
+
+// Static information about an expression, which does not depend on the point
+// it is evaluated at.
+typedef struct {
+    int stackDepth;     // Maximum number of stack slots used in evaluation
+    unsigned int axes;  // AxisMask of the coordinates the expression reads
+    float lipschitz;    // Bound on the gradient magnitude, or INFINITY
+} ExprInfo;
+
+// A range of values, with infinite ends where nothing is known.
+typedef struct {
+    double lo, hi;
+} Interval;
+
 /// Parses an expression, returns true if successful, false otherwise.
 bool parseExpression(char *str, Token *out, size_t outSize, char *errMsg);
 /// Performs a false run of a parsed expression to check for correct stack usage.
 bool validateExpression(Token *expr, char *errMsg);
 /// Evaluates an expression at a point in 3D space.
 float evaluateExpression(Token *expr, vec3 point);
+/// Folds constant subexpressions of a validated expression into literals, in
+/// place. Results are identical to evaluating the original expression.
+void optimizeExpression(Token *expr);
+/// Computes static information about a validated expression.
+ExprInfo analyzeExpression(Token *expr);
+/// Whether two sets of expression information are the same. Unknown bounds
+/// compare equal to each other.
+bool expressionInfoEqual(ExprInfo a, ExprInfo b);
+/// Adds bytes to a 64-bit FNV-1a hash, which starts from FNV_OFFSET.
+uint64_t hashBytes(uint64_t hash, const void *data, size_t length);
+/// Saves a validated expression in the binary program format, then loads it
+/// back to check that it reads as the same program. Returns false and sets
+/// errMsg if the file could not be written, or did not read back intact.
+bool saveExpression(Token *expr, char *path, char *errMsg);
+/// Loads a program saved by saveExpression, checking that it is intact and
+/// valid, and that its metadata matches analyzeExpression. The loaded
+/// expression is ready to evaluate, and does not need to be validated or
+/// optimized again. If info is not NULL, the metadata is stored in it.
+bool loadExpression(char *path, Token *out, size_t outSize, ExprInfo *info,
+                    char *errMsg);
+/// Evaluates an expression at count points, giving the same results as
+/// evaluateExpression, but applying each token to a block of points at a time.
+void evaluateExpressionBatch(Token *expr, vec3 *points, float *out,
+                             size_t count);
+/// Estimates the cost in nanoseconds of one evaluation of an expression with
+/// a backend, not including setup costs.
+double estimateExpressionCost(Token *expr, ExprBackend backend);
+/// Estimates the total time in nanoseconds for count evaluations of an
+/// expression with a backend, including setup costs.
+double estimateExpressionTime(Token *expr, ExprBackend backend, double count);
+/// Picks the backend expected to be fastest for count evaluations of an
+/// expression, including the fixed setup cost of each backend.
+ExprBackend chooseExpressionBackend(Token *expr, double count);
+/// Gets the name of a backend, for logging.
+char *getBackendName(ExprBackend backend);
+/// Evaluates an expression at a point in 3D space, in double precision.
+double evaluateExpressionDouble(Token *expr, dvec3 point);
+/// Evaluates an expression at a point, also finding its gradient there by
+/// forward differentiation. The value is identical to evaluateExpression.
+float evaluateExpressionGradient(Token *expr, vec3 point, vec3 gradient);
+/// Evaluates an expression and its gradient at count points, giving the same
+/// results as evaluateExpressionGradient, but applying each token to a block
+/// of points at a time.
+void evaluateExpressionGradientBatch(Token *expr, vec3 *points, float *out,
+                                     vec3 *gradients, size_t count);
+/// Evaluates an expression and its gradient at a point, in double precision.
+double evaluateExpressionGradientDouble(Token *expr, dvec3 point,
+                                        dvec3 gradient);
+/// Bounds the values an expression takes over a box with interval arithmetic.
+/// The bounds are for exact arithmetic, so float evaluations may stray past
+/// them by rounding error.
+Interval evaluateExpressionInterval(Token *expr, vec3 min, vec3 max);
+
+typedef struct ExprProfile ExprProfile;
+
+/// Creates a profile to collect per-token execution counts and timings for a
+/// parsed expression, with counters for a single thread.
+ExprProfile *createExpressionProfile(Token *expr);
+/// Gives the profile counters for threads 0 to threadCount - 1, keeping those
+/// recorded so far. Threads may evaluate in parallel as long as each passes
+/// its own index; their counters are added together in the reports.
+void setExpressionProfileThreads(ExprProfile *profile, int threadCount);
+/// Evaluates the profile's expression at a point, recording statistics.
+float evaluateExpressionProfiled(ExprProfile *profile, int thread,
+                                 vec3 point);
+/// Evaluates the profile's expression and its gradient at a point, in the
+/// same way as evaluateExpressionGradient, recording statistics. Only the
+/// tokens themselves are timed, not the chain rule.
+float evaluateExpressionGradientProfiled(ExprProfile *profile, int thread,
+                                         vec3 point, vec3 gradient);
+/// Evaluates the profile's expression at a point in double precision,
+/// recording statistics.
+double evaluateExpressionDoubleProfiled(ExprProfile *profile, int thread,
+                                        dvec3 point);
+/// Evaluates the profile's expression and its gradient at a point in double
+/// precision, recording statistics.
+double evaluateExpressionGradientDoubleProfiled(ExprProfile *profile,
+                                                int thread, dvec3 point,
+                                                dvec3 gradient);
+/// Writes a report of the most expensive operations and tokens, with
+/// positions in the source string.
+void writeProfileReport(ExprProfile *profile, char *source, FILE *file);
+/// Writes the same report as writeProfileReport, formatted as JSON.
+void writeProfileReportJSON(ExprProfile *profile, char *source, FILE *file);
+/// Destroys a profile.
+void destroyExpressionProfile(ExprProfile *profile);
 
 #endif
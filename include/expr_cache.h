@@ -0,0 +1,43 @@
+#ifndef EXPR_CACHE_H
+#define EXPR_CACHE_H
+
+#include "expr.h"
+
+#include <stddef.h>
+
+// Options that change the compiled program, and so are part of the cache key.
+typedef enum {
+    EXPR_OPTIMIZE = 1 << 0,
+} ExprOptions;
+
+typedef struct ExprCache ExprCache;
+typedef struct CompiledExpr CompiledExpr;
+
+/// Creates a cache holding up to capacity compiled expressions.
+ExprCache *createExpressionCache(size_t capacity);
+/// Looks up an expression in the cache, parsing, validating and compiling it
+/// on a miss. Returns a handle that must be released with releaseExpression,
+/// or NULL with errMsg set if the expression is invalid.
+CompiledExpr *acquireExpression(ExprCache *cache, char *str,
+                                unsigned int options, char *errMsg);
+/// Parses, validates and compiles an expression without going through a
+/// cache, so that token positions refer to str itself, as profile reports
+/// need. Returns NULL with errMsg set if the expression is invalid.
+CompiledExpr *compileExpressionText(char *str, unsigned int options,
+                                    char *errMsg);
+/// Loads a program saved by saveExpression, without going through a cache,
+/// so workers can start from it without parsing or optimizing. Returns NULL
+/// with errMsg set if it could not be loaded.
+CompiledExpr *loadCompiledExpression(char *path, char *errMsg);
+/// Takes an extra reference to a compiled expression.
+CompiledExpr *retainExpression(CompiledExpr *expr);
+/// Releases a reference to a compiled expression, freeing it if it was the
+/// last one.
+void releaseExpression(CompiledExpr *expr);
+/// Retrieves the token program of a compiled expression. Token positions
+/// refer to the normalized expression text.
+Token *getExpressionTokens(CompiledExpr *expr);
+/// Destroys a cache. Handles acquired from it remain valid until released.
+void destroyExpressionCache(ExprCache *cache);
+
+#endif
@@ -0,0 +1,54 @@
+#ifndef GEN_WORKER_H
+#define GEN_WORKER_H
+
+#include "expr.h"
+#include "expr_cache.h"
+#include "generator.h"
+#include "mesh.h"
+
+/// Everything a mesh generated in the background depends on.
+typedef struct {
+    /// The expression to generate from. The job owns a reference to it, which
+    /// is released once the job is superseded or a later job replaces it.
+    CompiledExpr *sdf;
+    int subdivisions;
+    Window window;
+    float threshold;
+    bool invertNormals;
+    Precision precision;
+    NormalMode normalMode;
+    ExprBackend backend;
+    bool streaming, culling, progressive;
+    float bandMargin, simplifyTolerance;
+    /// If set, the mesh is generated once at full size with profiling, and
+    /// the profile is handed back with the result. The job owns the profile
+    /// until then, and destroys it if the job is superseded.
+    ExprProfile *profile;
+} GenJob;
+
+typedef struct GenWorker GenWorker;
+
+/// Creates a thread that generates meshes in the background, with its own
+/// generator. Meshes are generated into back and handed over by swapping it
+/// with front, so both must be created on the thread that owns the GL
+/// context, and only front may be used by the caller.
+GenWorker *createGenWorker(Mesh *front, Mesh *back);
+/// Queues a job, superseding any job that is queued or running. A queued job
+/// is dropped, and a running one is cancelled, stopping within a layer of the
+/// grid. In progressive mode, each level of the preview is handed over as it
+/// finishes.
+void submitGenJob(GenWorker *worker, GenJob job);
+/// If a mesh has finished since the last call, swaps it in as the front mesh,
+/// which is stored in mesh, and returns true. It still needs uploading. The
+/// profile of a profiled job is stored in profile, and must be destroyed by
+/// the caller; otherwise profile is set to NULL.
+bool takeGenResult(GenWorker *worker, Mesh **mesh, ExprProfile **profile);
+/// Whether a job is queued or running.
+bool isGenWorkerBusy(GenWorker *worker);
+/// Gets how far through its current level the running job is, from 0 to 1.
+float getGenWorkerProgress(GenWorker *worker);
+/// Cancels the running job, then stops the thread and frees the worker and
+/// its generator. The meshes are left to the caller.
+void destroyGenWorker(GenWorker *worker);
+
+#endif
@@ -4,12 +4,41 @@
 #include "expr.h"
 #include "mesh.h"
 
+#include <stdatomic.h>
 #include <cglm/cglm.h>
 
 typedef struct {
     vec3 min, max;
 } Window;
 
+// In mixed precision mode, samples are still evaluated as floats, but edges
+// and normals are calculated in double precision. Vertices are always placed
+// in double precision.
+typedef enum { PRECISION_FLOAT, PRECISION_MIXED } Precision;
+
+// Sampled normals are estimated from the gradient of the sample grid rather
+// than the SDF, so they cost no extra evaluations but are less accurate,
+// which suits previews.
+typedef enum { NORMALS_EVALUATED, NORMALS_SAMPLED } NormalMode;
+
+// The stages of the pipeline, each of which is run once per layer of the
+// grid, apart from faces when simplifying, which are found all at once at the
+// end.
+typedef enum {
+    STAGE_SAMPLES,
+    STAGE_EDGES,
+    STAGE_VERTICES,
+    STAGE_FACES,
+} GenStage;
+
+// What generateMesh did: the mesh needs uploading again unless it is
+// unchanged, and is left empty if generation was cancelled.
+typedef enum { GEN_UNCHANGED, GEN_UPDATED, GEN_CANCELLED } GenStatus;
+
+// Reports that a stage has finished done of its total layers.
+typedef void (*ProgressFunction)(void *data, GenStage stage, int done,
+                                 int total);
+
 typedef struct Generator Generator;
 
 Generator *createGenerator();
@@ -17,7 +46,87 @@ void setGeneratorSize(Generator *gen, int subdivisions);
 void setGeneratorWindow(Generator *gen, Window window);
 void setGeneratorSDF(Generator *gen, Token *expr);
 void setGeneratorThreshold(Generator *gen, float threshold);
-void generateMesh(Generator *gen, Mesh *mesh, bool invertNormals);
+void setGeneratorPrecision(Generator *gen, Precision precision);
+void setGeneratorNormals(Generator *gen, NormalMode normalMode);
+// While a profile is set, SDF evaluations are recorded in it, in float and
+// double precision, including the gradient evaluations used to refine edges.
+// Tasks still run on every thread, each recording into its own counters.
+void setGeneratorProfile(Generator *gen, ExprProfile *profile);
+// Overrides the backend used for sampling, which is picked by a cost model
+// when left as BACKEND_AUTO.
+void setGeneratorBackend(Generator *gen, ExprBackend backend);
+// When verbose, the chosen backend and its estimated and actual sampling
+// time are logged to stderr, along with the evaluations made per edge. Sampled
+// normals are also compared against evaluated ones.
+void setGeneratorVerbose(Generator *gen, bool verbose);
+// In streaming mode, only the layers of samples being worked on are kept, so
+// memory grows with the area of a layer rather than the volume of the grid.
+// This allows grids of 2048^3 and beyond to be generated in one go.
+void setGeneratorStreaming(Generator *gen, bool streaming);
+// When tolerance is above 0, cells are merged into the nodes of an octree
+// wherever the merged vertex stays within tolerance, as an RMS distance in
+// world units, of the planes of the intersections below it, and faces are
+// found by walking the octree. Flat regions then need far fewer faces. At 0,
+// every cell has its own vertex.
+void setGeneratorSimplification(Generator *gen, float tolerance);
+// When culling is enabled, the SDF is bounded over blocks of the grid with
+// interval arithmetic, and blocks proven to be entirely inside or outside the
+// surface are filled in without being sampled. Enabled by default.
+void setGeneratorCulling(Generator *gen, bool culling);
+// When margin is above 0, a coarse grid of every 4th sample is taken first,
+// and only blocks where it comes within margin of the threshold, or crosses
+// it, are sampled at full resolution, along with the blocks around them.
+// Unlike culling this works for any field, but a surface that passes between
+// the coarse samples can be lost; any crossings found in the blocks around
+// the band are reported as a warning. Takes the place of culling.
+void setGeneratorNarrowBand(Generator *gen, float margin);
+// In progressive mode, the samples of each mesh are kept when the size is
+// changed, and guide the narrow band of the next, finer mesh if it is a
+// preview: only blocks where the guide comes closer to the threshold than its
+// own slope allows for are sampled, so each level costs little more than its
+// surface. Any margin set with setGeneratorNarrowBand is kept as a minimum.
+// The guide is only used while the window stays the same and the new size is
+// a multiple of the old, and is not kept while streaming.
+void setGeneratorProgressive(Generator *gen, bool progressive);
+// Marks the meshes that follow as previews, which the guide of progressive
+// mode is used for. The slope it assumes is only an estimate, so thin
+// features can be lost; meshes that are not previews are sampled as if there
+// were no guide. Off by default.
+void setGeneratorPreview(Generator *gen, bool preview);
+// Unless streaming, the samples of each mesh are kept, and when the window is
+// then moved by a whole number of cells they are moved with it, so that the
+// next mesh only samples the newly exposed slabs. A move that is within a
+// thousandth of a cell of whole cells counts, and the grid then stays on the
+// cells of the kept samples rather than the window. Samples are dropped when
+// the size or SDF changes; resetGeneratorSamples drops them, along with any
+// guide, and must be called when anything else that changes the samples has
+// changed.
+void resetGeneratorSamples(Generator *gen);
+// Whether samples are kept for the next mesh.
+bool hasGeneratorKeptSamples(Generator *gen);
+// While a progress function is set, it is called with data each time a stage
+// finishes a layer, on the thread running generateMesh. It is called for
+// every layer, so it should only record the progress, for example in an
+// atomic that another thread polls.
+void setGeneratorProgress(Generator *gen, ProgressFunction progress,
+                          void *data);
+// While a cancellation flag is set, generateMesh checks it before each layer
+// and once its samples are taken, between the rows being sampled, and while
+// simplifying and contouring the octree. Once the flag is raised,
+// generateMesh returns GEN_CANCELLED promptly, leaving the mesh empty. The
+// generator can still be used, but the next mesh is generated from scratch.
+// The flag is never cleared by the generator.
+void setGeneratorCancel(Generator *gen, atomic_bool *cancel);
+// Sets the number of threads used for generation, or one per processor if
+// threads is 0.
+void setGeneratorThreads(Generator *gen, int threads);
+// Generates the mesh, unless nothing it depends on has changed since the last
+// mesh was generated, which must not have been changed in between. If that
+// was into a different Mesh, it is copied across instead. Only the stages
+// that depend on what has changed are run: samples are kept across threshold
+// and normal changes, and changing invertNormals alone only flips the winding
+// of the mesh.
+GenStatus generateMesh(Generator *gen, Mesh *mesh, bool invertNormals);
 void destroyGenerator(Generator *gen);
 
 #endif
@@ -13,12 +13,29 @@ Mesh *createMesh(GLuint shaderProgram);
 void clearMesh(Mesh *mesh);
 /// Adds a quad with correct normals, to a mesh.
 void addQuad(Mesh *mesh, vec3 a, vec3 b, vec3 c, vec3 d, bool invertNormals);
+/// Resizes the mesh's vertex list to hold exactly quadCount quads, keeping
+/// any existing quads. New quads must then be filled in with setQuad.
+void resizeMeshQuads(Mesh *mesh, size_t quadCount);
+/// Writes a quad at a given position in the mesh, in the same way as addQuad.
+/// Different quads may be written from different threads at once.
+void setQuad(Mesh *mesh, size_t index, vec3 a, vec3 b, vec3 c, vec3 d,
+             bool invertNormals);
+/// Copies the vertex list of source into mesh. Neither mesh's GPU buffer is
+/// touched, so this may be called from any thread.
+void copyMesh(Mesh *mesh, Mesh *source);
+/// Flips the winding and normals of every quad in a mesh, giving the same
+/// mesh as if its quads had been added with invertNormals toggled.
+void invertMeshNormals(Mesh *mesh);
 /// Copies the internal vertex buffer of a mesh to the GPU.
 void updateMeshBuffer(Mesh *mesh);
 /// Renders a mesh.
 void renderMesh(Mesh *mesh, mat4 view, mat4 projection);
 /// Exports a mesh, writing to the given file handle.
 void exportMesh(Mesh *mesh, FILE *file);
+/// Gets the number of vertices in the mesh's vertex list, six for each quad.
+size_t getMeshVertexCount(Mesh *mesh);
+/// Copies the position and normal of a vertex in the mesh's vertex list.
+void getMeshVertex(Mesh *mesh, size_t index, vec3 pos, vec3 normal);
 /// Destroys a mesh, freeing all buffers and GPU objects.
 void destroyMesh(Mesh *mesh);
 
@@ -0,0 +1,24 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+/// Runs one task. thread is the index of the thread running it, from 0 to
+/// the size of the pool - 1, for use with per-thread scratch data.
+typedef void (*TaskFunction)(void *data, int task, int thread);
+
+typedef struct ThreadPool ThreadPool;
+
+/// Creates a pool of persistent threads. The calling thread counts as one of
+/// threadCount, and a count of 0 or less uses one thread per processor.
+ThreadPool *createThreadPool(int threadCount);
+/// Gets the number of threads that run tasks, including the calling thread.
+int getThreadPoolSize(ThreadPool *pool);
+/// Runs function for every task from 0 to taskCount - 1, and waits until they
+/// have all finished. Each thread starts with an even share of the tasks, and
+/// threads that run out steal from the others, so tasks of uneven cost are
+/// still balanced.
+void runTasks(ThreadPool *pool, int taskCount, TaskFunction function,
+              void *data);
+/// Stops and joins all threads, and frees the pool.
+void destroyThreadPool(ThreadPool *pool);
+
+#endif
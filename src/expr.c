@@ -1,15 +1,43 @@
 #include "expr.h"
 
+#include <stdint.h>
 #include <string.h>
+#include <time.h>
 #include <cglm/cglm.h>
 #include <noise1234.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#define HAVE_MMAP
+#endif
+
 #define TOKEN(TYPE) \
-    (Token) { TOKEN_##TYPE, 0.0 }
+    (Token) { TOKEN_##TYPE, 0.0, 0 }
 #define LITERAL(VALUE) \
-    (Token) { TOKEN_LITERAL, VALUE }
+    (Token) { TOKEN_LITERAL, VALUE, 0 }
 
 #define EVAL_STACK_SIZE 64
+// Only one in this many profiled evaluations is timed, as reading the cycle
+// counter costs more than most operations.
+#define PROFILE_SAMPLE_INTERVAL 64
+#define PROFILE_CONTEXT_LENGTH 24
+// Number of points the batch evaluator applies each token to at once.
+#define EVAL_BATCH_SIZE 64
+
+#define PROGRAM_MAGIC "SDFP"
+#define PROGRAM_VERSION 1
+#define PROGRAM_BYTE_ORDER 0x01020304u
+// Each instruction holds an opcode in its low byte, and for literals, an
+// index into the constant pool in the remaining bits.
+#define INSTRUCTION_OPCODE(INS) ((INS)&0xff)
+#define INSTRUCTION_CONSTANT(INS) ((INS) >> 8)
+#define FNV_PRIME 0x100000001b3ull
 
 typedef enum {
     CLASS_VALUE,
@@ -25,6 +53,73 @@ typedef enum {
 
 typedef enum { ASSOC_LEFT, ASSOC_RIGHT } Assoc;
 
+char *getTokenName(TokenType type) {
+    switch (type) {
+        case TOKEN_LITERAL:
+            return "literal";
+        case TOKEN_PI:
+            return "pi";
+        case TOKEN_E:
+            return "e";
+        case TOKEN_X:
+            return "x";
+        case TOKEN_Y:
+            return "y";
+        case TOKEN_Z:
+            return "z";
+        case TOKEN_ADD:
+            return "+";
+        case TOKEN_SUBTRACT:
+            return "-";
+        case TOKEN_MULTIPLY:
+            return "*";
+        case TOKEN_DIVIDE:
+            return "/";
+        case TOKEN_FLOOR_DIVIDE:
+            return "//";
+        case TOKEN_MODULO:
+            return "%";
+        case TOKEN_EXPONENTIATE:
+            return "^";
+        case TOKEN_NEGATE:
+            return "negate";
+        case TOKEN_ABS:
+            return "abs";
+        case TOKEN_MIN:
+            return "min";
+        case TOKEN_MAX:
+            return "max";
+        case TOKEN_FLOOR:
+            return "floor";
+        case TOKEN_SIN:
+            return "sin";
+        case TOKEN_COS:
+            return "cos";
+        case TOKEN_TAN:
+            return "tan";
+        case TOKEN_ASIN:
+            return "asin";
+        case TOKEN_ACOS:
+            return "acos";
+        case TOKEN_ATAN:
+            return "atan";
+        case TOKEN_ATAN2:
+            return "atan2";
+        case TOKEN_LN:
+            return "ln";
+        case TOKEN_LOG:
+            return "log";
+        case TOKEN_SQRT:
+            return "sqrt";
+        case TOKEN_NROOT:
+            return "nroot";
+        case TOKEN_NOISE:
+            return "noise";
+        default:
+            return "?";
+    }
+}
+
 char *getClassName(TokenClass class) {
     switch (class) {
         case CLASS_VALUE:
@@ -289,9 +384,13 @@ bool parseExpression(char *str, Token *out, size_t outSize, char *errMsg) {
     Token operators[outSize];
     size_t outIndex = 0, operatorIndex = 0;
     do {
+        // Skip whitespace here too, so that the token position is known.
+        cursor += strspn(cursor, " \n\t");
+        int position = cursor - str;
         if (!getToken(&cursor, previousToken, &currentToken, errMsg)) {
             return false;
         }
+        currentToken.position = position;
         TokenClass class = getTokenClass(currentToken);
         if (class == CLASS_VALUE) {
             out[outIndex++] = currentToken;
@@ -396,6 +495,151 @@ float popStack(float *rpnStack, size_t *rpnIndex) {
     return rpnStack[--(*rpnIndex)];
 }
 
+// The body of applyToken and applyTokenDouble, which only differ in the type
+// of their stack, so that every operator is written once. Expects token,
+// rpnStack, rpnIndex and point to be in scope.
+#define APPLY_TOKEN(TYPE, PUSH, POP)                                           \
+    switch (token->type) {                                                     \
+        case TOKEN_LITERAL:                                                    \
+            PUSH(rpnStack, rpnIndex, token->value);                            \
+            break;                                                             \
+        case TOKEN_PI:                                                         \
+            PUSH(rpnStack, rpnIndex, M_PI);                                    \
+            break;                                                             \
+        case TOKEN_E:                                                          \
+            PUSH(rpnStack, rpnIndex, M_E);                                     \
+            break;                                                             \
+        case TOKEN_X:                                                          \
+            PUSH(rpnStack, rpnIndex, point[0]);                                \
+            break;                                                             \
+        case TOKEN_Y:                                                          \
+            PUSH(rpnStack, rpnIndex, point[1]);                                \
+            break;                                                             \
+        case TOKEN_Z:                                                          \
+            PUSH(rpnStack, rpnIndex, point[2]);                                \
+            break;                                                             \
+        case TOKEN_ADD: {                                                      \
+            TYPE b = POP(rpnStack, rpnIndex);                                  \
+            TYPE a = POP(rpnStack, rpnIndex);                                  \
+            PUSH(rpnStack, rpnIndex, a + b);                                   \
+            break;                                                             \
+        }                                                                      \
+        case TOKEN_SUBTRACT: {                                                 \
+            TYPE b = POP(rpnStack, rpnIndex);                                  \
+            TYPE a = POP(rpnStack, rpnIndex);                                  \
+            PUSH(rpnStack, rpnIndex, a - b);                                   \
+            break;                                                             \
+        }                                                                      \
+        case TOKEN_MULTIPLY: {                                                 \
+            TYPE b = POP(rpnStack, rpnIndex);                                  \
+            TYPE a = POP(rpnStack, rpnIndex);                                  \
+            PUSH(rpnStack, rpnIndex, a * b);                                   \
+            break;                                                             \
+        }                                                                      \
+        case TOKEN_DIVIDE: {                                                   \
+            TYPE b = POP(rpnStack, rpnIndex);                                  \
+            TYPE a = POP(rpnStack, rpnIndex);                                  \
+            PUSH(rpnStack, rpnIndex, a / b);                                   \
+            break;                                                             \
+        }                                                                      \
+        case TOKEN_FLOOR_DIVIDE: {                                             \
+            TYPE b = POP(rpnStack, rpnIndex);                                  \
+            TYPE a = POP(rpnStack, rpnIndex);                                  \
+            PUSH(rpnStack, rpnIndex, floor(a / b));                            \
+            break;                                                             \
+        }                                                                      \
+        case TOKEN_MODULO: {                                                   \
+            TYPE b = POP(rpnStack, rpnIndex);                                  \
+            TYPE a = POP(rpnStack, rpnIndex);                                  \
+            PUSH(rpnStack, rpnIndex, remainder(a, b));                         \
+            break;                                                             \
+        }                                                                      \
+        case TOKEN_EXPONENTIATE: {                                             \
+            TYPE b = POP(rpnStack, rpnIndex);                                  \
+            TYPE a = POP(rpnStack, rpnIndex);                                  \
+            PUSH(rpnStack, rpnIndex, pow(a, b));                               \
+            break;                                                             \
+        }                                                                      \
+        case TOKEN_NEGATE:                                                     \
+            rpnStack[*rpnIndex - 1] *= -1;                                     \
+            break;                                                             \
+        case TOKEN_ABS:                                                        \
+            rpnStack[*rpnIndex - 1] = fabs(rpnStack[*rpnIndex - 1]);           \
+            break;                                                             \
+        case TOKEN_MIN: {                                                      \
+            TYPE b = POP(rpnStack, rpnIndex);                                  \
+            TYPE a = POP(rpnStack, rpnIndex);                                  \
+            PUSH(rpnStack, rpnIndex, fmin(a, b));                              \
+            break;                                                             \
+        }                                                                      \
+        case TOKEN_MAX: {                                                      \
+            TYPE b = POP(rpnStack, rpnIndex);                                  \
+            TYPE a = POP(rpnStack, rpnIndex);                                  \
+            PUSH(rpnStack, rpnIndex, fmax(a, b));                              \
+            break;                                                             \
+        }                                                                      \
+        case TOKEN_FLOOR:                                                      \
+            rpnStack[*rpnIndex - 1] = floor(rpnStack[*rpnIndex - 1]);          \
+            break;                                                             \
+        case TOKEN_SIN:                                                        \
+            rpnStack[*rpnIndex - 1] = sin(rpnStack[*rpnIndex - 1]);            \
+            break;                                                             \
+        case TOKEN_COS:                                                        \
+            rpnStack[*rpnIndex - 1] = cos(rpnStack[*rpnIndex - 1]);            \
+            break;                                                             \
+        case TOKEN_TAN:                                                        \
+            rpnStack[*rpnIndex - 1] = tan(rpnStack[*rpnIndex - 1]);            \
+            break;                                                             \
+        case TOKEN_ASIN:                                                       \
+            rpnStack[*rpnIndex - 1] = asin(rpnStack[*rpnIndex - 1]);           \
+            break;                                                             \
+        case TOKEN_ACOS:                                                       \
+            rpnStack[*rpnIndex - 1] = acos(rpnStack[*rpnIndex - 1]);           \
+            break;                                                             \
+        case TOKEN_ATAN:                                                       \
+            rpnStack[*rpnIndex - 1] = atan(rpnStack[*rpnIndex - 1]);           \
+            break;                                                             \
+        case TOKEN_ATAN2: {                                                    \
+            TYPE x = POP(rpnStack, rpnIndex);                                  \
+            TYPE y = POP(rpnStack, rpnIndex);                                  \
+            PUSH(rpnStack, rpnIndex, atan2(y, x));                             \
+            break;                                                             \
+        }                                                                      \
+        case TOKEN_LN:                                                         \
+            rpnStack[*rpnIndex - 1] = log(rpnStack[*rpnIndex - 1]);            \
+            break;                                                             \
+        case TOKEN_LOG: {                                                      \
+            TYPE x = POP(rpnStack, rpnIndex);                                  \
+            TYPE base = POP(rpnStack, rpnIndex);                               \
+            PUSH(rpnStack, rpnIndex, log(x) / log(base));                      \
+            break;                                                             \
+        }                                                                      \
+        case TOKEN_SQRT:                                                       \
+            rpnStack[*rpnIndex - 1] = sqrt(rpnStack[*rpnIndex - 1]);           \
+            break;                                                             \
+        case TOKEN_NROOT: {                                                    \
+            TYPE x = POP(rpnStack, rpnIndex);                                  \
+            TYPE n = POP(rpnStack, rpnIndex);                                  \
+            PUSH(rpnStack, rpnIndex, pow(x, 1 / n));                           \
+            break;                                                             \
+        }                                                                      \
+        case TOKEN_NOISE: {                                                    \
+            TYPE x = POP(rpnStack, rpnIndex);                                  \
+            TYPE y = POP(rpnStack, rpnIndex);                                  \
+            TYPE z = POP(rpnStack, rpnIndex);                                  \
+            PUSH(rpnStack, rpnIndex, noise3(x, y, z));                         \
+            break;                                                             \
+        }                                                                      \
+        default:                                                               \
+            /* These tokens never appear in a parsed expression. */            \
+            break;                                                             \
+    }
+
+/// Applies a single token to the evaluation stack.
+void applyToken(Token *token, float *rpnStack, size_t *rpnIndex, vec3 point) {
+    APPLY_TOKEN(float, pushStack, popStack)
+}
+
 float evaluateExpression(Token *expr, vec3 point) {
     // Hard limit on equation complexity, but this should be above pretty much
     // any normal usage.
@@ -404,143 +648,1456 @@ float evaluateExpression(Token *expr, vec3 point) {
 
     Token *currentToken = expr;
     while (currentToken->type != TOKEN_END) {
-        switch (currentToken->type) {
-            case TOKEN_LITERAL:
-                pushStack(rpnStack, &rpnIndex, currentToken->value);
-                break;
-            case TOKEN_PI:
-                pushStack(rpnStack, &rpnIndex, M_PI);
-                break;
-            case TOKEN_E:
-                pushStack(rpnStack, &rpnIndex, M_E);
-                break;
-            case TOKEN_X:
-                pushStack(rpnStack, &rpnIndex, point[0]);
-                break;
-            case TOKEN_Y:
-                pushStack(rpnStack, &rpnIndex, point[1]);
-                break;
-            case TOKEN_Z:
-                pushStack(rpnStack, &rpnIndex, point[2]);
-                break;
-            case TOKEN_ADD: {
-                float b = popStack(rpnStack, &rpnIndex);
-                float a = popStack(rpnStack, &rpnIndex);
-                pushStack(rpnStack, &rpnIndex, a + b);
-                break;
-            }
-            case TOKEN_SUBTRACT: {
-                float b = popStack(rpnStack, &rpnIndex);
-                float a = popStack(rpnStack, &rpnIndex);
-                pushStack(rpnStack, &rpnIndex, a - b);
-                break;
+        applyToken(currentToken, rpnStack, &rpnIndex, point);
+        currentToken++;
+    }
+    return popStack(rpnStack, &rpnIndex);
+}
+
+// Applies a token to a block of points. Each stack slot is a row of values,
+// one per point, and every operation must match applyToken exactly.
+void applyTokenBatch(Token *token, float (*rows)[EVAL_BATCH_SIZE],
+                     size_t *rowIndex, vec3 *points, size_t count) {
+    // Arguments are a, b and c in the order they were pushed.
+    float *c = *rowIndex >= 3 ? rows[*rowIndex - 3] : NULL;
+    float *b = *rowIndex >= 2 ? rows[*rowIndex - 2] : NULL;
+    float *a = *rowIndex >= 1 ? rows[*rowIndex - 1] : NULL;
+    float *push = rows[*rowIndex];
+    switch (token->type) {
+        case TOKEN_LITERAL:
+            for (size_t i = 0; i < count; i++) push[i] = token->value;
+            (*rowIndex)++;
+            break;
+        case TOKEN_PI:
+            for (size_t i = 0; i < count; i++) push[i] = M_PI;
+            (*rowIndex)++;
+            break;
+        case TOKEN_E:
+            for (size_t i = 0; i < count; i++) push[i] = M_E;
+            (*rowIndex)++;
+            break;
+        case TOKEN_X:
+        case TOKEN_Y:
+        case TOKEN_Z: {
+            int axis = token->type - TOKEN_X;
+            for (size_t i = 0; i < count; i++) push[i] = points[i][axis];
+            (*rowIndex)++;
+            break;
+        }
+        // For two argument tokens, b is the first argument, and a the second.
+        case TOKEN_ADD:
+            for (size_t i = 0; i < count; i++) b[i] = b[i] + a[i];
+            (*rowIndex)--;
+            break;
+        case TOKEN_SUBTRACT:
+            for (size_t i = 0; i < count; i++) b[i] = b[i] - a[i];
+            (*rowIndex)--;
+            break;
+        case TOKEN_MULTIPLY:
+            for (size_t i = 0; i < count; i++) b[i] = b[i] * a[i];
+            (*rowIndex)--;
+            break;
+        case TOKEN_DIVIDE:
+            for (size_t i = 0; i < count; i++) b[i] = b[i] / a[i];
+            (*rowIndex)--;
+            break;
+        case TOKEN_FLOOR_DIVIDE:
+            for (size_t i = 0; i < count; i++) b[i] = floor(b[i] / a[i]);
+            (*rowIndex)--;
+            break;
+        case TOKEN_MODULO:
+            for (size_t i = 0; i < count; i++) b[i] = remainder(b[i], a[i]);
+            (*rowIndex)--;
+            break;
+        case TOKEN_EXPONENTIATE:
+            for (size_t i = 0; i < count; i++) b[i] = pow(b[i], a[i]);
+            (*rowIndex)--;
+            break;
+        case TOKEN_NEGATE:
+            for (size_t i = 0; i < count; i++) a[i] *= -1;
+            break;
+        case TOKEN_ABS:
+            for (size_t i = 0; i < count; i++) a[i] = fabs(a[i]);
+            break;
+        case TOKEN_MIN:
+            for (size_t i = 0; i < count; i++) b[i] = fmin(b[i], a[i]);
+            (*rowIndex)--;
+            break;
+        case TOKEN_MAX:
+            for (size_t i = 0; i < count; i++) b[i] = fmax(b[i], a[i]);
+            (*rowIndex)--;
+            break;
+        case TOKEN_FLOOR:
+            for (size_t i = 0; i < count; i++) a[i] = floor(a[i]);
+            break;
+        case TOKEN_SIN:
+            for (size_t i = 0; i < count; i++) a[i] = sin(a[i]);
+            break;
+        case TOKEN_COS:
+            for (size_t i = 0; i < count; i++) a[i] = cos(a[i]);
+            break;
+        case TOKEN_TAN:
+            for (size_t i = 0; i < count; i++) a[i] = tan(a[i]);
+            break;
+        case TOKEN_ASIN:
+            for (size_t i = 0; i < count; i++) a[i] = asin(a[i]);
+            break;
+        case TOKEN_ACOS:
+            for (size_t i = 0; i < count; i++) a[i] = acos(a[i]);
+            break;
+        case TOKEN_ATAN:
+            for (size_t i = 0; i < count; i++) a[i] = atan(a[i]);
+            break;
+        case TOKEN_ATAN2:
+            for (size_t i = 0; i < count; i++) b[i] = atan2(b[i], a[i]);
+            (*rowIndex)--;
+            break;
+        case TOKEN_LN:
+            for (size_t i = 0; i < count; i++) a[i] = log(a[i]);
+            break;
+        case TOKEN_LOG:
+            for (size_t i = 0; i < count; i++) b[i] = log(a[i]) / log(b[i]);
+            (*rowIndex)--;
+            break;
+        case TOKEN_SQRT:
+            for (size_t i = 0; i < count; i++) a[i] = sqrt(a[i]);
+            break;
+        case TOKEN_NROOT:
+            for (size_t i = 0; i < count; i++) b[i] = pow(a[i], 1 / b[i]);
+            (*rowIndex)--;
+            break;
+        case TOKEN_NOISE:
+            for (size_t i = 0; i < count; i++) c[i] = noise3(a[i], b[i], c[i]);
+            *rowIndex -= 2;
+            break;
+        default:
+            break;
+    }
+}
+
+void evaluateExpressionBatch(Token *expr, vec3 *points, float *out,
+                             size_t count) {
+    float rows[EVAL_STACK_SIZE][EVAL_BATCH_SIZE];
+    for (size_t start = 0; start < count; start += EVAL_BATCH_SIZE) {
+        size_t blockSize = count - start;
+        if (blockSize > EVAL_BATCH_SIZE) blockSize = EVAL_BATCH_SIZE;
+        size_t rowIndex = 0;
+        for (Token *token = expr; token->type != TOKEN_END; token++) {
+            applyTokenBatch(token, rows, &rowIndex, points + start, blockSize);
+        }
+        memcpy(out + start, rows[0], blockSize * sizeof(float));
+    }
+}
+
+// Rough cost of each token in nanoseconds, when run by the interpreter.
+double getTokenCost(TokenType type) {
+    switch (type) {
+        case TOKEN_DIVIDE:
+        case TOKEN_FLOOR:
+        case TOKEN_FLOOR_DIVIDE:
+        case TOKEN_SQRT:
+            return 3.0;
+        case TOKEN_MODULO:
+            return 8.0;
+        case TOKEN_SIN:
+        case TOKEN_COS:
+        case TOKEN_ATAN:
+        case TOKEN_LN:
+            return 12.0;
+        case TOKEN_TAN:
+        case TOKEN_ASIN:
+        case TOKEN_ACOS:
+        case TOKEN_ATAN2:
+            return 18.0;
+        case TOKEN_EXPONENTIATE:
+        case TOKEN_LOG:
+        case TOKEN_NROOT:
+            return 25.0;
+        case TOKEN_NOISE:
+            return 40.0;
+        default:
+            return 1.0;
+    }
+}
+
+// Whether the batch evaluator's loop for a token can be vectorized, rather
+// than calling into the maths library for each point.
+bool isVectorizable(TokenType type) {
+    switch (type) {
+        case TOKEN_LITERAL:
+        case TOKEN_PI:
+        case TOKEN_E:
+        case TOKEN_X:
+        case TOKEN_Y:
+        case TOKEN_Z:
+        case TOKEN_ADD:
+        case TOKEN_SUBTRACT:
+        case TOKEN_MULTIPLY:
+        case TOKEN_DIVIDE:
+        case TOKEN_NEGATE:
+        case TOKEN_ABS:
+        case TOKEN_MIN:
+        case TOKEN_MAX:
+        case TOKEN_SQRT:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Costs in nanoseconds, roughly calibrated on a desktop x86 machine.
+#define EVALUATION_COST 15.0
+#define INTERPRETER_DISPATCH_COST 3.5
+#define BATCH_VECTOR_WIDTH 2.0
+#define BATCH_SETUP_COST 5000.0
+
+double estimateExpressionCost(Token *expr, ExprBackend backend) {
+    // Fixed cost of each evaluation, such as fetching the point.
+    double cost = EVALUATION_COST;
+    for (Token *token = expr; token->type != TOKEN_END; token++) {
+        double tokenCost = getTokenCost(token->type);
+        if (backend == BACKEND_BATCH) {
+            // Dispatch is paid once per block rather than once per point.
+            if (isVectorizable(token->type)) tokenCost /= BATCH_VECTOR_WIDTH;
+            cost += tokenCost + INTERPRETER_DISPATCH_COST / EVAL_BATCH_SIZE;
+        } else {
+            cost += tokenCost + INTERPRETER_DISPATCH_COST;
+        }
+    }
+    return cost;
+}
+
+double estimateExpressionTime(Token *expr, ExprBackend backend,
+                              double count) {
+    double setupCost = backend == BACKEND_BATCH ? BATCH_SETUP_COST : 0.0;
+    return estimateExpressionCost(expr, backend) * count + setupCost;
+}
+
+ExprBackend chooseExpressionBackend(Token *expr, double count) {
+    double interpreterTime =
+        estimateExpressionTime(expr, BACKEND_INTERPRETER, count);
+    double batchTime = estimateExpressionTime(expr, BACKEND_BATCH, count);
+    return batchTime < interpreterTime ? BACKEND_BATCH : BACKEND_INTERPRETER;
+}
+
+char *getBackendName(ExprBackend backend) {
+    switch (backend) {
+        case BACKEND_INTERPRETER:
+            return "interpreter";
+        case BACKEND_BATCH:
+            return "batch";
+        default:
+            return "auto";
+    }
+}
+
+void optimizeExpression(Token *expr) {
+    size_t outIndex = 0;
+    Token *currentToken = expr;
+    while (currentToken->type != TOKEN_END) {
+        Token token = *currentToken;
+        // Named constants are converted to literals so they can be folded.
+        if (token.type == TOKEN_PI || token.type == TOKEN_E) {
+            float value = token.type == TOKEN_PI ? M_PI : M_E;
+            int position = token.position;
+            token = LITERAL(value);
+            token.position = position;
+        }
+        expr[outIndex++] = token;
+        currentToken++;
+
+        // Values have no operands, every other token takes 1 - stack effect.
+        TokenClass class = getTokenClass(token);
+        if (class == CLASS_VALUE) continue;
+        size_t operandCount = 1 - getTokenStackEffect(token);
+        bool constant = outIndex > operandCount;
+        for (size_t i = 0; constant && i < operandCount; i++) {
+            constant = expr[outIndex - 2 - i].type == TOKEN_LITERAL;
+        }
+        if (!constant) continue;
+
+        // Evaluate the operator on its literal operands, and replace them
+        // all with the result.
+        Token subexpression[operandCount + 2];
+        memcpy(subexpression, &expr[outIndex - operandCount - 1],
+               (operandCount + 1) * sizeof(Token));
+        subexpression[operandCount + 1] = TOKEN(END);
+        vec3 origin = {0.0, 0.0, 0.0};
+        float value = evaluateExpression(subexpression, origin);
+        outIndex -= operandCount + 1;
+        int position = expr[outIndex].position;
+        expr[outIndex] = LITERAL(value);
+        expr[outIndex].position = position;
+        outIndex++;
+    }
+    expr[outIndex] = TOKEN(END);
+}
+
+void pushStackDouble(double *rpnStack, size_t *rpnIndex, double value) {
+    rpnStack[(*rpnIndex)++] = value;
+}
+
+double popStackDouble(double *rpnStack, size_t *rpnIndex) {
+    return rpnStack[--(*rpnIndex)];
+}
+
+// Applies a single token to a double precision stack. Noise is still only
+// computed in single precision, as that is all the noise library offers.
+void applyTokenDouble(Token *token, double *rpnStack, size_t *rpnIndex,
+                      dvec3 point) {
+    APPLY_TOKEN(double, pushStackDouble, popStackDouble)
+}
+
+double evaluateExpressionDouble(Token *expr, dvec3 point) {
+    double rpnStack[EVAL_STACK_SIZE];
+    size_t rpnIndex = 0;
+
+    Token *currentToken = expr;
+    while (currentToken->type != TOKEN_END) {
+        applyTokenDouble(currentToken, rpnStack, &rpnIndex, point);
+        currentToken++;
+    }
+    return popStackDouble(rpnStack, &rpnIndex);
+}
+
+// Step used to differentiate noise, which has no closed form derivative here.
+#define NOISE_DELTA 0.001f
+
+// The body of getTokenPartials and getTokenPartialsDouble, which only differ
+// in the type of their arguments. Expects type, args, result and partials to
+// be in scope. Noise is differentiated in single precision either way.
+#define TOKEN_PARTIALS(TYPE)                                                   \
+    TYPE a = args[0], b = args[1];                                             \
+    switch (type) {                                                            \
+        case TOKEN_ADD:                                                        \
+            partials[0] = 1;                                                   \
+            partials[1] = 1;                                                   \
+            break;                                                             \
+        case TOKEN_SUBTRACT:                                                   \
+            partials[0] = 1;                                                   \
+            partials[1] = -1;                                                  \
+            break;                                                             \
+        case TOKEN_MULTIPLY:                                                   \
+            partials[0] = b;                                                   \
+            partials[1] = a;                                                   \
+            break;                                                             \
+        case TOKEN_DIVIDE:                                                     \
+            partials[0] = 1 / b;                                               \
+            partials[1] = -a / (b * b);                                        \
+            break;                                                             \
+        case TOKEN_MODULO:                                                     \
+            /* remainder(a, b) is a - n * b for the nearest integer n. */      \
+            partials[0] = 1;                                                   \
+            partials[1] = -round((a - result) / b);                            \
+            break;                                                             \
+        case TOKEN_EXPONENTIATE:                                               \
+            partials[0] = b * pow(a, b - 1);                                   \
+            partials[1] = a > 0 ? result * log(a) : 0;                         \
+            break;                                                             \
+        case TOKEN_NEGATE:                                                     \
+            partials[0] = -1;                                                  \
+            break;                                                             \
+        case TOKEN_ABS:                                                        \
+            partials[0] = a < 0 ? -1 : 1;                                      \
+            break;                                                             \
+        case TOKEN_MIN:                                                        \
+        case TOKEN_MAX:                                                        \
+            partials[0] = result == a;                                         \
+            partials[1] = result != a;                                         \
+            break;                                                             \
+        case TOKEN_SIN:                                                        \
+            partials[0] = cos(a);                                              \
+            break;                                                             \
+        case TOKEN_COS:                                                        \
+            partials[0] = -sin(a);                                             \
+            break;                                                             \
+        case TOKEN_TAN:                                                        \
+            partials[0] = 1 / (cos(a) * cos(a));                               \
+            break;                                                             \
+        case TOKEN_ASIN:                                                       \
+            partials[0] = 1 / sqrt(1 - a * a);                                 \
+            break;                                                             \
+        case TOKEN_ACOS:                                                       \
+            partials[0] = -1 / sqrt(1 - a * a);                                \
+            break;                                                             \
+        case TOKEN_ATAN:                                                       \
+            partials[0] = 1 / (1 + a * a);                                     \
+            break;                                                             \
+        case TOKEN_ATAN2:                                                      \
+            /* The arguments are y, then x. */                                 \
+            partials[0] = b / (a * a + b * b);                                 \
+            partials[1] = -a / (a * a + b * b);                                \
+            break;                                                             \
+        case TOKEN_LN:                                                         \
+            partials[0] = 1 / a;                                               \
+            break;                                                             \
+        case TOKEN_LOG:                                                        \
+            /* The arguments are the base, then x. */                          \
+            partials[0] = -result / (a * log(a));                              \
+            partials[1] = 1 / (b * log(a));                                    \
+            break;                                                             \
+        case TOKEN_SQRT:                                                       \
+            partials[0] = 0.5f / result;                                       \
+            break;                                                             \
+        case TOKEN_NROOT:                                                      \
+            /* The arguments are n, then x. */                                 \
+            partials[0] = b > 0 ? -result * log(b) / (a * a) : 0;              \
+            partials[1] = result / (a * b);                                    \
+            break;                                                             \
+        case TOKEN_NOISE:                                                      \
+            /* noise3 takes its arguments in reverse order. */                 \
+            for (int i = 0; i < 3; i++) {                                      \
+                TYPE plus[3] = {args[0], args[1], args[2]};                    \
+                TYPE minus[3] = {args[0], args[1], args[2]};                   \
+                plus[i] += NOISE_DELTA;                                        \
+                minus[i] -= NOISE_DELTA;                                       \
+                partials[i] = (noise3(plus[2], plus[1], plus[0]) -             \
+                               noise3(minus[2], minus[1], minus[0])) /         \
+                              (2 * NOISE_DELTA);                               \
+            }                                                                  \
+            break;                                                             \
+        default:                                                               \
+            /* Floors and constants are flat wherever they are defined. */     \
+            partials[0] = partials[1] = partials[2] = 0;                       \
+            break;                                                             \
+    }
+
+// Finds the partial derivatives of a token with respect to each of its
+// arguments, which are in the order they were pushed, given the result.
+void getTokenPartials(TokenType type, float *args, float result,
+                      float *partials) {
+    TOKEN_PARTIALS(float)
+}
+
+void getTokenPartialsDouble(TokenType type, double *args, double result,
+                            double *partials) {
+    TOKEN_PARTIALS(double)
+}
+
+// Carries the gradients of a token's arguments, which start at base on the
+// gradient stack, through the token by the chain rule, leaving the gradient of
+// its result at base. args holds the argument values, and result the value
+// the token gave.
+void applyTokenGradient(Token *token, float *args, size_t argCount,
+                        float result, vec3 *gradientStack, size_t base) {
+    vec3 gradient = {0, 0, 0};
+    if (token->type >= TOKEN_X && token->type <= TOKEN_Z) {
+        gradient[token->type - TOKEN_X] = 1;
+    } else if (argCount > 0) {
+        float partials[3] = {0, 0, 0};
+        getTokenPartials(token->type, args, result, partials);
+        for (size_t i = 0; i < argCount; i++) {
+            glm_vec3_muladds(gradientStack[base + i], partials[i], gradient);
+        }
+    }
+    glm_vec3_copy(gradient, gradientStack[base]);
+}
+
+float evaluateExpressionGradient(Token *expr, vec3 point, vec3 gradient) {
+    float rpnStack[EVAL_STACK_SIZE];
+    vec3 gradientStack[EVAL_STACK_SIZE];
+    size_t rpnIndex = 0;
+
+    for (Token *token = expr; token->type != TOKEN_END; token++) {
+        // Values are found by applyToken, so they match evaluateExpression
+        // exactly, and gradients follow alongside by the chain rule.
+        size_t argCount = 1 - getTokenStackEffect(*token);
+        size_t base = rpnIndex - argCount;
+        float args[3] = {0, 0, 0};
+        for (size_t i = 0; i < argCount; i++) args[i] = rpnStack[base + i];
+        applyToken(token, rpnStack, &rpnIndex, point);
+        applyTokenGradient(token, args, argCount, rpnStack[base],
+                           gradientStack, base);
+    }
+    glm_vec3_copy(gradientStack[0], gradient);
+    return popStack(rpnStack, &rpnIndex);
+}
+
+void evaluateExpressionGradientBatch(Token *expr, vec3 *points, float *out,
+                                     vec3 *gradients, size_t count) {
+    float rows[EVAL_STACK_SIZE][EVAL_BATCH_SIZE];
+    // Gradients are stored as a row per axis for each stack slot.
+    float gradientRows[EVAL_STACK_SIZE][3][EVAL_BATCH_SIZE];
+    for (size_t start = 0; start < count; start += EVAL_BATCH_SIZE) {
+        size_t blockSize = count - start;
+        if (blockSize > EVAL_BATCH_SIZE) blockSize = EVAL_BATCH_SIZE;
+        size_t rowIndex = 0;
+        for (Token *token = expr; token->type != TOKEN_END; token++) {
+            size_t argCount = 1 - getTokenStackEffect(*token);
+            size_t base = rowIndex - argCount;
+            float args[3][EVAL_BATCH_SIZE];
+            for (size_t i = 0; i < argCount; i++) {
+                memcpy(args[i], rows[base + i], blockSize * sizeof(float));
             }
-            case TOKEN_MULTIPLY: {
-                float b = popStack(rpnStack, &rpnIndex);
-                float a = popStack(rpnStack, &rpnIndex);
-                pushStack(rpnStack, &rpnIndex, a * b);
-                break;
+            applyTokenBatch(token, rows, &rowIndex, points + start,
+                            blockSize);
+
+            float (*result)[EVAL_BATCH_SIZE] = gradientRows[base];
+            if (token->type >= TOKEN_X && token->type <= TOKEN_Z) {
+                for (int axis = 0; axis < 3; axis++) {
+                    float value = token->type - TOKEN_X == axis;
+                    for (size_t j = 0; j < blockSize; j++) {
+                        result[axis][j] = value;
+                    }
+                }
+                continue;
             }
-            case TOKEN_DIVIDE: {
-                float b = popStack(rpnStack, &rpnIndex);
-                float a = popStack(rpnStack, &rpnIndex);
-                pushStack(rpnStack, &rpnIndex, a / b);
-                break;
+            if (argCount == 0) {
+                memset(result, 0, sizeof(gradientRows[base]));
+                continue;
             }
-            case TOKEN_FLOOR_DIVIDE: {
-                float b = popStack(rpnStack, &rpnIndex);
-                float a = popStack(rpnStack, &rpnIndex);
-                pushStack(rpnStack, &rpnIndex, floor(a / b));
-                break;
+            // The sums are taken in the same order as applyTokenGradient, so
+            // the gradients match evaluateExpressionGradient exactly.
+            for (size_t j = 0; j < blockSize; j++) {
+                float pointArgs[3] = {0, 0, 0};
+                float partials[3] = {0, 0, 0};
+                for (size_t i = 0; i < argCount; i++) {
+                    pointArgs[i] = args[i][j];
+                }
+                getTokenPartials(token->type, pointArgs, rows[base][j],
+                                 partials);
+                vec3 gradient = {0, 0, 0};
+                for (size_t i = 0; i < argCount; i++) {
+                    for (int axis = 0; axis < 3; axis++) {
+                        gradient[axis] +=
+                            gradientRows[base + i][axis][j] * partials[i];
+                    }
+                }
+                for (int axis = 0; axis < 3; axis++) {
+                    result[axis][j] = gradient[axis];
+                }
             }
-            case TOKEN_MODULO: {
-                float b = popStack(rpnStack, &rpnIndex);
-                float a = popStack(rpnStack, &rpnIndex);
-                pushStack(rpnStack, &rpnIndex, remainder(a, b));
-                break;
+        }
+        memcpy(out + start, rows[0], blockSize * sizeof(float));
+        for (size_t j = 0; j < blockSize; j++) {
+            for (int axis = 0; axis < 3; axis++) {
+                gradients[start + j][axis] = gradientRows[0][axis][j];
             }
-            case TOKEN_EXPONENTIATE: {
-                float b = popStack(rpnStack, &rpnIndex);
-                float a = popStack(rpnStack, &rpnIndex);
-                pushStack(rpnStack, &rpnIndex, pow(a, b));
-                break;
+        }
+    }
+}
+
+// The same as applyTokenGradient, in double precision.
+void applyTokenGradientDouble(Token *token, double *args, size_t argCount,
+                              double result, dvec3 *gradientStack,
+                              size_t base) {
+    dvec3 gradient = {0, 0, 0};
+    if (token->type >= TOKEN_X && token->type <= TOKEN_Z) {
+        gradient[token->type - TOKEN_X] = 1;
+    } else if (argCount > 0) {
+        double partials[3] = {0, 0, 0};
+        getTokenPartialsDouble(token->type, args, result, partials);
+        for (size_t i = 0; i < argCount; i++) {
+            for (int axis = 0; axis < 3; axis++) {
+                gradient[axis] += gradientStack[base + i][axis] * partials[i];
             }
-            case TOKEN_NEGATE:
-                rpnStack[rpnIndex - 1] *= -1;
-                break;
-            case TOKEN_ABS:
-                rpnStack[rpnIndex - 1] = fabs(rpnStack[rpnIndex - 1]);
-                break;
-            case TOKEN_MIN: {
-                float b = popStack(rpnStack, &rpnIndex);
-                float a = popStack(rpnStack, &rpnIndex);
-                pushStack(rpnStack, &rpnIndex, fmin(a, b));
-                break;
+        }
+    }
+    memcpy(gradientStack[base], gradient, sizeof(dvec3));
+}
+
+double evaluateExpressionGradientDouble(Token *expr, dvec3 point,
+                                        dvec3 gradient) {
+    double rpnStack[EVAL_STACK_SIZE];
+    dvec3 gradientStack[EVAL_STACK_SIZE];
+    size_t rpnIndex = 0;
+
+    for (Token *token = expr; token->type != TOKEN_END; token++) {
+        size_t argCount = 1 - getTokenStackEffect(*token);
+        size_t base = rpnIndex - argCount;
+        double args[3] = {0, 0, 0};
+        for (size_t i = 0; i < argCount; i++) args[i] = rpnStack[base + i];
+        applyTokenDouble(token, rpnStack, &rpnIndex, point);
+        applyTokenGradientDouble(token, args, argCount, rpnStack[base],
+                                 gradientStack, base);
+    }
+    memcpy(gradient, gradientStack[0], sizeof(dvec3));
+    return popStackDouble(rpnStack, &rpnIndex);
+}
+
+// Bound on the magnitude of noise3: each gradient term is at most 2, and the
+// result is scaled by 0.936.
+#define NOISE_BOUND 1.872
+
+Interval makeInterval(double a, double b) {
+    Interval result = {fmin(a, b), fmax(a, b)};
+    // NaN ends mean the operation may not be defined over the whole range.
+    if (isnan(a) || isnan(b)) {
+        result.lo = -INFINITY;
+        result.hi = INFINITY;
+    }
+    return result;
+}
+
+// The smallest interval holding four values, for operations that are
+// monotonic in each argument.
+Interval getCornerInterval(double a, double b, double c, double d) {
+    if (isnan(a) || isnan(b) || isnan(c) || isnan(d)) {
+        return makeInterval(NAN, NAN);
+    }
+    return makeInterval(fmin(fmin(a, b), fmin(c, d)),
+                        fmax(fmax(a, b), fmax(c, d)));
+}
+
+bool containsValue(Interval a, double value) {
+    return a.lo <= value && value <= a.hi;
+}
+
+// Bounds a periodic function with peaks at phase + 2 pi k and troughs half a
+// period later, like sin with phase pi / 2, over an interval.
+Interval getWaveInterval(Interval a, double phase, double low, double high) {
+    if (a.hi - a.lo >= 2 * M_PI || !isfinite(a.lo) || !isfinite(a.hi)) {
+        return makeInterval(-1, 1);
+    }
+    Interval result = makeInterval(low, high);
+    double peak = phase + 2 * M_PI * ceil((a.lo - phase) / (2 * M_PI));
+    if (peak <= a.hi) result.hi = 1;
+    double trough =
+        phase + M_PI + 2 * M_PI * ceil((a.lo - phase - M_PI) / (2 * M_PI));
+    if (trough <= a.hi) result.lo = -1;
+    return result;
+}
+
+Interval getPowerInterval(Interval a, Interval b) {
+    if (a.lo > 0) {
+        // a^b is monotonic in each argument for positive a.
+        return getCornerInterval(pow(a.lo, b.lo), pow(a.lo, b.hi),
+                                 pow(a.hi, b.lo), pow(a.hi, b.hi));
+    }
+    if (b.lo != b.hi || b.lo != floor(b.lo)) return makeInterval(NAN, NAN);
+    // Integer powers of ranges that may be negative.
+    double n = b.lo;
+    Interval result = makeInterval(pow(a.lo, n), pow(a.hi, n));
+    if (n < 0 && containsValue(a, 0)) return makeInterval(NAN, NAN);
+    if (n > 0 && fmod(n, 2) == 0 && containsValue(a, 0)) result.lo = 0;
+    return result;
+}
+
+// Applies a token to intervals, bounding the result of applyToken for any
+// arguments within them.
+Interval applyTokenInterval(TokenType type, Interval *args, vec3 min,
+                            vec3 max) {
+    Interval a = args[0], b = args[1];
+    switch (type) {
+        case TOKEN_X:
+        case TOKEN_Y:
+        case TOKEN_Z:
+            return makeInterval(min[type - TOKEN_X], max[type - TOKEN_X]);
+        case TOKEN_ADD:
+            return makeInterval(a.lo + b.lo, a.hi + b.hi);
+        case TOKEN_SUBTRACT:
+            return makeInterval(a.lo - b.hi, a.hi - b.lo);
+        case TOKEN_MULTIPLY:
+            return getCornerInterval(a.lo * b.lo, a.lo * b.hi, a.hi * b.lo,
+                                     a.hi * b.hi);
+        case TOKEN_DIVIDE:
+        case TOKEN_FLOOR_DIVIDE: {
+            if (containsValue(b, 0)) return makeInterval(NAN, NAN);
+            Interval result = getCornerInterval(
+                a.lo / b.lo, a.lo / b.hi, a.hi / b.lo, a.hi / b.hi);
+            if (type == TOKEN_DIVIDE) return result;
+            return makeInterval(floor(result.lo), floor(result.hi));
+        }
+        case TOKEN_MODULO: {
+            // remainder(a, b) is at most half of b in magnitude.
+            double bound = fmax(fabs(b.lo), fabs(b.hi)) / 2;
+            if (containsValue(b, 0)) return makeInterval(NAN, NAN);
+            return makeInterval(-bound, bound);
+        }
+        case TOKEN_EXPONENTIATE:
+            return getPowerInterval(a, b);
+        case TOKEN_NEGATE:
+            return makeInterval(-a.hi, -a.lo);
+        case TOKEN_ABS:
+            if (a.lo >= 0) return a;
+            if (a.hi <= 0) return makeInterval(-a.hi, -a.lo);
+            return makeInterval(0, fmax(-a.lo, a.hi));
+        case TOKEN_MIN:
+            return makeInterval(fmin(a.lo, b.lo), fmin(a.hi, b.hi));
+        case TOKEN_MAX:
+            return makeInterval(fmax(a.lo, b.lo), fmax(a.hi, b.hi));
+        case TOKEN_FLOOR:
+            return makeInterval(floor(a.lo), floor(a.hi));
+        case TOKEN_SIN:
+            return getWaveInterval(a, M_PI / 2, sin(a.lo), sin(a.hi));
+        case TOKEN_COS:
+            return getWaveInterval(a, 0, cos(a.lo), cos(a.hi));
+        case TOKEN_TAN: {
+            // Poles at pi / 2 + pi k.
+            double pole = M_PI / 2 + M_PI * ceil((a.lo - M_PI / 2) / M_PI);
+            if (pole <= a.hi || !isfinite(a.lo) || !isfinite(a.hi)) {
+                return makeInterval(NAN, NAN);
             }
-            case TOKEN_MAX: {
-                float b = popStack(rpnStack, &rpnIndex);
-                float a = popStack(rpnStack, &rpnIndex);
-                pushStack(rpnStack, &rpnIndex, fmax(a, b));
-                break;
+            return makeInterval(tan(a.lo), tan(a.hi));
+        }
+        case TOKEN_ASIN:
+            return makeInterval(asin(a.lo), asin(a.hi));
+        case TOKEN_ACOS:
+            return makeInterval(acos(a.hi), acos(a.lo));
+        case TOKEN_ATAN:
+            return makeInterval(atan(a.lo), atan(a.hi));
+        case TOKEN_ATAN2:
+            // The arguments are y, then x. Away from the branch cut, atan2 is
+            // monotonic in each argument.
+            if (b.lo > 0) {
+                return getCornerInterval(atan2(a.lo, b.lo), atan2(a.lo, b.hi),
+                                         atan2(a.hi, b.lo), atan2(a.hi, b.hi));
             }
-            case TOKEN_FLOOR:
-                rpnStack[rpnIndex - 1] = floor(rpnStack[rpnIndex - 1]);
-                break;
-            case TOKEN_SIN:
-                rpnStack[rpnIndex - 1] = sin(rpnStack[rpnIndex - 1]);
-                break;
-            case TOKEN_COS:
-                rpnStack[rpnIndex - 1] = cos(rpnStack[rpnIndex - 1]);
-                break;
-            case TOKEN_TAN:
-                rpnStack[rpnIndex - 1] = tan(rpnStack[rpnIndex - 1]);
-                break;
-            case TOKEN_ASIN:
-                rpnStack[rpnIndex - 1] = asin(rpnStack[rpnIndex - 1]);
-                break;
-            case TOKEN_ACOS:
-                rpnStack[rpnIndex - 1] = acos(rpnStack[rpnIndex - 1]);
-                break;
-            case TOKEN_ATAN:
-                rpnStack[rpnIndex - 1] = atan(rpnStack[rpnIndex - 1]);
-                break;
-            case TOKEN_ATAN2: {
-                float x = popStack(rpnStack, &rpnIndex);
-                float y = popStack(rpnStack, &rpnIndex);
-                pushStack(rpnStack, &rpnIndex, atan2(y, x));
-                break;
+            return makeInterval(-M_PI, M_PI);
+        case TOKEN_LN:
+            if (a.lo <= 0) return makeInterval(NAN, NAN);
+            return makeInterval(log(a.lo), log(a.hi));
+        case TOKEN_LOG: {
+            // The arguments are the base, then x.
+            if (a.lo <= 0 || b.lo <= 0) return makeInterval(NAN, NAN);
+            Interval logBase = {log(a.lo), log(a.hi)};
+            if (containsValue(logBase, 0)) return makeInterval(NAN, NAN);
+            return getCornerInterval(
+                log(b.lo) / logBase.lo, log(b.lo) / logBase.hi,
+                log(b.hi) / logBase.lo, log(b.hi) / logBase.hi);
+        }
+        case TOKEN_SQRT:
+            if (a.lo < 0) return makeInterval(NAN, NAN);
+            return makeInterval(sqrt(a.lo), sqrt(a.hi));
+        case TOKEN_NROOT: {
+            // The arguments are n, then x.
+            if (containsValue(a, 0)) return makeInterval(NAN, NAN);
+            Interval exponent =
+                getCornerInterval(1 / a.lo, 1 / a.hi, 1 / a.lo, 1 / a.hi);
+            return getPowerInterval(b, exponent);
+        }
+        case TOKEN_NOISE:
+            for (int i = 0; i < 3; i++) {
+                if (!isfinite(args[i].lo) || !isfinite(args[i].hi)) {
+                    return makeInterval(NAN, NAN);
+                }
             }
-            case TOKEN_LN:
-                rpnStack[rpnIndex - 1] = log(rpnStack[rpnIndex - 1]);
-                break;
-            case TOKEN_LOG: {
-                float x = popStack(rpnStack, &rpnIndex);
-                float base = popStack(rpnStack, &rpnIndex);
-                pushStack(rpnStack, &rpnIndex, log(x) / log(base));
-                break;
+            return makeInterval(-NOISE_BOUND, NOISE_BOUND);
+        default:
+            return makeInterval(NAN, NAN);
+    }
+}
+
+Interval evaluateExpressionInterval(Token *expr, vec3 min, vec3 max) {
+    Interval stack[EVAL_STACK_SIZE];
+    size_t stackIndex = 0;
+    for (Token *token = expr; token->type != TOKEN_END; token++) {
+        if (getTokenClass(*token) == CLASS_VALUE &&
+            (token->type < TOKEN_X || token->type > TOKEN_Z)) {
+            // Constants are found by applyToken, so they match exactly.
+            float value;
+            size_t index = 0;
+            applyToken(token, &value, &index, min);
+            stack[stackIndex++] = makeInterval(value, value);
+            continue;
+        }
+        size_t argCount = 1 - getTokenStackEffect(*token);
+        stackIndex -= argCount;
+        Interval result =
+            applyTokenInterval(token->type, &stack[stackIndex], min, max);
+        stack[stackIndex++] = result;
+    }
+    return stack[0];
+}
+
+// The statistics recorded by one thread. Each thread only touches its own,
+// so evaluations can be profiled in parallel, and they are added together
+// when a report is written.
+typedef struct {
+    unsigned long long evaluations;
+    unsigned long long timedEvaluations;
+    // Indexed by token position in expr.
+    unsigned long long *counts;
+    unsigned long long *cycles;
+    unsigned long long *timedCounts;
+    // Keep each thread's totals on their own cache line.
+    char padding[64];
+} ProfileCounters;
+
+struct ExprProfile {
+    Token *expr;
+    size_t tokenCount;
+    unsigned long long timerOverhead;
+    int threadCount;
+    ProfileCounters *threads;
+    // The counters of every thread added together, for reports.
+    ProfileCounters total;
+};
+
+// A single line of a profile report, either for a token or a TokenType.
+typedef struct {
+    int index;
+    unsigned long long count;
+    double cost;
+} ProfileEntry;
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CYCLE_UNIT "cycles"
+unsigned long long readCycleCounter() { return __rdtsc(); }
+#else
+#define CYCLE_UNIT "ns"
+unsigned long long readCycleCounter() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+#endif
+
+void initProfileCounters(ProfileCounters *counters, size_t tokenCount) {
+    counters->evaluations = 0;
+    counters->timedEvaluations = 0;
+    counters->counts = calloc(tokenCount, sizeof(unsigned long long));
+    counters->cycles = calloc(tokenCount, sizeof(unsigned long long));
+    counters->timedCounts = calloc(tokenCount, sizeof(unsigned long long));
+}
+
+void freeProfileCounters(ProfileCounters *counters) {
+    free(counters->counts);
+    free(counters->cycles);
+    free(counters->timedCounts);
+}
+
+ExprProfile *createExpressionProfile(Token *expr) {
+    ExprProfile *profile = malloc(sizeof(ExprProfile));
+    profile->expr = expr;
+    profile->tokenCount = 0;
+    while (expr[profile->tokenCount].type != TOKEN_END) {
+        profile->tokenCount++;
+    }
+    profile->threadCount = 1;
+    profile->threads = malloc(sizeof(ProfileCounters));
+    initProfileCounters(&profile->threads[0], profile->tokenCount);
+    initProfileCounters(&profile->total, profile->tokenCount);
+
+    // Measure the cost of reading the counter, so it can be subtracted from
+    // each timed token.
+    profile->timerOverhead = ~0ull;
+    for (int i = 0; i < 64; i++) {
+        unsigned long long start = readCycleCounter();
+        unsigned long long elapsed = readCycleCounter() - start;
+        if (elapsed < profile->timerOverhead) profile->timerOverhead = elapsed;
+    }
+    return profile;
+}
+
+void setExpressionProfileThreads(ExprProfile *profile, int threadCount) {
+    if (threadCount <= profile->threadCount) return;
+    profile->threads =
+        realloc(profile->threads, threadCount * sizeof(ProfileCounters));
+    for (int i = profile->threadCount; i < threadCount; i++) {
+        initProfileCounters(&profile->threads[i], profile->tokenCount);
+    }
+    profile->threadCount = threadCount;
+}
+
+// Counts an evaluation on a thread, returning its counters and whether the
+// evaluation is one of those timed.
+ProfileCounters *startProfiledEvaluation(ExprProfile *profile, int thread,
+                                         bool *timed) {
+    ProfileCounters *counters = &profile->threads[thread];
+    *timed = counters->evaluations % PROFILE_SAMPLE_INTERVAL == 0;
+    counters->evaluations++;
+    if (*timed) counters->timedEvaluations++;
+    return counters;
+}
+
+// The body of profileToken and profileTokenDouble, which apply token i of a
+// profiled evaluation with APPLY, counting it, and timing it if the evaluation
+// is timed.
+#define PROFILE_TOKEN(APPLY)                                                   \
+    counters->counts[i]++;                                                     \
+    if (!timed) {                                                              \
+        APPLY(&profile->expr[i], rpnStack, rpnIndex, point);                   \
+        return;                                                                \
+    }                                                                          \
+    unsigned long long start = readCycleCounter();                             \
+    APPLY(&profile->expr[i], rpnStack, rpnIndex, point);                       \
+    unsigned long long elapsed = readCycleCounter() - start;                   \
+    if (elapsed > profile->timerOverhead) {                                    \
+        counters->cycles[i] += elapsed - profile->timerOverhead;               \
+    }                                                                          \
+    counters->timedCounts[i]++;
+
+void profileToken(ExprProfile *profile, ProfileCounters *counters, size_t i,
+                  bool timed, float *rpnStack, size_t *rpnIndex, vec3 point) {
+    PROFILE_TOKEN(applyToken)
+}
+
+void profileTokenDouble(ExprProfile *profile, ProfileCounters *counters,
+                        size_t i, bool timed, double *rpnStack,
+                        size_t *rpnIndex, dvec3 point) {
+    PROFILE_TOKEN(applyTokenDouble)
+}
+
+float evaluateExpressionProfiled(ExprProfile *profile, int thread,
+                                 vec3 point) {
+    float rpnStack[EVAL_STACK_SIZE];
+    size_t rpnIndex = 0;
+
+    bool timed;
+    ProfileCounters *counters =
+        startProfiledEvaluation(profile, thread, &timed);
+    for (size_t i = 0; i < profile->tokenCount; i++) {
+        profileToken(profile, counters, i, timed, rpnStack, &rpnIndex, point);
+    }
+    return popStack(rpnStack, &rpnIndex);
+}
+
+float evaluateExpressionGradientProfiled(ExprProfile *profile, int thread,
+                                         vec3 point, vec3 gradient) {
+    float rpnStack[EVAL_STACK_SIZE];
+    vec3 gradientStack[EVAL_STACK_SIZE];
+    size_t rpnIndex = 0;
+
+    bool timed;
+    ProfileCounters *counters =
+        startProfiledEvaluation(profile, thread, &timed);
+    for (size_t i = 0; i < profile->tokenCount; i++) {
+        Token *token = &profile->expr[i];
+        size_t argCount = 1 - getTokenStackEffect(*token);
+        size_t base = rpnIndex - argCount;
+        float args[3] = {0, 0, 0};
+        for (size_t j = 0; j < argCount; j++) args[j] = rpnStack[base + j];
+        profileToken(profile, counters, i, timed, rpnStack, &rpnIndex, point);
+        applyTokenGradient(token, args, argCount, rpnStack[base],
+                           gradientStack, base);
+    }
+    glm_vec3_copy(gradientStack[0], gradient);
+    return popStack(rpnStack, &rpnIndex);
+}
+
+double evaluateExpressionDoubleProfiled(ExprProfile *profile, int thread,
+                                        dvec3 point) {
+    double rpnStack[EVAL_STACK_SIZE];
+    size_t rpnIndex = 0;
+
+    bool timed;
+    ProfileCounters *counters =
+        startProfiledEvaluation(profile, thread, &timed);
+    for (size_t i = 0; i < profile->tokenCount; i++) {
+        profileTokenDouble(profile, counters, i, timed, rpnStack, &rpnIndex,
+                           point);
+    }
+    return popStackDouble(rpnStack, &rpnIndex);
+}
+
+double evaluateExpressionGradientDoubleProfiled(ExprProfile *profile,
+                                                int thread, dvec3 point,
+                                                dvec3 gradient) {
+    double rpnStack[EVAL_STACK_SIZE];
+    dvec3 gradientStack[EVAL_STACK_SIZE];
+    size_t rpnIndex = 0;
+
+    bool timed;
+    ProfileCounters *counters =
+        startProfiledEvaluation(profile, thread, &timed);
+    for (size_t i = 0; i < profile->tokenCount; i++) {
+        Token *token = &profile->expr[i];
+        size_t argCount = 1 - getTokenStackEffect(*token);
+        size_t base = rpnIndex - argCount;
+        double args[3] = {0, 0, 0};
+        for (size_t j = 0; j < argCount; j++) args[j] = rpnStack[base + j];
+        profileTokenDouble(profile, counters, i, timed, rpnStack, &rpnIndex,
+                           point);
+        applyTokenGradientDouble(token, args, argCount, rpnStack[base],
+                                 gradientStack, base);
+    }
+    memcpy(gradient, gradientStack[0], sizeof(dvec3));
+    return popStackDouble(rpnStack, &rpnIndex);
+}
+
+// Adds the counters of every thread into the profile's total.
+void mergeProfileCounters(ExprProfile *profile) {
+    ProfileCounters *total = &profile->total;
+    total->evaluations = 0;
+    total->timedEvaluations = 0;
+    for (size_t i = 0; i < profile->tokenCount; i++) {
+        total->counts[i] = total->cycles[i] = total->timedCounts[i] = 0;
+    }
+    for (int thread = 0; thread < profile->threadCount; thread++) {
+        ProfileCounters *counters = &profile->threads[thread];
+        total->evaluations += counters->evaluations;
+        total->timedEvaluations += counters->timedEvaluations;
+        for (size_t i = 0; i < profile->tokenCount; i++) {
+            total->counts[i] += counters->counts[i];
+            total->cycles[i] += counters->cycles[i];
+            total->timedCounts[i] += counters->timedCounts[i];
+        }
+    }
+}
+
+int compareProfileEntries(const void *a, const void *b) {
+    double costA = ((ProfileEntry *)a)->cost;
+    double costB = ((ProfileEntry *)b)->cost;
+    return (costA < costB) - (costA > costB);
+}
+
+// Estimates the total cost of each token by scaling its timed cost up to the
+// full number of executions, then sorts them, most expensive first. The
+// counters must have been merged.
+size_t getTokenEntries(ExprProfile *profile, ProfileEntry *entries) {
+    ProfileCounters *total = &profile->total;
+    for (size_t i = 0; i < profile->tokenCount; i++) {
+        entries[i].index = i;
+        entries[i].count = total->counts[i];
+        entries[i].cost = 0.0;
+        if (total->timedCounts[i] > 0) {
+            entries[i].cost = (double)total->cycles[i] /
+                              total->timedCounts[i] * total->counts[i];
+        }
+    }
+    qsort(entries, profile->tokenCount, sizeof(ProfileEntry),
+          compareProfileEntries);
+    return profile->tokenCount;
+}
+
+// Combines token entries by TokenType, most expensive first.
+size_t getTypeEntries(ExprProfile *profile, ProfileEntry *tokenEntries,
+                      ProfileEntry *entries) {
+    size_t entryCount = 0;
+    for (size_t i = 0; i < profile->tokenCount; i++) {
+        TokenType type = profile->expr[tokenEntries[i].index].type;
+        size_t j = 0;
+        while (j < entryCount && entries[j].index != (int)type) j++;
+        if (j == entryCount) {
+            entries[j] = (ProfileEntry){type, 0, 0.0};
+            entryCount++;
+        }
+        entries[j].count += tokenEntries[i].count;
+        entries[j].cost += tokenEntries[i].cost;
+    }
+    qsort(entries, entryCount, sizeof(ProfileEntry), compareProfileEntries);
+    return entryCount;
+}
+
+double getTotalCost(ProfileEntry *entries, size_t entryCount) {
+    double total = 0.0;
+    for (size_t i = 0; i < entryCount; i++) {
+        total += entries[i].cost;
+    }
+    return total > 0.0 ? total : 1.0;
+}
+
+void writeProfileReport(ExprProfile *profile, char *source, FILE *file) {
+    ProfileEntry tokenEntries[profile->tokenCount];
+    ProfileEntry typeEntries[profile->tokenCount];
+    mergeProfileCounters(profile);
+    size_t tokenCount = getTokenEntries(profile, tokenEntries);
+    size_t typeCount = getTypeEntries(profile, tokenEntries, typeEntries);
+    double total = getTotalCost(tokenEntries, tokenCount);
+
+    fprintf(file, "Expression profile: %llu evaluations, %llu timed (%s)\n",
+            profile->total.evaluations, profile->total.timedEvaluations,
+            CYCLE_UNIT);
+    fprintf(file, "\nOperations by estimated cost:\n");
+    for (size_t i = 0; i < typeCount; i++) {
+        fprintf(file, "%3zu. %-8s %12llu calls %14.0f %s %6.2f%%\n", i + 1,
+                getTokenName(typeEntries[i].index), typeEntries[i].count,
+                typeEntries[i].cost, CYCLE_UNIT,
+                100.0 * typeEntries[i].cost / total);
+    }
+    fprintf(file, "\nTokens by estimated cost:\n");
+    for (size_t i = 0; i < tokenCount; i++) {
+        Token *token = &profile->expr[tokenEntries[i].index];
+        fprintf(file, "%3zu. %-8s at %3d %14.0f %s %6.2f%%  %.*s\n", i + 1,
+                getTokenName(token->type), token->position,
+                tokenEntries[i].cost, CYCLE_UNIT,
+                100.0 * tokenEntries[i].cost / total, PROFILE_CONTEXT_LENGTH,
+                source + token->position);
+    }
+}
+
+void writeJSONString(char *str, size_t length, FILE *file) {
+    fputc('"', file);
+    for (size_t i = 0; i < length && str[i] != 0; i++) {
+        if (str[i] == '"' || str[i] == '\\') {
+            fprintf(file, "\\%c", str[i]);
+        } else if ((unsigned char)str[i] < 0x20) {
+            fprintf(file, "\\u%04x", str[i]);
+        } else {
+            fputc(str[i], file);
+        }
+    }
+    fputc('"', file);
+}
+
+void writeProfileReportJSON(ExprProfile *profile, char *source, FILE *file) {
+    ProfileEntry tokenEntries[profile->tokenCount];
+    ProfileEntry typeEntries[profile->tokenCount];
+    mergeProfileCounters(profile);
+    size_t tokenCount = getTokenEntries(profile, tokenEntries);
+    size_t typeCount = getTypeEntries(profile, tokenEntries, typeEntries);
+    double total = getTotalCost(tokenEntries, tokenCount);
+
+    fprintf(file, "{\n  \"source\": ");
+    writeJSONString(source, strlen(source), file);
+    fprintf(file,
+            ",\n  \"evaluations\": %llu,\n  \"timedEvaluations\": %llu,\n"
+            "  \"unit\": \"%s\",\n  \"operations\": [",
+            profile->total.evaluations, profile->total.timedEvaluations,
+            CYCLE_UNIT);
+    for (size_t i = 0; i < typeCount; i++) {
+        fprintf(file,
+                "%s\n    {\"op\": \"%s\", \"count\": %llu, \"cost\": %.0f, "
+                "\"share\": %.4f}",
+                i > 0 ? "," : "", getTokenName(typeEntries[i].index),
+                typeEntries[i].count, typeEntries[i].cost,
+                typeEntries[i].cost / total);
+    }
+    fprintf(file, "\n  ],\n  \"tokens\": [");
+    for (size_t i = 0; i < tokenCount; i++) {
+        Token *token = &profile->expr[tokenEntries[i].index];
+        fprintf(file,
+                "%s\n    {\"op\": \"%s\", \"position\": %d, \"count\": %llu, "
+                "\"cost\": %.0f, \"share\": %.4f, \"context\": ",
+                i > 0 ? "," : "", getTokenName(token->type), token->position,
+                tokenEntries[i].count, tokenEntries[i].cost,
+                tokenEntries[i].cost / total);
+        writeJSONString(source + token->position, PROFILE_CONTEXT_LENGTH, file);
+        fprintf(file, "}");
+    }
+    fprintf(file, "\n  ]\n}\n");
+}
+
+void destroyExpressionProfile(ExprProfile *profile) {
+    for (int thread = 0; thread < profile->threadCount; thread++) {
+        freeProfileCounters(&profile->threads[thread]);
+    }
+    free(profile->threads);
+    freeProfileCounters(&profile->total);
+    free(profile);
+}
+
+// Used while analysing an expression, to track each stack slot.
+typedef struct {
+    unsigned int axes;
+    float lipschitz;
+    bool known;  // Whether the value is a known constant.
+    float value;
+} SlotInfo;
+
+// Scales the Lipschitz bound of an operand by a constant factor. Multiplying
+// by zero gives a constant, so the result is 0 even if the bound is INFINITY,
+// where the product would otherwise be NaN.
+float scaleLipschitzBound(float factor, float lipschitz) {
+    if (factor == 0.0) return 0.0;
+    return fabs(factor) * lipschitz;
+}
+
+// Combine the Lipschitz bounds of an operator's operands. Operators without a
+// bound for non-constant operands give INFINITY.
+float getLipschitzBound(TokenType type, SlotInfo *args, int argCount) {
+    bool constant = true;
+    for (int i = 0; i < argCount; i++) {
+        if (args[i].lipschitz != 0.0) constant = false;
+    }
+    if (constant) return 0.0;
+    SlotInfo a = args[0], b = args[argCount > 1 ? 1 : 0];
+    switch (type) {
+        case TOKEN_ADD:
+        case TOKEN_SUBTRACT:
+            return a.lipschitz + b.lipschitz;
+        case TOKEN_MULTIPLY:
+            if (a.known) return scaleLipschitzBound(a.value, b.lipschitz);
+            if (b.known) return scaleLipschitzBound(b.value, a.lipschitz);
+            return INFINITY;
+        case TOKEN_DIVIDE:
+            if (b.known && b.value != 0.0) return a.lipschitz / fabs(b.value);
+            return INFINITY;
+        case TOKEN_NEGATE:
+        case TOKEN_ABS:
+        case TOKEN_SIN:
+        case TOKEN_COS:
+        case TOKEN_ATAN:
+            return a.lipschitz;
+        case TOKEN_MIN:
+        case TOKEN_MAX:
+            return fmax(a.lipschitz, b.lipschitz);
+        default:
+            return INFINITY;
+    }
+}
+
+ExprInfo analyzeExpression(Token *expr) {
+    SlotInfo slots[EVAL_STACK_SIZE];
+    int slotIndex = 0;
+    ExprInfo info = {0, 0, 0.0};
+    for (Token *token = expr; token->type != TOKEN_END; token++) {
+        TokenClass class = getTokenClass(*token);
+        if (class == CLASS_VALUE) {
+            SlotInfo slot = {0, 0.0, false, 0.0};
+            switch (token->type) {
+                case TOKEN_X:
+                    slot.axes = AXIS_X;
+                    slot.lipschitz = 1.0;
+                    break;
+                case TOKEN_Y:
+                    slot.axes = AXIS_Y;
+                    slot.lipschitz = 1.0;
+                    break;
+                case TOKEN_Z:
+                    slot.axes = AXIS_Z;
+                    slot.lipschitz = 1.0;
+                    break;
+                case TOKEN_PI:
+                    slot.known = true;
+                    slot.value = M_PI;
+                    break;
+                case TOKEN_E:
+                    slot.known = true;
+                    slot.value = M_E;
+                    break;
+                default:
+                    slot.known = true;
+                    slot.value = token->value;
+                    break;
             }
-            case TOKEN_SQRT:
-                rpnStack[rpnIndex - 1] = sqrt(rpnStack[rpnIndex - 1]);
-                break;
-            case TOKEN_NROOT: {
-                float x = popStack(rpnStack, &rpnIndex);
-                float n = popStack(rpnStack, &rpnIndex);
-                pushStack(rpnStack, &rpnIndex, pow(x, 1 / n));
-                break;
+            slots[slotIndex++] = slot;
+        } else {
+            int argCount = 1 - getTokenStackEffect(*token);
+            slotIndex -= argCount;
+            SlotInfo *args = &slots[slotIndex];
+            SlotInfo result = {0, 0.0, false, 0.0};
+            for (int i = 0; i < argCount; i++) {
+                result.axes |= args[i].axes;
             }
-            case TOKEN_NOISE: {
-                float x = popStack(rpnStack, &rpnIndex);
-                float y = popStack(rpnStack, &rpnIndex);
-                float z = popStack(rpnStack, &rpnIndex);
-                pushStack(rpnStack, &rpnIndex, noise3(x, y, z));
-                break;
+            result.lipschitz = getLipschitzBound(token->type, args, argCount);
+            // Constants such as NaN or infinite factors can still leave no
+            // meaningful bound.
+            if (isnan(result.lipschitz)) result.lipschitz = INFINITY;
+            slots[slotIndex++] = result;
+        }
+        if (slotIndex > info.stackDepth) info.stackDepth = slotIndex;
+    }
+    info.axes = slots[0].axes;
+    info.lipschitz = slots[0].lipschitz;
+    return info;
+}
+
+bool expressionInfoEqual(ExprInfo a, ExprInfo b) {
+    bool sameBound = a.lipschitz == b.lipschitz ||
+                     (isnan(a.lipschitz) && isnan(b.lipschitz));
+    return a.stackDepth == b.stackDepth && a.axes == b.axes && sameBound;
+}
+
+typedef struct {
+    char magic[4];
+    uint32_t byteOrder;
+    uint16_t version;
+    uint16_t headerSize;
+    uint32_t instructionCount;
+    uint32_t constantCount;
+    uint32_t stackDepth;
+    uint32_t axes;
+    float lipschitz;
+    uint64_t checksum;  // FNV-1a hash of everything after the header.
+} ProgramHeader;
+
+uint64_t hashBytes(uint64_t hash, const void *data, size_t length) {
+    const unsigned char *bytes = data;
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ bytes[i]) * FNV_PRIME;
+    }
+    return hash;
+}
+
+// Checks a mapped program, and converts it to tokens.
+bool decodeProgram(const unsigned char *data, size_t size, Token *out,
+                   size_t outSize, ExprInfo *info, char *errMsg) {
+    ProgramHeader header;
+    if (size < sizeof(header)) {
+        strcpy(errMsg, "Error: program file is truncated.");
+        return false;
+    }
+    memcpy(&header, data, sizeof(header));
+    if (memcmp(header.magic, PROGRAM_MAGIC, 4) != 0 ||
+        header.byteOrder != PROGRAM_BYTE_ORDER ||
+        header.headerSize != sizeof(header)) {
+        strcpy(errMsg, "Error: not a program file for this platform.");
+        return false;
+    }
+    if (header.version != PROGRAM_VERSION) {
+        sprintf(errMsg, "Error: unsupported program version %d.",
+                header.version);
+        return false;
+    }
+    size_t payloadSize = (size_t)header.instructionCount * sizeof(uint32_t) +
+                         (size_t)header.constantCount * sizeof(float);
+    if (size - sizeof(header) != payloadSize) {
+        strcpy(errMsg, "Error: program file is truncated.");
+        return false;
+    }
+    if ((size_t)header.instructionCount + 1 > outSize) {
+        strcpy(errMsg, "Error: program is too long.");
+        return false;
+    }
+    const unsigned char *payload = data + sizeof(header);
+    if (hashBytes(FNV_OFFSET, payload, payloadSize) != header.checksum) {
+        strcpy(errMsg, "Error: program file is corrupted.");
+        return false;
+    }
+
+    const unsigned char *constants =
+        payload + header.instructionCount * sizeof(uint32_t);
+    for (uint32_t i = 0; i < header.instructionCount; i++) {
+        uint32_t instruction;
+        memcpy(&instruction, payload + i * sizeof(uint32_t), sizeof(uint32_t));
+        Token token = TOKEN(END);
+        token.type = INSTRUCTION_OPCODE(instruction);
+        TokenClass class = getTokenClass(token);
+        if (token.type > TOKEN_NOISE ||
+            (class != CLASS_VALUE && class != CLASS_BINARY_OP &&
+             class != CLASS_UNARY_OP && class != CLASS_FUNCTION)) {
+            strcpy(errMsg, "Error: invalid instruction in program.");
+            return false;
+        }
+        if (token.type == TOKEN_LITERAL) {
+            uint32_t index = INSTRUCTION_CONSTANT(instruction);
+            if (index >= header.constantCount) {
+                strcpy(errMsg, "Error: invalid constant in program.");
+                return false;
             }
-            default:
-                // These tokens should never appear in a parsed expression,
-                // don't need to handle them.
-                break;
+            memcpy(&token.value, constants + index * sizeof(float),
+                   sizeof(float));
         }
-        currentToken++;
+        out[i] = token;
     }
-    return popStack(rpnStack, &rpnIndex);
-}
\ No newline at end of file
+    out[header.instructionCount] = TOKEN(END);
+    if (!validateExpression(out, errMsg)) return false;
+    // The metadata is only trusted if it matches what the program computes.
+    ExprInfo actual = analyzeExpression(out);
+    ExprInfo stored = {header.stackDepth, header.axes, header.lipschitz};
+    if (!expressionInfoEqual(actual, stored)) {
+        strcpy(errMsg, "Error: program metadata does not match.");
+        return false;
+    }
+    if (info) *info = actual;
+    return true;
+}
+
+bool loadExpression(char *path, Token *out, size_t outSize, ExprInfo *info,
+                    char *errMsg) {
+#ifdef HAVE_MMAP
+    int fd = open(path, O_RDONLY);
+    struct stat fileStat;
+    if (fd < 0 || fstat(fd, &fileStat) != 0) {
+        if (fd >= 0) close(fd);
+        strcpy(errMsg, "Error: could not open program file.");
+        return false;
+    }
+    size_t size = fileStat.st_size;
+    if (size == 0) {
+        close(fd);
+        strcpy(errMsg, "Error: program file is truncated.");
+        return false;
+    }
+    void *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        strcpy(errMsg, "Error: could not map program file.");
+        return false;
+    }
+    bool success = decodeProgram(data, size, out, outSize, info, errMsg);
+    munmap(data, size);
+    return success;
+#else
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        strcpy(errMsg, "Error: could not open program file.");
+        return false;
+    }
+    long end = -1;
+    if (fseek(file, 0, SEEK_END) == 0) end = ftell(file);
+    if (end < 0 || fseek(file, 0, SEEK_SET) != 0) {
+        fclose(file);
+        strcpy(errMsg, "Error: could not read program file.");
+        return false;
+    }
+    size_t size = end;
+    unsigned char *data = malloc(size > 0 ? size : 1);
+    if (!data) {
+        fclose(file);
+        strcpy(errMsg, "Error: program file is too large to load.");
+        return false;
+    }
+    bool success = fread(data, 1, size, file) == size &&
+                   decodeProgram(data, size, out, outSize, info, errMsg);
+    if (!success && ferror(file)) {
+        strcpy(errMsg, "Error: could not read program file.");
+    }
+    fclose(file);
+    free(data);
+    return success;
+#endif
+}
+
+bool saveExpression(Token *expr, char *path, char *errMsg) {
+    size_t length = 0;
+    while (expr[length].type != TOKEN_END) length++;
+    uint32_t instructions[length > 0 ? length : 1];
+    float constants[length > 0 ? length : 1];
+    uint32_t constantCount = 0;
+    for (size_t i = 0; i < length; i++) {
+        instructions[i] = expr[i].type;
+        if (expr[i].type != TOKEN_LITERAL) continue;
+        // Identical constants share a slot in the pool.
+        uint32_t index = 0;
+        while (index < constantCount &&
+               memcmp(&constants[index], &expr[i].value, sizeof(float)) != 0) {
+            index++;
+        }
+        if (index == constantCount) constants[constantCount++] = expr[i].value;
+        instructions[i] |= index << 8;
+    }
+
+    ExprInfo info = analyzeExpression(expr);
+    ProgramHeader header = {
+        .magic = PROGRAM_MAGIC,
+        .byteOrder = PROGRAM_BYTE_ORDER,
+        .version = PROGRAM_VERSION,
+        .headerSize = sizeof(ProgramHeader),
+        .instructionCount = length,
+        .constantCount = constantCount,
+        .stackDepth = info.stackDepth,
+        .axes = info.axes,
+        .lipschitz = info.lipschitz,
+    };
+    header.checksum =
+        hashBytes(FNV_OFFSET, instructions, length * sizeof(uint32_t));
+    header.checksum =
+        hashBytes(header.checksum, constants, constantCount * sizeof(float));
+
+    FILE *file = fopen(path, "wb");
+    if (!file) {
+        strcpy(errMsg, "Error: could not open program file for writing.");
+        return false;
+    }
+    bool written =
+        fwrite(&header, sizeof(header), 1, file) == 1 &&
+        fwrite(instructions, sizeof(uint32_t), length, file) == length &&
+        fwrite(constants, sizeof(float), constantCount, file) == constantCount;
+    if (fclose(file) != 0) written = false;
+    if (!written) {
+        strcpy(errMsg, "Error: could not write program file.");
+        return false;
+    }
+
+    // Read the file back, so that a program is never handed on unless it
+    // loads as the same tokens, with the same metadata.
+    Token loaded[length + 1];
+    ExprInfo loadedInfo;
+    if (!loadExpression(path, loaded, length + 1, &loadedInfo, errMsg)) {
+        return false;
+    }
+    bool same = expressionInfoEqual(loadedInfo, info);
+    for (size_t i = 0; same && i < length; i++) {
+        same = loaded[i].type == expr[i].type &&
+               (expr[i].type != TOKEN_LITERAL ||
+                memcmp(&loaded[i].value, &expr[i].value, sizeof(float)) == 0);
+    }
+    if (!same) {
+        strcpy(errMsg, "Error: program file did not read back intact.");
+        return false;
+    }
+    return true;
+}
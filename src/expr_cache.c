@@ -0,0 +1,253 @@
+#include "expr_cache.h"
+#include "expr.h"
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#define MAX_TOKENS 512
+
+struct CompiledExpr {
+    atomic_int refCount;
+    uint64_t programHash;
+    unsigned int options;
+    size_t length;
+    Token *tokens;
+};
+
+// Cache entries are kept in a doubly linked list, most recently used first.
+typedef struct CacheEntry {
+    uint64_t key;
+    unsigned int options;
+    char *text;
+    CompiledExpr *expr;
+    struct CacheEntry *prev, *next;
+} CacheEntry;
+
+struct ExprCache {
+    pthread_mutex_t lock;
+    size_t capacity;
+    size_t size;
+    CacheEntry *head, *tail;
+};
+
+/// Normalizes an expression by trimming it and collapsing runs of whitespace
+/// into single spaces. The tokenizer skips any amount of whitespace, so this
+/// never changes the meaning of an expression.
+void normalizeExpression(char *str, char *out) {
+    size_t outIndex = 0;
+    bool pendingSpace = false;
+    for (char *c = str; *c; c++) {
+        if (*c == ' ' || *c == '\n' || *c == '\t') {
+            pendingSpace = outIndex > 0;
+            continue;
+        }
+        if (pendingSpace) out[outIndex++] = ' ';
+        pendingSpace = false;
+        out[outIndex++] = *c;
+    }
+    out[outIndex] = 0;
+}
+
+// Hash a parsed and optimized program, ignoring source positions, so that
+// expressions which only differ in formatting share a compiled program.
+uint64_t hashProgram(Token *tokens, unsigned int options) {
+    uint64_t hash = hashBytes(FNV_OFFSET, &options, sizeof(options));
+    for (Token *token = tokens; token->type != TOKEN_END; token++) {
+        hash = hashBytes(hash, &token->type, sizeof(token->type));
+        if (token->type == TOKEN_LITERAL) {
+            hash = hashBytes(hash, &token->value, sizeof(token->value));
+        }
+    }
+    return hash;
+}
+
+bool programsEqual(Token *a, Token *b) {
+    for (; a->type != TOKEN_END && b->type != TOKEN_END; a++, b++) {
+        if (a->type != b->type) return false;
+        if (a->type == TOKEN_LITERAL &&
+            memcmp(&a->value, &b->value, sizeof(float)) != 0) {
+            return false;
+        }
+    }
+    return a->type == b->type;
+}
+
+ExprCache *createExpressionCache(size_t capacity) {
+    ExprCache *cache = malloc(sizeof(ExprCache));
+    pthread_mutex_init(&cache->lock, NULL);
+    cache->capacity = capacity;
+    cache->size = 0;
+    cache->head = NULL;
+    cache->tail = NULL;
+    return cache;
+}
+
+void unlinkEntry(ExprCache *cache, CacheEntry *entry) {
+    if (entry->prev) {
+        entry->prev->next = entry->next;
+    } else {
+        cache->head = entry->next;
+    }
+    if (entry->next) {
+        entry->next->prev = entry->prev;
+    } else {
+        cache->tail = entry->prev;
+    }
+}
+
+void pushEntry(ExprCache *cache, CacheEntry *entry) {
+    entry->prev = NULL;
+    entry->next = cache->head;
+    if (cache->head) cache->head->prev = entry;
+    cache->head = entry;
+    if (!cache->tail) cache->tail = entry;
+}
+
+void destroyEntry(CacheEntry *entry) {
+    releaseExpression(entry->expr);
+    free(entry->text);
+    free(entry);
+}
+
+CacheEntry *findEntry(ExprCache *cache, uint64_t key, unsigned int options,
+                      char *text) {
+    for (CacheEntry *entry = cache->head; entry; entry = entry->next) {
+        if (entry->key == key && entry->options == options &&
+            strcmp(entry->text, text) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+// Look for an existing program from a differently formatted expression.
+CompiledExpr *findProgram(ExprCache *cache, uint64_t programHash,
+                          unsigned int options, Token *tokens) {
+    for (CacheEntry *entry = cache->head; entry; entry = entry->next) {
+        CompiledExpr *expr = entry->expr;
+        if (expr->programHash == programHash && expr->options == options &&
+            programsEqual(expr->tokens, tokens)) {
+            return expr;
+        }
+    }
+    return NULL;
+}
+
+CompiledExpr *compileExpression(Token *parsed, uint64_t programHash,
+                                unsigned int options) {
+    CompiledExpr *expr = malloc(sizeof(CompiledExpr));
+    atomic_init(&expr->refCount, 1);
+    expr->programHash = programHash;
+    expr->options = options;
+    expr->length = 0;
+    while (parsed[expr->length].type != TOKEN_END) expr->length++;
+    expr->tokens = malloc((expr->length + 1) * sizeof(Token));
+    memcpy(expr->tokens, parsed, (expr->length + 1) * sizeof(Token));
+    return expr;
+}
+
+CompiledExpr *acquireExpression(ExprCache *cache, char *str,
+                                unsigned int options, char *errMsg) {
+    char text[strlen(str) + 1];
+    normalizeExpression(str, text);
+    uint64_t key = hashBytes(FNV_OFFSET, text, strlen(text));
+
+    pthread_mutex_lock(&cache->lock);
+    CacheEntry *entry = findEntry(cache, key, options, text);
+    if (entry) {
+        unlinkEntry(cache, entry);
+        pushEntry(cache, entry);
+        CompiledExpr *expr = retainExpression(entry->expr);
+        pthread_mutex_unlock(&cache->lock);
+        return expr;
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    // Parsing happens outside the lock, so other threads are not held up.
+    Token parsed[MAX_TOKENS];
+    if (!parseExpression(text, parsed, MAX_TOKENS, errMsg) ||
+        !validateExpression(parsed, errMsg)) {
+        return NULL;
+    }
+    if (options & EXPR_OPTIMIZE) optimizeExpression(parsed);
+    uint64_t programHash = hashProgram(parsed, options);
+
+    pthread_mutex_lock(&cache->lock);
+    // Another thread may have inserted the same expression in the meantime.
+    entry = findEntry(cache, key, options, text);
+    if (entry) {
+        unlinkEntry(cache, entry);
+        pushEntry(cache, entry);
+        CompiledExpr *expr = retainExpression(entry->expr);
+        pthread_mutex_unlock(&cache->lock);
+        return expr;
+    }
+    CompiledExpr *expr = findProgram(cache, programHash, options, parsed);
+    if (expr) {
+        retainExpression(expr);
+    } else {
+        expr = compileExpression(parsed, programHash, options);
+    }
+
+    entry = malloc(sizeof(CacheEntry));
+    entry->key = key;
+    entry->options = options;
+    entry->text = strdup(text);
+    entry->expr = expr;
+    pushEntry(cache, entry);
+    cache->size++;
+    while (cache->size > cache->capacity) {
+        CacheEntry *evicted = cache->tail;
+        unlinkEntry(cache, evicted);
+        destroyEntry(evicted);
+        cache->size--;
+    }
+    retainExpression(expr);
+    pthread_mutex_unlock(&cache->lock);
+    return expr;
+}
+
+CompiledExpr *compileExpressionText(char *str, unsigned int options,
+                                    char *errMsg) {
+    Token parsed[MAX_TOKENS];
+    if (!parseExpression(str, parsed, MAX_TOKENS, errMsg) ||
+        !validateExpression(parsed, errMsg)) {
+        return NULL;
+    }
+    if (options & EXPR_OPTIMIZE) optimizeExpression(parsed);
+    return compileExpression(parsed, hashProgram(parsed, options), options);
+}
+
+CompiledExpr *loadCompiledExpression(char *path, char *errMsg) {
+    Token loaded[MAX_TOKENS];
+    if (!loadExpression(path, loaded, MAX_TOKENS, NULL, errMsg)) return NULL;
+    return compileExpression(loaded, hashProgram(loaded, 0), 0);
+}
+
+CompiledExpr *retainExpression(CompiledExpr *expr) {
+    atomic_fetch_add(&expr->refCount, 1);
+    return expr;
+}
+
+void releaseExpression(CompiledExpr *expr) {
+    if (atomic_fetch_sub(&expr->refCount, 1) == 1) {
+        free(expr->tokens);
+        free(expr);
+    }
+}
+
+Token *getExpressionTokens(CompiledExpr *expr) { return expr->tokens; }
+
+void destroyExpressionCache(ExprCache *cache) {
+    CacheEntry *entry = cache->head;
+    while (entry) {
+        CacheEntry *next = entry->next;
+        destroyEntry(entry);
+        entry = next;
+    }
+    pthread_mutex_destroy(&cache->lock);
+    free(cache);
+}
@@ -0,0 +1,291 @@
+#include "gen_worker.h"
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+// Progressive previews start at this many subdivisions, doubling until the
+// next level would reach the target.
+#define FIRST_LEVEL 16
+#define LAST_COARSE_LEVEL 64
+#define MAX_LEVELS 8
+// Progress is published in thousandths of a level.
+#define PROGRESS_SCALE 1000
+
+struct GenWorker {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    bool stopping;
+    // The next job to run. Each submitted job increments generation, so a
+    // running job whose generation is behind has been superseded.
+    GenJob pending;
+    bool hasPending;
+    bool running;
+    unsigned long generation;
+    // A mesh finished in back, waiting to be taken. Back is not touched again
+    // until it has been, or the job has been superseded, so takeGenResult can
+    // swap the meshes under the lock.
+    bool resultReady;
+    ExprProfile *resultProfile;
+    Mesh *front, *back;
+    // Raised to stop the running job partway through a level, once it has
+    // been superseded. The worker lowers it before starting the next job.
+    atomic_bool cancel;
+    // How far through the current level the running job is, out of
+    // PROGRESS_SCALE.
+    atomic_int progress;
+    // The rest is only used by the worker thread.
+    Generator *gen;
+    int stageDone[STAGE_FACES + 1], stageTotal[STAGE_FACES + 1];
+    // The expression the generator borrows its tokens from, and the target
+    // size of the last job, so that samples kept from its target can be used
+    // by the next job without going through the coarse levels again.
+    CompiledExpr *sdf;
+    int targetSize;
+    bool reachedTarget;
+};
+
+// Drop a job that will not be run to the end, along with what it owns.
+void discardGenJob(GenJob *job) {
+    releaseExpression(job->sdf);
+    if (job->profile) destroyExpressionProfile(job->profile);
+}
+
+// Progress is the share of the layers of every stage that are done, so it
+// only reaches the end once the last faces are.
+void recordGenProgress(void *data, GenStage stage, int done, int total) {
+    GenWorker *worker = data;
+    worker->stageDone[stage] = done;
+    worker->stageTotal[stage] = total;
+    int allDone = 0, allTotal = 0;
+    for (int i = 0; i <= STAGE_FACES; i++) {
+        allDone += worker->stageDone[i];
+        allTotal += worker->stageTotal[i];
+    }
+    atomic_store_explicit(&worker->progress,
+                          (int)((long)allDone * PROGRESS_SCALE / allTotal),
+                          memory_order_relaxed);
+}
+
+void resetGenProgress(GenWorker *worker, int subdivisions) {
+    // Every stage runs over each layer of cells, apart from samples, which
+    // have one more layer.
+    for (int i = 0; i <= STAGE_FACES; i++) {
+        worker->stageDone[i] = 0;
+        worker->stageTotal[i] = subdivisions + (i == STAGE_SAMPLES);
+    }
+    atomic_store_explicit(&worker->progress, 0, memory_order_relaxed);
+}
+
+bool isGenJobSuperseded(GenWorker *worker, unsigned long generation) {
+    pthread_mutex_lock(&worker->lock);
+    bool superseded = worker->generation != generation || worker->stopping;
+    pthread_mutex_unlock(&worker->lock);
+    return superseded;
+}
+
+// Hand a finished mesh over to the main loop, and wait until it has been
+// taken, so that back can be reused. Returns false if the job was superseded
+// instead, in which case the mesh is never shown.
+bool deliverGenResult(GenWorker *worker, unsigned long generation,
+                      ExprProfile *profile) {
+    pthread_mutex_lock(&worker->lock);
+    bool current = worker->generation == generation && !worker->stopping;
+    if (current) {
+        worker->resultReady = true;
+        worker->resultProfile = profile;
+        while (worker->resultReady && worker->generation == generation &&
+               !worker->stopping) {
+            pthread_cond_wait(&worker->changed, &worker->lock);
+        }
+        // A result left behind by a superseded job is withdrawn.
+        current = !worker->resultReady;
+        worker->resultReady = false;
+        worker->resultProfile = NULL;
+    }
+    pthread_mutex_unlock(&worker->lock);
+    return current;
+}
+
+void applyGenJob(GenWorker *worker, GenJob *job) {
+    Generator *gen = worker->gen;
+    // The samples only depend on the SDF and the grid, and the generator
+    // follows pans of the window itself.
+    bool sameSamples =
+        job->sdf == worker->sdf && job->subdivisions == worker->targetSize;
+    setGeneratorSDF(gen, getExpressionTokens(job->sdf));
+    if (worker->sdf) releaseExpression(worker->sdf);
+    worker->sdf = job->sdf;
+    setGeneratorWindow(gen, job->window);
+    setGeneratorThreshold(gen, job->threshold);
+    setGeneratorPrecision(gen, job->precision);
+    setGeneratorNormals(gen, job->normalMode);
+    setGeneratorBackend(gen, job->backend);
+    setGeneratorStreaming(gen, job->streaming);
+    setGeneratorSimplification(gen, job->simplifyTolerance);
+    setGeneratorCulling(gen, job->culling);
+    setGeneratorNarrowBand(gen, job->bandMargin);
+    setGeneratorProgressive(gen, job->progressive);
+    // Samples left by the levels of the last job are dropped unless they can
+    // still be used.
+    if (!sameSamples) {
+        resetGeneratorSamples(gen);
+        worker->reachedTarget = false;
+    }
+    worker->targetSize = job->subdivisions;
+}
+
+void runGenJob(GenWorker *worker, GenJob *job, unsigned long generation) {
+    applyGenJob(worker, job);
+    // If the target's samples can still be used, only the target is needed.
+    bool targetKept =
+        worker->reachedTarget && hasGeneratorKeptSamples(worker->gen);
+    int levelSizes[MAX_LEVELS];
+    int levelCount = 0;
+    if (job->progressive && !job->profile && !targetKept) {
+        for (int size = FIRST_LEVEL;
+             size <= LAST_COARSE_LEVEL && size < job->subdivisions;
+             size *= 2) {
+            levelSizes[levelCount++] = size;
+        }
+    }
+    levelSizes[levelCount++] = job->subdivisions;
+    worker->reachedTarget = false;
+
+    for (int level = 0; level < levelCount; level++) {
+        if (isGenJobSuperseded(worker, generation)) break;
+        bool target = level == levelCount - 1;
+        resetGenProgress(worker, levelSizes[level]);
+        setGeneratorSize(worker->gen, levelSizes[level]);
+        // The guide can lose thin features, so the target is sampled in
+        // full, matching the mesh of a job without levels.
+        setGeneratorPreview(worker->gen, !target);
+        if (target) setGeneratorProfile(worker->gen, job->profile);
+        GenStatus status =
+            generateMesh(worker->gen, worker->back, job->invertNormals);
+        setGeneratorProfile(worker->gen, NULL);
+        // A cancelled level leaves nothing worth showing.
+        if (status == GEN_CANCELLED ||
+            isGenJobSuperseded(worker, generation)) {
+            break;
+        }
+        worker->reachedTarget = target;
+        // The mesh is handed over even if generateMesh left it unchanged, as
+        // back may hold a mesh that was never shown.
+        if (deliverGenResult(worker, generation,
+                             target ? job->profile : NULL)) {
+            if (target) job->profile = NULL;
+        } else {
+            break;
+        }
+    }
+    if (job->profile) destroyExpressionProfile(job->profile);
+}
+
+void *genWorkerMain(void *arg) {
+    GenWorker *worker = arg;
+    pthread_mutex_lock(&worker->lock);
+    while (true) {
+        while (!worker->stopping && !worker->hasPending) {
+            pthread_cond_wait(&worker->changed, &worker->lock);
+        }
+        if (worker->stopping) break;
+        GenJob job = worker->pending;
+        worker->hasPending = false;
+        worker->running = true;
+        atomic_store(&worker->cancel, false);
+        unsigned long generation = worker->generation;
+        pthread_mutex_unlock(&worker->lock);
+
+        // The expression now belongs to the generator, which keeps it until
+        // the next job's expression replaces it.
+        runGenJob(worker, &job, generation);
+
+        pthread_mutex_lock(&worker->lock);
+        worker->running = false;
+    }
+    pthread_mutex_unlock(&worker->lock);
+    return NULL;
+}
+
+GenWorker *createGenWorker(Mesh *front, Mesh *back) {
+    GenWorker *worker = malloc(sizeof(GenWorker));
+    pthread_mutex_init(&worker->lock, NULL);
+    pthread_cond_init(&worker->changed, NULL);
+    worker->stopping = false;
+    atomic_init(&worker->cancel, false);
+    atomic_init(&worker->progress, 0);
+    worker->gen = createGenerator();
+    setGeneratorProgress(worker->gen, recordGenProgress, worker);
+    setGeneratorCancel(worker->gen, &worker->cancel);
+    worker->front = front;
+    worker->back = back;
+    worker->hasPending = false;
+    worker->running = false;
+    worker->generation = 0;
+    worker->resultReady = false;
+    worker->resultProfile = NULL;
+    worker->sdf = NULL;
+    worker->targetSize = 0;
+    worker->reachedTarget = false;
+    pthread_create(&worker->thread, NULL, genWorkerMain, worker);
+    return worker;
+}
+
+void submitGenJob(GenWorker *worker, GenJob job) {
+    pthread_mutex_lock(&worker->lock);
+    if (worker->hasPending) discardGenJob(&worker->pending);
+    worker->pending = job;
+    worker->hasPending = true;
+    worker->generation++;
+    if (worker->running) atomic_store(&worker->cancel, true);
+    pthread_cond_broadcast(&worker->changed);
+    pthread_mutex_unlock(&worker->lock);
+}
+
+bool takeGenResult(GenWorker *worker, Mesh **mesh, ExprProfile **profile) {
+    pthread_mutex_lock(&worker->lock);
+    bool ready = worker->resultReady;
+    if (ready) {
+        Mesh *finished = worker->back;
+        worker->back = worker->front;
+        worker->front = finished;
+        *mesh = finished;
+        *profile = worker->resultProfile;
+        worker->resultReady = false;
+        worker->resultProfile = NULL;
+        pthread_cond_broadcast(&worker->changed);
+    }
+    pthread_mutex_unlock(&worker->lock);
+    return ready;
+}
+
+bool isGenWorkerBusy(GenWorker *worker) {
+    pthread_mutex_lock(&worker->lock);
+    bool busy = worker->running || worker->hasPending;
+    pthread_mutex_unlock(&worker->lock);
+    return busy;
+}
+
+float getGenWorkerProgress(GenWorker *worker) {
+    return (float)atomic_load_explicit(&worker->progress,
+                                       memory_order_relaxed) /
+           PROGRESS_SCALE;
+}
+
+void destroyGenWorker(GenWorker *worker) {
+    pthread_mutex_lock(&worker->lock);
+    worker->stopping = true;
+    atomic_store(&worker->cancel, true);
+    pthread_cond_broadcast(&worker->changed);
+    pthread_mutex_unlock(&worker->lock);
+    pthread_join(worker->thread, NULL);
+    if (worker->hasPending) discardGenJob(&worker->pending);
+    destroyGenerator(worker->gen);
+    if (worker->sdf) releaseExpression(worker->sdf);
+    pthread_cond_destroy(&worker->changed);
+    pthread_mutex_destroy(&worker->lock);
+    free(worker);
+}
@@ -1,268 +1,1654 @@
 #include "generator.h"
 #include "expr.h"
 #include "mesh.h"
+#include "thread_pool.h"
 
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <cglm/cglm.h>
 
 #define VEC_DELTA 0.01
-#define STEP_SIZE 0.3
-#define MASS_BIAS 0.1
-#define MIN_MOVE_FRAC (1.0 / 20.0)
-#define ZERO_TOLERANCE 0.001
+// Singular values of a cell's QEF below this fraction of the largest are
+// treated as zero, so the vertex stays at the mass point along those
+// directions. The eigenvalues of ata are the squares of the singular values.
+#define QEF_TRUNCATION 0.1
+// Jacobi sweeps used to diagonalise a QEF, plenty for a 3x3 matrix.
+#define QEF_SWEEPS 5
+// Vertices may be this fraction of a cell outside it, as intersections are
+// only found in float precision. Points of the cell whose errors are within
+// this fraction of a cell squared count as equally good.
+#define QEF_BOX_TOLERANCE 1e-6
+// Edge, vertex and face tasks cover this many rows of cells in one layer.
+#define TILE_ROWS 4
+// Edges and vertices are only kept for the layers the pipeline is working
+// on, in rings indexed by z modulo these depths.
+#define EDGE_LAYERS 2
+#define VERTEX_LAYERS 2
+// Layers are sampled this far ahead of the edges being found, so that
+// sampled normals can take central differences across the layer above.
+#define SAMPLE_LOOKAHEAD 2
+// In streaming mode, samples are kept in a ring of this many layers too. The
+// edges of a layer need the samples of the layer below it and the two above.
+#define STREAM_SAMPLE_LAYERS 4
+// Culled sampling works on cubic blocks of at least CULL_BLOCK samples, with
+// at most CULL_MAX_BLOCKS of them along each axis.
+#define CULL_BLOCK 8
+#define CULL_MAX_BLOCKS 128
+// Blocks are only culled if the samples within this many of them are on the
+// same side too, so that no crossing edge, nor the samples around one that
+// sampled normals read, ever needs a culled value.
+#define CULL_MARGIN 2
+// Bounds must clear the threshold by this fraction of their magnitude, to
+// allow for rounding in float evaluations.
+#define CULL_TOLERANCE 1e-4
+// The narrow band is found from a coarse grid of every NARROW_STRIDE-th
+// sample, which also sets the size of the blocks it culls.
+#define NARROW_STRIDE 4
+// A guide only bounds the slope of the field between its own samples, so the
+// margin it implies is widened by this factor.
+#define GUIDE_SAFETY 2.0f
+// Samples are kept when the window moves by this close to a whole number of
+// cells, and its size changes by less than this fraction of a cell. The grid
+// then stays on the cells of the samples, so it can be off the window by up
+// to this fraction of a cell.
+#define SHIFT_TOLERANCE 1e-3
+// Vertex tasks cover this many active cells.
+#define CELL_CHUNK 32
+// Crossing edges are refined this many at a time.
+#define EDGE_BATCH 256
+// Samples and coarse samples are evaluated this many at a time, so that the
+// points fit on the small stacks of worker threads.
+#define SAMPLE_BATCH 256
+// Edge searches stop once a step moves less than this fraction of a cell, or
+// after this many evaluations.
+#define EDGE_TOLERANCE 0.001f
+#define EDGE_ITERATIONS 8
 
 typedef enum { INTERSECT_POS, INTERSECT_NEG, INTERSECT_NONE } IntersectType;
+typedef enum { DIR_X, DIR_Y, DIR_Z } EdgeDir;
+
+// Hermite data for an edge that crosses the surface. Edges that don't cross
+// are never stored.
 typedef struct {
+    int x;
+    EdgeDir dir;
     IntersectType intersectType;
     vec3 position;
     vec3 normal;
 } Edge;
 
+// The crossing edges of one band of rows in a layer, in the order they were
+// found, which is ordered by row, then x, then direction. Row r of the band
+// holds edges[rowStart[r]] up to edges[rowStart[r + 1]].
+typedef struct {
+    Edge *edges;
+    size_t count;
+    size_t capacity;
+    size_t rowStart[TILE_ROWS + 1];
+} EdgeBand;
+
+// A range of edges in one row, scanned along with the cells using it.
+typedef struct {
+    Edge *begin;
+    Edge *end;
+} EdgeRow;
+
+// The corners of a cell are numbered with their x, y and z offsets as bits
+// 0, 1 and 2, so the corners along x are found in one row of samples, and
+// the four rows (y, z), (y + 1, z), (y, z + 1) and (y + 1, z + 1) hold
+// corners 0-1, 2-3, 4-5 and 6-7. A cell's configuration has one bit per
+// corner, set if that corner is above the threshold.
+typedef struct {
+    EdgeDir dir;
+    int cornerA, cornerB;
+} CellEdge;
+
+// A cell with corners on both sides of the surface, which may need a vertex.
+typedef struct {
+    int x, y;
+    int config;
+    int node;  // The cell's leaf in the octree, when simplifying.
+} ActiveCell;
+
+// The edges of a cell, in the order their intersections are gathered.
+const CellEdge CELL_EDGES[12] = {
+    {DIR_X, 0, 1}, {DIR_X, 4, 5}, {DIR_X, 2, 3}, {DIR_X, 6, 7},
+    {DIR_Y, 0, 2}, {DIR_Y, 4, 6}, {DIR_Y, 1, 3}, {DIR_Y, 5, 7},
+    {DIR_Z, 0, 4}, {DIR_Z, 2, 6}, {DIR_Z, 1, 5}, {DIR_Z, 3, 7},
+};
+
 typedef struct {
     Edge *intersections[12];
     int intersectionCount;
-    vec3 massPoint;
 } Cell;
 
-typedef enum { DIR_X, DIR_Y, DIR_Z } EdgeDir;
+// Quadratic error function of a cell, the sum of squared distances to the
+// planes of its intersections. It is built relative to the mass point of the
+// intersections, in double precision so that it stays well conditioned.
+typedef struct {
+    double ata[3][3];
+    double atb[3];
+    double btb;
+    dvec3 massPoint;
+    int count;  // Number of intersections.
+} Qef;
+
+// A node of the octree built when simplifying. Leaves are the active cells of
+// the grid, and collapsed nodes stand in for all of the cells below them.
+// Both have the signs of their corners and a vertex, and are treated alike
+// when building faces.
+typedef struct {
+    int x, y, z;  // Lowest corner, in cells.
+    int size;
+    int children[8];  // Indexed like corners, -1 where a child is empty.
+    bool leaf;        // A leaf cell or a collapsed node.
+    int config;
+    Qef qef;
+    vec3 vertex;
+} OctreeNode;
 
 struct Generator {
     int subdivisions;  // Number of cells in each axis.
     Window window;
     Token *sdfExpr;
     float threshold;
+    Precision precision;
+    NormalMode normalMode;
+    ExprProfile *profile;
+    ExprBackend backend;
+    bool verbose;
+    bool streaming;
+    bool culling;
+    float bandMargin;  // The narrow band is used when this is above 0.
+    bool progressive;
+    bool preview;  // Whether the guide may be used for this mesh.
+    float simplifyTolerance;
+    ThreadPool *pool;
+    int sampleLayers;  // Number of layers of samples kept in memory.
     float *samples;
-    Edge *edges;
+    // Sign bits for each sample, packed 64 to a word, signWords to a row.
+    int signWords;
+    uint64_t *signs;
+    // For each block of samples when culling, the value its samples are
+    // filled with, or NaN if they must be evaluated.
+    int cullBlockSize;
+    int cullBlocks;  // Number of blocks along each axis.
+    float *blockFill;
+    bool blocksCulled;  // Whether blockFill is in use for this mesh.
+    // With the narrow band, the samples at the corners of every block, and
+    // for each block the side of the threshold they are all on, or 0 if the
+    // block is in the band.
+    float *coarseSamples;
+    signed char *blockSides;
+    // Unless streaming, the samples of the last mesh are kept for the next
+    // while the window only moves by whole cells: along each axis, those from
+    // keptLo to keptHi, which were keptShift cells further along when they
+    // were sampled. keptFill is the block fill they were sampled with, if
+    // keptCulled, as filled samples cannot be reused outside culled blocks.
+    bool samplesKept;
+    int keptLo[3], keptHi[3], keptShift[3];
+    float *keptFill;
+    bool keptCulled;
+    // Samples are placed gridShift cells along from the window grid, which is
+    // the window when samples were last taken afresh, so that a sample moved
+    // with the window is at exactly the position it would be sampled at.
+    Window grid;
+    int gridShift[3];
+    // When progressive, the complete samples of the last, coarser mesh, which
+    // guide the narrow band of the next. guideSubdivisions is 0 without one.
+    float *guideSamples;
+    int guideSubdivisions;
+    Window guideWindow;
+    // Whether anything the mesh depends on has changed since it was last
+    // generated into lastMesh, apart from invertNormals, which only changes
+    // its winding.
+    bool meshDirty;
+    Mesh *lastMesh;
+    bool lastInvertNormals;
+    ProgressFunction progress;
+    void *progressData;
+    atomic_bool *cancel;
+    int bandCount;  // Number of bands in each layer of edgeBands.
+    EdgeBand *edgeBands;
+    // The active cells of the layer being worked on, in scan order.
+    ActiveCell *activeCells;
+    size_t activeCellCapacity;
     vec3 *vertices;
+    // The octree of the grid when simplifying, with the root at index 0.
+    int octreeSize;
+    OctreeNode *octreeNodes;
+    size_t octreeNodeCount;
+    size_t octreeNodeCapacity;
 };
 
 Generator *createGenerator() {
     Generator *gen = malloc(sizeof(Generator));
+    gen->subdivisions = 0;
+    gen->precision = PRECISION_FLOAT;
+    gen->normalMode = NORMALS_EVALUATED;
+    gen->profile = NULL;
+    gen->backend = BACKEND_AUTO;
+    gen->verbose = false;
+    gen->streaming = false;
+    gen->culling = true;
+    gen->bandMargin = 0.0;
+    gen->progressive = false;
+    gen->preview = false;
+    gen->simplifyTolerance = 0.0;
+    gen->pool = createThreadPool(0);
     gen->samples = NULL;
-    gen->edges = NULL;
+    gen->signs = NULL;
+    gen->blockFill = NULL;
+    gen->coarseSamples = NULL;
+    gen->blockSides = NULL;
+    gen->samplesKept = false;
+    gen->keptFill = NULL;
+    for (int axis = 0; axis < 3; axis++) gen->gridShift[axis] = 0;
+    gen->guideSamples = NULL;
+    gen->guideSubdivisions = 0;
+    gen->meshDirty = true;
+    gen->lastMesh = NULL;
+    gen->progress = NULL;
+    gen->progressData = NULL;
+    gen->cancel = NULL;
+    gen->bandCount = 0;
+    gen->edgeBands = NULL;
+    gen->activeCells = NULL;
+    gen->activeCellCapacity = 0;
     gen->vertices = NULL;
+    gen->octreeNodes = NULL;
+    gen->octreeNodeCount = 0;
+    gen->octreeNodeCapacity = 0;
     return gen;
 }
 
-void setGeneratorSize(Generator *gen, int subdivisions) {
-    if (subdivisions == gen->subdivisions) return;
-    gen->subdivisions = subdivisions;
+// Each layer of cells is split into bands of TILE_ROWS rows.
+int getBandCount(Generator *gen) {
+    return (gen->subdivisions + TILE_ROWS - 1) / TILE_ROWS;
+}
+
+void getBandRows(Generator *gen, int band, int *yStart, int *yEnd) {
+    *yStart = band * TILE_ROWS;
+    *yEnd = *yStart + TILE_ROWS;
+    if (*yEnd > gen->subdivisions) *yEnd = gen->subdivisions;
+}
+
+void freeEdgeBands(Generator *gen) {
+    for (int i = 0; i < gen->bandCount * EDGE_LAYERS; i++) {
+        free(gen->edgeBands[i].edges);
+    }
+    free(gen->edgeBands);
+}
+
+void allocateBuffers(Generator *gen) {
+    size_t subdivisions = gen->subdivisions;
     // subdivisions is the number of cells, and there must be samples on all
-    // vertices of each cell.
-    // Required memory: (subdivisions + 1)^3 floats.
-    int sampleSide = subdivisions + 1;
-    int sampleMem = sampleSide * sampleSide * sampleSide * sizeof(float);
+    // vertices of each cell. Unless streaming, every layer is kept.
+    // Required memory: (subdivisions + 1)^2 * sampleLayers floats.
+    size_t sampleSide = subdivisions + 1;
+    gen->sampleLayers = gen->streaming ? STREAM_SAMPLE_LAYERS : sampleSide;
+    size_t sampleMem =
+        sampleSide * sampleSide * gen->sampleLayers * sizeof(float);
     gen->samples = realloc(gen->samples, sampleMem);
-    // For each sample point, up to three edges may be present.
-    // Required memory: (subdivisions + 1)^3 * 3 Edges.
-    int edgeMem = sampleSide * sampleSide * sampleSide * sizeof(Edge) * 3;
-    gen->edges = realloc(gen->edges, edgeMem);
-    // The cube is subdivided in each axis into [subdivisions] cells.
-    // Required memory: subdivisions^3 vec3s.
-    int vertexMem = subdivisions * subdivisions * subdivisions * sizeof(vec3);
+    gen->samplesKept = false;
+    // Each sample also has a sign bit, with rows padded to whole words.
+    // Required memory: (subdivisions + 1) * sampleLayers * signWords words.
+    gen->signWords = (sampleSide + 63) / 64;
+    size_t signMem =
+        sampleSide * gen->sampleLayers * gen->signWords * sizeof(uint64_t);
+    gen->signs = realloc(gen->signs, signMem);
+    // Culling blocks are kept for the whole grid, but there are few of them.
+    // Required memory: cullBlocks^3 floats.
+    bool narrowBand = gen->bandMargin > 0 || gen->progressive;
+    int minBlockSize = narrowBand ? NARROW_STRIDE : CULL_BLOCK;
+    gen->cullBlockSize = (sampleSide + CULL_MAX_BLOCKS - 1) / CULL_MAX_BLOCKS;
+    if (gen->cullBlockSize < minBlockSize) gen->cullBlockSize = minBlockSize;
+    // Narrow band blocks are a power of two, so that the samples of coarser
+    // grids, which guides come from, line up with them.
+    while (narrowBand && (gen->cullBlockSize & (gen->cullBlockSize - 1))) {
+        gen->cullBlockSize++;
+    }
+    gen->cullBlocks =
+        (sampleSide + gen->cullBlockSize - 1) / gen->cullBlockSize;
+    size_t blockCount =
+        (size_t)gen->cullBlocks * gen->cullBlocks * gen->cullBlocks;
+    gen->blockFill = realloc(gen->blockFill, blockCount * sizeof(float));
+    gen->keptFill = realloc(gen->keptFill, blockCount * sizeof(float));
+    // The narrow band also needs the coarse grid, with a sample at each
+    // corner of each block, and the side of each block.
+    // Required memory: (cullBlocks + 1)^3 floats and cullBlocks^3 bytes.
+    free(gen->coarseSamples);
+    free(gen->blockSides);
+    gen->coarseSamples = NULL;
+    gen->blockSides = NULL;
+    if (narrowBand) {
+        size_t coarseSide = gen->cullBlocks + 1;
+        gen->coarseSamples =
+            malloc(coarseSide * coarseSide * coarseSide * sizeof(float));
+        gen->blockSides = malloc(blockCount);
+    }
+    // Only edges crossing the surface are stored, in lists for each band
+    // which grow as needed. Only EDGE_LAYERS layers of them are kept at once.
+    freeEdgeBands(gen);
+    gen->bandCount = getBandCount(gen);
+    gen->edgeBands = calloc(gen->bandCount * EDGE_LAYERS, sizeof(EdgeBand));
+    // The cube is subdivided in each axis into [subdivisions] cells, with
+    // VERTEX_LAYERS layers of their vertices kept at once.
+    // Required memory: subdivisions^2 * VERTEX_LAYERS vec3s.
+    size_t vertexMem =
+        subdivisions * subdivisions * VERTEX_LAYERS * sizeof(vec3);
     gen->vertices = realloc(gen->vertices, vertexMem);
 }
 
-void setGeneratorWindow(Generator *gen, Window window) { gen->window = window; }
+// Whether samples are kept from the last mesh for the whole grid, unmoved,
+// and exactly on the window.
+bool areSamplesComplete(Generator *gen) {
+    if (!gen->samplesKept ||
+        memcmp(&gen->grid, &gen->window, sizeof(Window)) != 0) {
+        return false;
+    }
+    for (int axis = 0; axis < 3; axis++) {
+        if (gen->gridShift[axis] != 0 || gen->keptLo[axis] != 0 ||
+            gen->keptHi[axis] != gen->subdivisions + 1) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool isRowKept(Generator *gen, int y, int z) {
+    return gen->samplesKept && y >= gen->keptLo[1] && y < gen->keptHi[1] &&
+           z >= gen->keptLo[2] && z < gen->keptHi[2];
+}
+
+// Whether a sample in a kept row can be reused, which it can unless it was
+// filled in by culling.
+bool isSampleKept(Generator *gen, int x, int y, int z) {
+    if (x < gen->keptLo[0] || x >= gen->keptHi[0]) return false;
+    if (!gen->keptCulled) return true;
+    int size = gen->cullBlockSize, blocks = gen->cullBlocks;
+    x += gen->keptShift[0];
+    y += gen->keptShift[1];
+    z += gen->keptShift[2];
+    return isnan(
+        gen->keptFill[((size_t)(z / size) * blocks + y / size) * blocks +
+                      x / size]);
+}
 
-void setGeneratorSDF(Generator *gen, Token *expr) { gen->sdfExpr = expr; }
+// Moves the kept samples to follow the window, if it has only moved by whole
+// cells of the grid, and otherwise stops keeping them.
+void keepShiftedSamples(Generator *gen, Window window) {
+    int shift[3];
+    for (int axis = 0; axis < 3; axis++) {
+        float extent = gen->grid.max[axis] - gen->grid.min[axis];
+        float newExtent = window.max[axis] - window.min[axis];
+        // A flat (or NaN) window has no cells to shift by.
+        if (!(extent > 0)) {
+            gen->samplesKept = false;
+            return;
+        }
+        // The shift is measured from the grid rather than the last window,
+        // so that rounding does not build up over many moves.
+        double cells = (window.min[axis] - gen->grid.min[axis]) /
+                       (double)extent * gen->subdivisions;
+        long total = lround(cells);
+        shift[axis] = total - gen->gridShift[axis];
+        if (fabs(cells - total) > SHIFT_TOLERANCE ||
+            fabsf(newExtent - extent) > SHIFT_TOLERANCE * fabsf(extent) /
+                                            gen->subdivisions) {
+            gen->samplesKept = false;
+            return;
+        }
+        gen->keptLo[axis] -= shift[axis];
+        gen->keptHi[axis] -= shift[axis];
+        if (gen->keptLo[axis] < 0) gen->keptLo[axis] = 0;
+        if (gen->keptHi[axis] > gen->subdivisions + 1) {
+            gen->keptHi[axis] = gen->subdivisions + 1;
+        }
+        if (gen->keptLo[axis] >= gen->keptHi[axis]) {
+            gen->samplesKept = false;
+            return;
+        }
+        gen->keptShift[axis] += shift[axis];
+    }
+    for (int axis = 0; axis < 3; axis++) {
+        gen->gridShift[axis] += shift[axis];
+    }
+    // Each kept sample moves from x + shift to x. Layers and rows are visited
+    // in the order that reads each before it is overwritten.
+    int zStep = shift[2] >= 0 ? 1 : -1, yStep = shift[1] >= 0 ? 1 : -1;
+    int zFirst = zStep > 0 ? gen->keptLo[2] : gen->keptHi[2] - 1;
+    int yFirst = yStep > 0 ? gen->keptLo[1] : gen->keptHi[1] - 1;
+    size_t count = gen->keptHi[0] - gen->keptLo[0];
+    // Samples are only kept when every layer is, so layers are not wrapped.
+    size_t stride = gen->subdivisions + 1;
+    for (int z = zFirst; z >= gen->keptLo[2] && z < gen->keptHi[2];
+         z += zStep) {
+        for (int y = yFirst; y >= gen->keptLo[1] && y < gen->keptHi[1];
+             y += yStep) {
+            size_t to = ((size_t)z * stride + y) * stride + gen->keptLo[0];
+            size_t from = ((size_t)(z + shift[2]) * stride + y + shift[1]) *
+                              stride +
+                          gen->keptLo[0] + shift[0];
+            memmove(&gen->samples[to], &gen->samples[from],
+                    count * sizeof(float));
+        }
+    }
+}
+
+void setGeneratorSize(Generator *gen, int subdivisions) {
+    if (subdivisions == gen->subdivisions) return;
+    gen->meshDirty = true;
+    // The samples of the last mesh become the guide for the next, rather than
+    // being reallocated.
+    if (gen->progressive && areSamplesComplete(gen)) {
+        free(gen->guideSamples);
+        gen->guideSamples = gen->samples;
+        gen->guideSubdivisions = gen->subdivisions;
+        gen->guideWindow = gen->window;
+        gen->samples = NULL;
+    }
+    gen->subdivisions = subdivisions;
+    allocateBuffers(gen);
+}
+
+void setGeneratorWindow(Generator *gen, Window window) {
+    if (memcmp(&window, &gen->window, sizeof(Window)) == 0) return;
+    gen->meshDirty = true;
+    if (gen->samplesKept) keepShiftedSamples(gen, window);
+    gen->window = window;
+}
+
+void setGeneratorSDF(Generator *gen, Token *expr) {
+    if (expr != gen->sdfExpr) resetGeneratorSamples(gen);
+    gen->sdfExpr = expr;
+}
 
 void setGeneratorThreshold(Generator *gen, float threshold) {
+    if (threshold != gen->threshold) gen->meshDirty = true;
     gen->threshold = threshold;
 }
 
-// Calculate 1D memory indices for 3D sample coordinates.
-int sampleIndex(Generator *gen, int x, int y, int z) {
-    int stride = gen->subdivisions + 1;
-    return (z * stride + y) * stride + x;
+void setGeneratorPrecision(Generator *gen, Precision precision) {
+    if (precision != gen->precision) gen->meshDirty = true;
+    gen->precision = precision;
+}
+
+void setGeneratorNormals(Generator *gen, NormalMode normalMode) {
+    if (normalMode != gen->normalMode) gen->meshDirty = true;
+    gen->normalMode = normalMode;
+}
+
+void setGeneratorProfile(Generator *gen, ExprProfile *profile) {
+    // A profile needs a run to record.
+    if (profile) {
+        gen->meshDirty = true;
+        setExpressionProfileThreads(profile, getThreadPoolSize(gen->pool));
+    }
+    gen->profile = profile;
+}
+
+void setGeneratorBackend(Generator *gen, ExprBackend backend) {
+    gen->backend = backend;
+}
+
+void setGeneratorVerbose(Generator *gen, bool verbose) {
+    gen->verbose = verbose;
+}
+
+void setGeneratorStreaming(Generator *gen, bool streaming) {
+    if (streaming == gen->streaming) return;
+    gen->streaming = streaming;
+    if (gen->subdivisions > 0) allocateBuffers(gen);
+}
+
+void setGeneratorCulling(Generator *gen, bool culling) {
+    gen->culling = culling;
+}
+
+void setGeneratorNarrowBand(Generator *gen, float margin) {
+    // A narrow band can lose parts of the surface, so it may change the mesh.
+    if (margin != gen->bandMargin) gen->meshDirty = true;
+    bool resize = (margin > 0) != (gen->bandMargin > 0) && !gen->progressive;
+    gen->bandMargin = margin;
+    if (resize && gen->subdivisions > 0) allocateBuffers(gen);
+}
+
+void setGeneratorProgressive(Generator *gen, bool progressive) {
+    if (progressive == gen->progressive) return;
+    gen->meshDirty = true;
+    gen->progressive = progressive;
+    if (!progressive) resetGeneratorSamples(gen);
+    if (gen->subdivisions > 0) allocateBuffers(gen);
+}
+
+void setGeneratorPreview(Generator *gen, bool preview) {
+    if (preview == gen->preview) return;
+    gen->meshDirty = true;
+    gen->preview = preview;
+}
+
+void resetGeneratorSamples(Generator *gen) {
+    free(gen->guideSamples);
+    gen->guideSamples = NULL;
+    gen->guideSubdivisions = 0;
+    gen->samplesKept = false;
+    gen->meshDirty = true;
+}
+
+bool hasGeneratorKeptSamples(Generator *gen) { return gen->samplesKept; }
+
+void setGeneratorSimplification(Generator *gen, float tolerance) {
+    if (tolerance != gen->simplifyTolerance) gen->meshDirty = true;
+    gen->simplifyTolerance = tolerance;
+}
+
+void setGeneratorProgress(Generator *gen, ProgressFunction progress,
+                          void *data) {
+    gen->progress = progress;
+    gen->progressData = data;
+}
+
+void setGeneratorCancel(Generator *gen, atomic_bool *cancel) {
+    gen->cancel = cancel;
+}
+
+// The flag is only read, never waited on, so a relaxed load is enough, and
+// checking it costs next to nothing.
+bool isGeneratorCancelled(Generator *gen) {
+    return gen->cancel &&
+           atomic_load_explicit(gen->cancel, memory_order_relaxed);
+}
+
+void reportProgress(Generator *gen, GenStage stage, int done, int total) {
+    if (gen->progress) gen->progress(gen->progressData, stage, done, total);
+}
+
+void setGeneratorThreads(Generator *gen, int threads) {
+    destroyThreadPool(gen->pool);
+    gen->pool = createThreadPool(threads);
+    if (gen->profile) {
+        setExpressionProfileThreads(gen->profile, getThreadPoolSize(gen->pool));
+    }
+}
+
+double getTimeSeconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+// Run tasks on the generator's thread pool.
+void runGeneratorTasks(Generator *gen, int taskCount, TaskFunction function,
+                       void *data) {
+    runTasks(gen->pool, taskCount, function, data);
+}
+
+// Evaluate the SDF at a point, going through the profiler if one is set.
+// thread is the index of the pool thread making the evaluation, which the
+// profiler keeps separate counters for.
+float evaluateSDF(Generator *gen, int thread, vec3 point) {
+    if (gen->profile) {
+        return evaluateExpressionProfiled(gen->profile, thread, point);
+    }
+    return evaluateExpression(gen->sdfExpr, point);
+}
+
+// Evaluate the SDF and its gradient at a point, in the same way.
+float evaluateSDFGradient(Generator *gen, int thread, vec3 point,
+                          vec3 gradient) {
+    if (gen->profile) {
+        return evaluateExpressionGradientProfiled(gen->profile, thread, point,
+                                                  gradient);
+    }
+    return evaluateExpressionGradient(gen->sdfExpr, point, gradient);
+}
+
+// Evaluate the SDF at a point in double precision, in the same way.
+double evaluateSDFDouble(Generator *gen, int thread, dvec3 point) {
+    if (gen->profile) {
+        return evaluateExpressionDoubleProfiled(gen->profile, thread, point);
+    }
+    return evaluateExpressionDouble(gen->sdfExpr, point);
+}
+
+// Evaluate the SDF and its gradient at a point in double precision, in the
+// same way.
+double evaluateSDFGradientDouble(Generator *gen, int thread, dvec3 point,
+                                 dvec3 gradient) {
+    if (gen->profile) {
+        return evaluateExpressionGradientDoubleProfiled(gen->profile, thread,
+                                                        point, gradient);
+    }
+    return evaluateExpressionGradientDouble(gen->sdfExpr, point, gradient);
+}
+
+// Calculate 1D memory indices for 3D sample coordinates. Indices are 64-bit,
+// as a single layer of a 2048^3 grid is already millions of samples.
+size_t sampleIndex(Generator *gen, int x, int y, int z) {
+    size_t stride = gen->subdivisions + 1;
+    return ((size_t)(z % gen->sampleLayers) * stride + y) * stride + x;
+}
+
+uint64_t *getSignRow(Generator *gen, int y, int z) {
+    size_t row = (size_t)(z % gen->sampleLayers) * (gen->subdivisions + 1) + y;
+    return &gen->signs[row * gen->signWords];
+}
+
+// Get a word of a row of sign bits, shifted so that bit x holds the sign of
+// sample x + 1 instead of x.
+uint64_t getNextSigns(Generator *gen, uint64_t *row, int word) {
+    uint64_t next = word + 1 < gen->signWords ? row[word + 1] : 0;
+    return row[word] >> 1 | next << 63;
+}
+
+// Mask of the bits in a word of a row of signs that belong to a cell, rather
+// than to the extra sample at the end of the row.
+uint64_t getCellMask(Generator *gen, int word) {
+    int remaining = gen->subdivisions - word * 64;
+    if (remaining >= 64) return ~(uint64_t)0;
+    return ((uint64_t)1 << remaining) - 1;
+}
+
+// Number of words of sign bits covering the cells in a row.
+int getCellWords(Generator *gen) { return (gen->subdivisions + 63) / 64; }
+
+// Find the lowest set bit of a non-zero word.
+int findLowestBit(uint64_t bits) {
+#ifdef __GNUC__
+    return __builtin_ctzll(bits);
+#else
+    int bit = 0;
+    while (!(bits >> bit & 1)) bit++;
+    return bit;
+#endif
+}
+
+int countBits(uint64_t bits) {
+#ifdef __GNUC__
+    return __builtin_popcountll(bits);
+#else
+    int count = 0;
+    for (; bits; bits &= bits - 1) count++;
+    return count;
+#endif
+}
+
+EdgeBand *getEdgeBand(Generator *gen, int band, int z) {
+    return &gen->edgeBands[(z % EDGE_LAYERS) * gen->bandCount + band];
 }
 
-// Calculate 1D memory indices for 3D edge coordinates + a direction.
-int edgeIndex(Generator *gen, int x, int y, int z, EdgeDir dir) {
-    int stride = gen->subdivisions + 1;
-    return ((z * stride + y) * stride + x) * 3 + dir;
+// Get the crossing edges in row y of layer z. Rows past the last cell never
+// have any.
+EdgeRow getEdgeRow(Generator *gen, int y, int z) {
+    EdgeRow row = {NULL, NULL};
+    if (y >= gen->subdivisions) return row;
+    EdgeBand *band = getEdgeBand(gen, y / TILE_ROWS, z);
+    row.begin = band->edges + band->rowStart[y % TILE_ROWS];
+    row.end = band->edges + band->rowStart[y % TILE_ROWS + 1];
+    return row;
+}
+
+// Skip the edges in a row before x, for good. Cells are scanned in order of
+// x, so this keeps lookups short.
+void advanceEdgeRow(EdgeRow *row, int x) {
+    while (row->begin < row->end && row->begin->x < x) {
+        row->begin++;
+    }
+}
+
+// Find a crossing edge in a row, or NULL if that edge doesn't cross.
+Edge *findEdge(EdgeRow *row, int x, EdgeDir dir) {
+    for (Edge *edge = row->begin; edge < row->end && edge->x <= x; edge++) {
+        if (edge->x == x && edge->dir == dir) return edge;
+    }
+    return NULL;
+}
+
+// Add an edge to the end of a band, growing it if needed.
+Edge *pushEdge(EdgeBand *band) {
+    if (band->count == band->capacity) {
+        band->capacity = band->capacity ? band->capacity * 2 : 64;
+        band->edges = realloc(band->edges, band->capacity * sizeof(Edge));
+    }
+    return &band->edges[band->count++];
 }
 
 // Calculate 1D memory indices for 3D cell coordinates.
-int vertexIndex(Generator *gen, int x, int y, int z) {
-    int stride = gen->subdivisions;
-    return (z * stride + y) * stride + x;
+size_t vertexIndex(Generator *gen, int x, int y, int z) {
+    size_t stride = gen->subdivisions;
+    return ((size_t)(z % VERTEX_LAYERS) * stride + y) * stride + x;
 }
 
 // Calculate the vector to evaluate the SDF at for a sample.
 void getSampleVector(Generator *gen, int x, int y, int z, vec3 out) {
-    vec3 gridVector = {x, y, z};
+    vec3 gridVector = {x + gen->gridShift[0], y + gen->gridShift[1],
+                       z + gen->gridShift[2]};
     vec3 unitCubeVector;
     glm_vec3_divs(gridVector, gen->subdivisions, unitCubeVector);
     vec3 windowExtent;
-    glm_vec3_sub(gen->window.max, gen->window.min, windowExtent);
-    glm_vec3_copy(gen->window.min, out);
+    glm_vec3_sub(gen->grid.max, gen->grid.min, windowExtent);
+    glm_vec3_copy(gen->grid.min, out);
     glm_vec3_muladd(unitCubeVector, windowExtent, out);
 }
 
-void generateOneSample(Generator *gen, int x, int y, int z) {
+// Calculate the vector for a sample in double precision, for use in mixed
+// precision mode where large windows would make float positions jitter.
+void getSampleVectorDouble(Generator *gen, int x, int y, int z, dvec3 out) {
+    int gridVector[] = {x + gen->gridShift[0], y + gen->gridShift[1],
+                        z + gen->gridShift[2]};
+    for (int i = 0; i < 3; i++) {
+        double extent = (double)gen->grid.max[i] - gen->grid.min[i];
+        out[i] = gen->grid.min[i] +
+                 (double)gridVector[i] / gen->subdivisions * extent;
+    }
+}
+
+void lerpDouble(dvec3 a, dvec3 b, double t, dvec3 out) {
+    for (int i = 0; i < 3; i++) {
+        out[i] = a[i] + (b[i] - a[i]) * t;
+    }
+}
+
+// Estimate the gradient of the SDF at a sample from the samples around it,
+// by central differences, or one-sided differences on the faces of the grid.
+// The result is in world units, matching evaluateExpressionGradient.
+void getSampleGradient(Generator *gen, int x, int y, int z, vec3 out) {
+    for (int i = 0; i < 3; i++) {
+        int lo[] = {x, y, z}, hi[] = {x, y, z};
+        if (lo[i] > 0) lo[i]--;
+        if (hi[i] < gen->subdivisions) hi[i]++;
+        float extent = gen->grid.max[i] - gen->grid.min[i];
+        float distance = (hi[i] - lo[i]) * extent / gen->subdivisions;
+        out[i] = (gen->samples[sampleIndex(gen, hi[0], hi[1], hi[2])] -
+                  gen->samples[sampleIndex(gen, lo[0], lo[1], lo[2])]) /
+                 distance;
+    }
+}
+
+// Estimate the normal at a fraction t along an edge, interpolating between
+// the sample gradients at its ends. This needs no SDF evaluations at all.
+void getSampledNormal(Generator *gen, int x, int y, int z, EdgeDir dir,
+                      float t, vec3 normal) {
+    vec3 gradientA, gradientB;
+    getSampleGradient(gen, x, y, z, gradientA);
+    getSampleGradient(gen, x + (dir == DIR_X), y + (dir == DIR_Y),
+                      z + (dir == DIR_Z), gradientB);
+    glm_vec3_lerp(gradientA, gradientB, t, normal);
+    glm_vec3_normalize(normal);
+}
+
+void generateOneSample(Generator *gen, int thread, int x, int y, int z) {
     vec3 sampleVector;
     getSampleVector(gen, x, y, z, sampleVector);
-    float sampledValue = evaluateExpression(gen->sdfExpr, sampleVector);
+    float sampledValue = evaluateSDF(gen, thread, sampleVector);
     gen->samples[sampleIndex(gen, x, y, z)] = sampledValue;
 }
 
-void generateSamples(Generator *gen) {
+// Pack the signs of a row of samples into bits, setting those above the
+// threshold. Later passes only look at the float samples where they need to.
+void generateSignRow(Generator *gen, int y, int z) {
+    float *samples = &gen->samples[sampleIndex(gen, 0, y, z)];
+    uint64_t *signs = getSignRow(gen, y, z);
     int sideLength = gen->subdivisions + 1;
-    for (int z = 0; z < sideLength; z++) {
-        for (int y = 0; y < sideLength; y++) {
-            for (int x = 0; x < sideLength; x++) {
-                generateOneSample(gen, x, y, z);
+    for (int word = 0; word < gen->signWords; word++) {
+        int count = sideLength - word * 64;
+        if (count > 64) count = 64;
+        uint64_t bits = 0;
+        for (int bit = 0; bit < count; bit++) {
+            float value = samples[word * 64 + bit] - gen->threshold;
+            bits |= (uint64_t)(value > 0) << bit;
+        }
+        signs[word] = bits;
+    }
+}
+
+// Evaluate a run of samples along the x axis with the batch backend.
+void generateSampleRun(Generator *gen, int start, int end, int y, int z,
+                       vec3 *points) {
+    for (int x = start; x < end; x++) {
+        getSampleVector(gen, x, y, z, points[x - start]);
+    }
+    evaluateExpressionBatch(gen->sdfExpr, points,
+                            &gen->samples[sampleIndex(gen, start, y, z)],
+                            end - start);
+}
+
+size_t blockIndex(Generator *gen, int x, int y, int z) {
+    int size = gen->cullBlockSize, blocks = gen->cullBlocks;
+    return ((size_t)(z / size) * blocks + y / size) * blocks + x / size;
+}
+
+// Gets the value the samples in the block around a sample are filled with,
+// or NaN if they must be evaluated.
+float getBlockFill(Generator *gen, int x, int y, int z) {
+    if (!gen->blocksCulled) return NAN;
+    return gen->blockFill[blockIndex(gen, x, y, z)];
+}
+
+// Gets the sample after the last one in the same block as x, along a row.
+int getBlockEnd(Generator *gen, int x) {
+    int end = (x / gen->cullBlockSize + 1) * gen->cullBlockSize;
+    return end < gen->subdivisions + 1 ? end : gen->subdivisions + 1;
+}
+
+// Counts the samples of a run that are on the other side of the threshold
+// from the coarse samples around their block, which can only happen when the
+// surface crosses outside the narrow band.
+size_t countBandMisses(Generator *gen, int start, int end, int y, int z) {
+    size_t misses = 0;
+    for (int x = start; x < end; x++) {
+        int side = gen->blockSides[blockIndex(gen, x, y, z)];
+        float value = gen->samples[sampleIndex(gen, x, y, z)] - gen->threshold;
+        if (side != 0 && (value > 0) != (side > 0)) misses++;
+    }
+    return misses;
+}
+
+// Pick the backend for sampling, based on the number of samples unless it has
+// been overridden. Profiling only works through the interpreter.
+ExprBackend getSampleBackend(Generator *gen, double sampleCount) {
+    if (gen->profile) return BACKEND_INTERPRETER;
+    if (gen->backend != BACKEND_AUTO) return gen->backend;
+    return chooseExpressionBackend(gen->sdfExpr, sampleCount);
+}
+
+// Shared by the tasks of each stage of the pipeline, which work on layer z.
+typedef struct {
+    Generator *gen;
+    int z;
+    ExprBackend backend;
+    Mesh *mesh;
+    bool invertNormals;
+    // The number of active cells in each band, then the index of its first.
+    size_t *bandCells;
+    size_t cellCount;
+    // The index of the first quad of each band.
+    size_t *bandQuads;
+    size_t quadCount;
+    size_t leafCount;
+    double sampleTime;
+    atomic_size_t culledSamples;
+    atomic_size_t bandMisses;
+    atomic_size_t keptSamples;
+    bool narrowBand;
+    bool guided;
+    int intervalCount;
+    double cullTime;
+    atomic_size_t edgeCount;
+    atomic_size_t edgeEvaluations;
+    // The total and largest angle between sampled and evaluated normals in
+    // each band, when comparing them.
+    double *bandNormalError;
+    double *bandNormalErrorMax;
+} SlabJob;
+
+// Bounds the SDF over a range of blocks, and the margin around them. Blocks
+// proven to be on one side of the threshold are filled with the bound, and
+// the rest are subdivided until single blocks remain, which are sampled.
+void classifyBlocks(SlabJob *job, int lo[3], int hi[3]) {
+    Generator *gen = job->gen;
+    int size = gen->cullBlockSize;
+    vec3 a, b, min, max;
+    getSampleVector(gen, lo[0] * size - CULL_MARGIN, lo[1] * size - CULL_MARGIN,
+                    lo[2] * size - CULL_MARGIN, a);
+    getSampleVector(gen, hi[0] * size - 1 + CULL_MARGIN,
+                    hi[1] * size - 1 + CULL_MARGIN,
+                    hi[2] * size - 1 + CULL_MARGIN, b);
+    glm_vec3_minv(a, b, min);
+    glm_vec3_maxv(a, b, max);
+    Interval bounds = evaluateExpressionInterval(gen->sdfExpr, min, max);
+    job->intervalCount++;
+
+    double threshold = gen->threshold;
+    float fill = NAN;
+    if (bounds.lo - threshold >
+        CULL_TOLERANCE * (1 + fabs(threshold) + fabs(bounds.lo))) {
+        fill = bounds.lo;
+    } else if (threshold - bounds.hi >
+               CULL_TOLERANCE * (1 + fabs(threshold) + fabs(bounds.hi))) {
+        fill = bounds.hi;
+    }
+    bool single = hi[0] - lo[0] == 1 && hi[1] - lo[1] == 1 &&
+                  hi[2] - lo[2] == 1;
+    if (!isnan(fill) || single) {
+        int blocks = gen->cullBlocks;
+        for (int z = lo[2]; z < hi[2]; z++) {
+            for (int y = lo[1]; y < hi[1]; y++) {
+                for (int x = lo[0]; x < hi[0]; x++) {
+                    gen->blockFill[((size_t)z * blocks + y) * blocks + x] =
+                        fill;
+                }
             }
         }
+        return;
+    }
+    for (int i = 0; i < 8; i++) {
+        int childLo[3], childHi[3];
+        bool empty = false;
+        for (int axis = 0; axis < 3; axis++) {
+            int mid = (lo[axis] + hi[axis] + 1) / 2;
+            childLo[axis] = i >> axis & 1 ? mid : lo[axis];
+            childHi[axis] = i >> axis & 1 ? hi[axis] : mid;
+            if (childLo[axis] == childHi[axis]) empty = true;
+        }
+        if (!empty) classifyBlocks(job, childLo, childHi);
     }
 }
 
-// Approximate a normal from the SDF by sampling at arbitrarily small offsets.
-void generateApproxNormal(Generator *gen, vec3 pos, vec3 normal, float delta) {
-    float value = evaluateExpression(gen->sdfExpr, pos);
-    vec3 temp;
-    glm_vec3_add(pos, (vec3){delta, 0, 0}, temp);
-    normal[0] = evaluateExpression(gen->sdfExpr, temp) - value;
-    glm_vec3_add(pos, (vec3){0, delta, 0}, temp);
-    normal[1] = evaluateExpression(gen->sdfExpr, temp) - value;
-    glm_vec3_add(pos, (vec3){0, 0, delta}, temp);
-    normal[2] = evaluateExpression(gen->sdfExpr, temp) - value;
+// Finds the blocks of the grid that can be culled, subdividing from the
+// whole grid down.
+void cullBlocks(SlabJob *job) {
+    double startTime = getTimeSeconds();
+    int lo[] = {0, 0, 0};
+    int hi[] = {job->gen->cullBlocks, job->gen->cullBlocks,
+                job->gen->cullBlocks};
+    classifyBlocks(job, lo, hi);
+    job->cullTime = getTimeSeconds() - startTime;
+}
+
+// Samples part of a row along the x axis, from rowStart to rowEnd. Runs of
+// blocks that are not culled are evaluated together, and culled blocks are
+// filled in.
+void generateSampleRange(SlabJob *job, int thread, int rowStart, int rowEnd,
+                         int y, int z, size_t *culled, size_t *misses) {
+    Generator *gen = job->gen;
+    int x = rowStart;
+    while (x < rowEnd) {
+        int start = x, end = x;
+        while (end < rowEnd && isnan(getBlockFill(gen, end, y, z))) {
+            end = getBlockEnd(gen, end);
+        }
+        if (end > rowEnd) end = rowEnd;
+        if (job->backend == BACKEND_BATCH) {
+            vec3 points[SAMPLE_BATCH];
+            while (x < end) {
+                int runEnd = x + SAMPLE_BATCH < end ? x + SAMPLE_BATCH : end;
+                generateSampleRun(gen, x, runEnd, y, z, points);
+                x = runEnd;
+            }
+        }
+        for (; x < end; x++) {
+            generateOneSample(gen, thread, x, y, z);
+        }
+        if (job->narrowBand) {
+            *misses += countBandMisses(gen, start, end, y, z);
+        }
+        while (x < rowEnd) {
+            float fill = getBlockFill(gen, x, y, z);
+            if (isnan(fill)) break;
+            int blockEnd = getBlockEnd(gen, x);
+            if (blockEnd > rowEnd) blockEnd = rowEnd;
+            *culled += blockEnd - x;
+            for (; x < blockEnd; x++) {
+                gen->samples[sampleIndex(gen, x, y, z)] = fill;
+            }
+        }
+    }
+}
+
+// Each task evaluates one row of samples along the x axis. Rows are small
+// enough that even coarse grids are spread across every thread. Kept samples
+// are skipped, as are all rows once generation is cancelled, since the layer
+// will be thrown away.
+void generateSampleTask(void *data, int task, int thread) {
+    SlabJob *job = data;
+    Generator *gen = job->gen;
+    if (isGeneratorCancelled(gen)) return;
+    int y = task, z = job->z;
+    int sideLength = gen->subdivisions + 1;
+    size_t culled = 0, misses = 0, kept = 0;
+    if (!isRowKept(gen, y, z)) {
+        generateSampleRange(job, thread, 0, sideLength, y, z, &culled,
+                            &misses);
+    } else {
+        generateSampleRange(job, thread, 0, gen->keptLo[0], y, z, &culled,
+                            &misses);
+        int x = gen->keptLo[0];
+        while (x < gen->keptHi[0]) {
+            int start = x;
+            while (x < gen->keptHi[0] && isSampleKept(gen, x, y, z)) x++;
+            kept += x - start;
+            int end = x;
+            while (end < gen->keptHi[0] && !isSampleKept(gen, end, y, z)) {
+                end++;
+            }
+            generateSampleRange(job, thread, x, end, y, z, &culled, &misses);
+            x = end;
+        }
+        generateSampleRange(job, thread, gen->keptHi[0], sideLength, y, z,
+                            &culled, &misses);
+    }
+    if (culled) atomic_fetch_add(&job->culledSamples, culled);
+    if (misses) atomic_fetch_add(&job->bandMisses, misses);
+    if (kept) atomic_fetch_add(&job->keptSamples, kept);
+    generateSignRow(gen, y, z);
+}
+
+void generateSampleLayer(SlabJob *job, int z) {
+    double startTime = getTimeSeconds();
+    job->z = z;
+    runGeneratorTasks(job->gen, job->gen->subdivisions + 1, generateSampleTask,
+                      job);
+    job->sampleTime += getTimeSeconds() - startTime;
+}
+
+// Approximate a normal from the SDF in double precision by sampling at
+// arbitrarily small offsets. The result is still stored as a float.
+void generateApproxNormalDouble(Generator *gen, int thread, dvec3 pos,
+                                vec3 normal, double delta) {
+    double value = evaluateSDFDouble(gen, thread, pos);
+    for (int i = 0; i < 3; i++) {
+        dvec3 temp = {pos[0], pos[1], pos[2]};
+        temp[i] += delta;
+        normal[i] = evaluateSDFDouble(gen, thread, temp) - value;
+    }
     glm_vec3_normalize(normal);
 }
 
-// Use iterative interpolation to find a zero along an edge.
-void generateOneEdge(Generator *gen, int x, int y, int z, EdgeDir dir) {
-    vec3 a, b;
-    float valueA, valueB;
-    getSampleVector(gen, x, y, z, a);
-    valueA = gen->samples[sampleIndex(gen, x, y, z)];
-    switch (dir) {
-        case DIR_X:
-            getSampleVector(gen, x + 1, y, z, b);
-            valueB = gen->samples[sampleIndex(gen, x + 1, y, z)];
-            break;
-        case DIR_Y:
-            getSampleVector(gen, x, y + 1, z, b);
-            valueB = gen->samples[sampleIndex(gen, x, y + 1, z)];
-            break;
-        case DIR_Z:
-            getSampleVector(gen, x, y, z + 1, b);
-            valueB = gen->samples[sampleIndex(gen, x, y, z + 1)];
-            break;
+// Add a crossing edge to a band. Its Hermite data is found once the band is
+// complete.
+void addEdge(EdgeBand *band, int x, EdgeDir dir, IntersectType intersectType) {
+    Edge *edge = pushEdge(band);
+    edge->x = x;
+    edge->dir = dir;
+    edge->intersectType = intersectType;
+}
+
+// Evaluate the SDF at many points, with the backend chosen for sampling.
+void evaluatePoints(SlabJob *job, int thread, vec3 *points, float *values,
+                    int count) {
+    if (job->backend == BACKEND_BATCH) {
+        evaluateExpressionBatch(job->gen->sdfExpr, points, values, count);
+        return;
     }
-    float range = 1.0;
-    int iterations = 0;
-    while (range > 0.01 && iterations < 5) {
-        float t = (gen->threshold - valueA) / (valueB - valueA);
-        vec3 interpolatedVector;
-        glm_vec3_lerp(a, b, t, interpolatedVector);
-        float newValue = evaluateExpression(gen->sdfExpr, interpolatedVector);
-        if (fabs(newValue - gen->threshold) < ZERO_TOLERANCE) break;
-        if ((newValue > gen->threshold) == (valueA > gen->threshold)) {
-            valueA = newValue;
-            glm_vec3_copy(interpolatedVector, a);
-            range *= (1 - t);
-        } else {
-            valueB = newValue;
-            glm_vec3_copy(interpolatedVector, b);
-            range *= t;
+    for (int i = 0; i < count; i++) {
+        values[i] = evaluateSDF(job->gen, thread, points[i]);
+    }
+}
+
+// Evaluate the SDF and its gradient at many points, in the same way.
+void evaluatePointGradients(SlabJob *job, int thread, vec3 *points,
+                            float *values, vec3 *gradients, int count) {
+    if (job->backend == BACKEND_BATCH) {
+        evaluateExpressionGradientBatch(job->gen->sdfExpr, points, values,
+                                        gradients, count);
+        return;
+    }
+    for (int i = 0; i < count; i++) {
+        values[i] =
+            evaluateSDFGradient(job->gen, thread, points[i], gradients[i]);
+    }
+}
+
+// Gets the sample at index i of the coarse grid along an axis. The last
+// coarse sample is moved back onto the grid when blocks overhang it.
+int getCoarseSample(Generator *gen, int i) {
+    int sample = i * gen->cullBlockSize;
+    return sample < gen->subdivisions ? sample : gen->subdivisions;
+}
+
+// Each task samples one row of the coarse grid.
+void generateCoarseTask(void *data, int task, int thread) {
+    SlabJob *job = data;
+    Generator *gen = job->gen;
+    int coarseSide = gen->cullBlocks + 1;
+    int y = getCoarseSample(gen, task % coarseSide);
+    int z = getCoarseSample(gen, task / coarseSide);
+    float *values = &gen->coarseSamples[(size_t)task * coarseSide];
+    vec3 points[SAMPLE_BATCH];
+    for (int start = 0; start < coarseSide; start += SAMPLE_BATCH) {
+        int count = coarseSide - start;
+        if (count > SAMPLE_BATCH) count = SAMPLE_BATCH;
+        for (int i = 0; i < count; i++) {
+            getSampleVector(gen, getCoarseSample(gen, start + i), y, z,
+                            points[i]);
         }
-        iterations++;
+        evaluatePoints(job, thread, points, &values[start], count);
     }
+}
 
-    int index = edgeIndex(gen, x, y, z, dir);
-    float t = (gen->threshold - valueA) / (valueB - valueA);
-    glm_vec3_lerp(a, b, t, gen->edges[index].position);
-    generateApproxNormal(gen, gen->edges[index].position,
-                         gen->edges[index].normal, VEC_DELTA);
+// Whether the guide can stand in for the coarse grid: the mesh must be a
+// preview, and the guide must cover the same window, with every coarse sample
+// on one of its samples.
+bool isGuideUsable(Generator *gen) {
+    if (!gen->preview || gen->guideSubdivisions == 0 ||
+        gen->subdivisions % gen->guideSubdivisions != 0) {
+        return false;
+    }
+    int ratio = gen->subdivisions / gen->guideSubdivisions;
+    return gen->cullBlockSize % ratio == 0 &&
+           memcmp(&gen->guideWindow, &gen->window, sizeof(Window)) == 0;
 }
 
-bool checkEdgeIntersection(Generator *gen, int x, int y, int z, EdgeDir dir) {
-    float valueA = gen->samples[sampleIndex(gen, x, y, z)];
-    float valueB;
-    switch (dir) {
-        case DIR_X:
-            valueB = gen->samples[sampleIndex(gen, x + 1, y, z)];
-            break;
-        case DIR_Y:
-            valueB = gen->samples[sampleIndex(gen, x, y + 1, z)];
-            break;
-        case DIR_Z:
-            valueB = gen->samples[sampleIndex(gen, x, y, z + 1)];
-            break;
+float getGuideSample(Generator *gen, int x, int y, int z) {
+    size_t stride = gen->guideSubdivisions + 1;
+    return gen->guideSamples[((size_t)z * stride + y) * stride + x];
+}
+
+// Gets the side of the threshold a block of guide samples is on, or 0 if it
+// is in the band: unless every sample is on the same side, and further from
+// it than the field could change between guide samples. The slope is taken
+// as the largest difference between neighbouring samples, which the range of
+// the samples bounds, so that is tried first.
+int getGuideSide(Generator *gen, int lo[3], int hi[3]) {
+    size_t stride = gen->guideSubdivisions + 1, layer = stride * stride;
+    float *first = &gen->guideSamples[(lo[2] * stride + lo[1]) * stride];
+    int side = first[lo[0]] > gen->threshold ? 1 : -1;
+    float nearest = INFINITY, min = INFINITY, max = -INFINITY;
+    for (int z = lo[2]; z <= hi[2]; z++) {
+        for (int y = lo[1]; y <= hi[1]; y++) {
+            float *row = &gen->guideSamples[(z * stride + y) * stride];
+            for (int x = lo[0]; x <= hi[0]; x++) {
+                float value = row[x] - gen->threshold;
+                // NaNs are kept in the band too.
+                if (!((value > 0) == (side > 0) && value == value)) return 0;
+                if (fabsf(value) < nearest) nearest = fabsf(value);
+                if (row[x] < min) min = row[x];
+                if (row[x] > max) max = row[x];
+            }
+        }
     }
-    valueA -= gen->threshold;
-    valueB -= gen->threshold;
-    bool isIntersection = (valueA > 0) != (valueB > 0);
-    if (isIntersection) {
-        int index = edgeIndex(gen, x, y, z, dir);
-        if (valueA > valueB) {
-            gen->edges[index].intersectType = INTERSECT_NEG;
-        } else {
-            gen->edges[index].intersectType = INTERSECT_POS;
+    // Every point is within half the diagonal of a guide cell of a guide
+    // sample.
+    float scale = GUIDE_SAFETY * 0.8660254f;
+    if (nearest <= gen->bandMargin) return 0;
+    if (nearest > scale * (max - min)) return side;
+    float slope = 0.0f;
+    for (int z = lo[2]; z <= hi[2]; z++) {
+        for (int y = lo[1]; y <= hi[1]; y++) {
+            float *row = &gen->guideSamples[(z * stride + y) * stride];
+            for (int x = lo[0]; x <= hi[0]; x++) {
+                float dx = x < hi[0] ? fabsf(row[x + 1] - row[x]) : 0.0f;
+                float dy = y < hi[1] ? fabsf(row[x + stride] - row[x]) : 0.0f;
+                float dz = z < hi[2] ? fabsf(row[x + layer] - row[x]) : 0.0f;
+                if (dx > slope) slope = dx;
+                if (dy > slope) slope = dy;
+                if (dz > slope) slope = dz;
+            }
         }
     }
-    return isIntersection;
+    return nearest > scale * slope ? side : 0;
 }
 
-void clearEdges(Generator *gen) {
-    int edgeSide = gen->subdivisions + 1;
-    int edgeCount = edgeSide * edgeSide * edgeSide * 3;
+// Each task finds the sides of one layer of blocks from the guide.
+void generateGuideTask(void *data, int task, int thread) {
+    SlabJob *job = data;
+    Generator *gen = job->gen;
+    int blocks = gen->cullBlocks;
+    int ratio = gen->subdivisions / gen->guideSubdivisions;
+    int lo[3], hi[3];
+    lo[2] = getCoarseSample(gen, task) / ratio;
+    hi[2] = getCoarseSample(gen, task + 1) / ratio;
+    for (int by = 0; by < blocks; by++) {
+        lo[1] = getCoarseSample(gen, by) / ratio;
+        hi[1] = getCoarseSample(gen, by + 1) / ratio;
+        for (int bx = 0; bx < blocks; bx++) {
+            lo[0] = getCoarseSample(gen, bx) / ratio;
+            hi[0] = getCoarseSample(gen, bx + 1) / ratio;
+            gen->blockSides[((size_t)task * blocks + by) * blocks + bx] =
+                getGuideSide(gen, lo, hi);
+        }
+    }
+}
 
-    for (int i = 0; i < edgeCount; i++) {
-        gen->edges[i].intersectType = INTERSECT_NONE;
+// Puts every block whose corners are not all more than the margin from the
+// threshold, on the same side, in the band.
+void markNarrowBand(Generator *gen) {
+    int blocks = gen->cullBlocks, coarseSide = blocks + 1;
+    for (int z = 0; z < blocks; z++) {
+        for (int y = 0; y < blocks; y++) {
+            for (int x = 0; x < blocks; x++) {
+                size_t corner = ((size_t)z * coarseSide + y) * coarseSide + x;
+                int side = gen->coarseSamples[corner] > gen->threshold ? 1 : -1;
+                for (int i = 0; i < 8; i++) {
+                    size_t index = corner + (i & 1) +
+                                   (i >> 1 & 1) * coarseSide +
+                                   (i >> 2) * coarseSide * coarseSide;
+                    float value = gen->coarseSamples[index] - gen->threshold;
+                    // NaNs are kept in the band too.
+                    if (!(fabsf(value) > gen->bandMargin) ||
+                        (value > 0) != (side > 0)) {
+                        side = 0;
+                        break;
+                    }
+                }
+                gen->blockSides[((size_t)z * blocks + y) * blocks + x] = side;
+            }
+        }
     }
 }
 
-void generateEdges(Generator *gen) {
-    clearEdges(gen);
-    // Only need the first n - 1 vertices, the others are always external edges.
-    int sideLength = gen->subdivisions;
-    for (int z = 0; z < sideLength; z++) {
-        for (int y = 0; y < sideLength; y++) {
-            for (int x = 0; x < sideLength; x++) {
-                if (y > 0 && z > 0 &&
-                    checkEdgeIntersection(gen, x, y, z, DIR_X)) {
-                    generateOneEdge(gen, x, y, z, DIR_X);
+// Finds the narrow band, from the guide if it can be used and otherwise from
+// a coarse grid. Blocks next to the band are sampled too, so that the surface
+// stays well inside the samples; the rest are filled with a coarse sample.
+void findNarrowBand(SlabJob *job) {
+    double startTime = getTimeSeconds();
+    Generator *gen = job->gen;
+    int blocks = gen->cullBlocks, coarseSide = blocks + 1;
+    job->guided = isGuideUsable(gen);
+    if (job->guided) {
+        int ratio = gen->subdivisions / gen->guideSubdivisions;
+        for (int z = 0; z < coarseSide; z++) {
+            for (int y = 0; y < coarseSide; y++) {
+                for (int x = 0; x < coarseSide; x++) {
+                    gen->coarseSamples[((size_t)z * coarseSide + y) *
+                                           coarseSide +
+                                       x] =
+                        getGuideSample(gen, getCoarseSample(gen, x) / ratio,
+                                       getCoarseSample(gen, y) / ratio,
+                                       getCoarseSample(gen, z) / ratio);
                 }
-                if (x > 0 && z > 0 &&
-                    checkEdgeIntersection(gen, x, y, z, DIR_Y)) {
-                    generateOneEdge(gen, x, y, z, DIR_Y);
+            }
+        }
+        runGeneratorTasks(gen, blocks, generateGuideTask, job);
+    } else {
+        runGeneratorTasks(gen, coarseSide * coarseSide, generateCoarseTask,
+                          job);
+        markNarrowBand(gen);
+    }
+
+    for (int z = 0; z < blocks; z++) {
+        for (int y = 0; y < blocks; y++) {
+            for (int x = 0; x < blocks; x++) {
+                gen->blockFill[((size_t)z * blocks + y) * blocks + x] =
+                    gen->coarseSamples[((size_t)z * coarseSide + y) *
+                                           coarseSide +
+                                       x];
+            }
+        }
+    }
+    // Then clear the fill of the band and the blocks around it.
+    for (int z = 0; z < blocks; z++) {
+        for (int y = 0; y < blocks; y++) {
+            for (int x = 0; x < blocks; x++) {
+                if (gen->blockSides[((size_t)z * blocks + y) * blocks + x]) {
+                    continue;
                 }
-                if (x > 0 && y > 0 &&
-                    checkEdgeIntersection(gen, x, y, z, DIR_Z)) {
-                    generateOneEdge(gen, x, y, z, DIR_Z);
+                for (int i = 0; i < 27; i++) {
+                    int nx = x + i % 3 - 1, ny = y + i / 3 % 3 - 1,
+                        nz = z + i / 9 - 1;
+                    if (nx >= 0 && ny >= 0 && nz >= 0 && nx < blocks &&
+                        ny < blocks && nz < blocks) {
+                        gen->blockFill[((size_t)nz * blocks + ny) * blocks +
+                                       nx] = NAN;
+                    }
                 }
             }
         }
     }
+    job->cullTime = getTimeSeconds() - startTime;
 }
 
-float vertexError(vec3 point, Cell *cell) {
-    float faceError = 0.0;
-    for (int i = 0; i < cell->intersectionCount; i++) {
-        Edge *edge = cell->intersections[i];
-        vec3 relativePosition;
-        glm_vec3_sub(point, edge->position, relativePosition);
-        float planeDistance = glm_vec3_dot(relativePosition, edge->normal);
-        faceError += planeDistance * planeDistance;
+// The state of a batch of edge searches, as a structure of arrays. Each
+// search brackets the zero between lo and hi, as fractions of the edge.
+typedef struct {
+    vec3 a[EDGE_BATCH], b[EDGE_BATCH];
+    float lo[EDGE_BATCH], hi[EDGE_BATCH];
+    float valueLo[EDGE_BATCH], valueHi[EDGE_BATCH];
+    float t[EDGE_BATCH];
+    // Which end of the bracket moved last, for the Illinois step.
+    int side[EDGE_BATCH];
+    int active[EDGE_BATCH];
+    vec3 points[EDGE_BATCH];
+    float values[EDGE_BATCH];
+    vec3 gradients[EDGE_BATCH];
+    // With sampled normals, the sample gradients at the ends of each edge.
+    vec3 gradientA[EDGE_BATCH], gradientB[EDGE_BATCH];
+} EdgeBatch;
+
+// Updates the bracket of search i with the value and slope at its current
+// point, then picks the next point. A Newton step is taken if it stays inside
+// the bracket, otherwise an Illinois step, so the zero is never lost. Returns
+// true once the step is below EDGE_TOLERANCE, leaving the result in t.
+bool stepEdgeSearch(EdgeBatch *batch, int i, float value, float slope) {
+    float t = batch->t[i];
+    if ((value > 0) == (batch->valueLo[i] > 0)) {
+        batch->lo[i] = t;
+        batch->valueLo[i] = value;
+        // Halve the stale end if this end has moved twice in a row.
+        if (batch->side[i] < 0) batch->valueHi[i] *= 0.5f;
+        batch->side[i] = -1;
+    } else {
+        batch->hi[i] = t;
+        batch->valueHi[i] = value;
+        if (batch->side[i] > 0) batch->valueLo[i] *= 0.5f;
+        batch->side[i] = 1;
+    }
+    float lo = batch->lo[i], hi = batch->hi[i];
+    float next = t - value / slope;
+    if (!(next > lo && next < hi)) {
+        next = lo - batch->valueLo[i] * (hi - lo) /
+                        (batch->valueHi[i] - batch->valueLo[i]);
+    }
+    if (!isfinite(next)) next = (lo + hi) / 2;
+    batch->t[i] = next;
+    return value == 0 || fabsf(next - t) < EDGE_TOLERANCE ||
+           hi - lo < EDGE_TOLERANCE;
+}
+
+// Find a zero along each edge of a batch, whose ends and values have been
+// filled in. Every step is one batched evaluation of the SDF and its gradient
+// together, which gives the slope along the edge for the next step and the
+// normal once the search has converged. With sampled normals, the gradient
+// comes from the samples instead, so only values are evaluated. Edges that
+// have converged are compacted out of the active list between steps. Returns
+// the number of evaluations made.
+size_t refineEdgeBatch(SlabJob *job, int thread, EdgeBatch *batch,
+                       Edge **edges, int count) {
+    Generator *gen = job->gen;
+    bool sampled = gen->normalMode == NORMALS_SAMPLED;
+    size_t evaluations = 0;
+    int activeCount = count;
+    for (int i = 0; i < count; i++) {
+        // Values are relative to the threshold from here on.
+        batch->valueLo[i] -= gen->threshold;
+        batch->valueHi[i] -= gen->threshold;
+        batch->lo[i] = 0;
+        batch->hi[i] = 1;
+        batch->t[i] =
+            batch->valueLo[i] / (batch->valueLo[i] - batch->valueHi[i]);
+        batch->side[i] = 0;
+        batch->active[i] = i;
+    }
+    for (int iteration = 0; iteration < EDGE_ITERATIONS && activeCount > 0;
+         iteration++) {
+        for (int k = 0; k < activeCount; k++) {
+            int i = batch->active[k];
+            glm_vec3_lerp(batch->a[i], batch->b[i], batch->t[i],
+                          batch->points[k]);
+            if (sampled) {
+                glm_vec3_lerp(batch->gradientA[i], batch->gradientB[i],
+                              batch->t[i], batch->gradients[k]);
+            }
+        }
+        if (sampled) {
+            evaluatePoints(job, thread, batch->points, batch->values,
+                           activeCount);
+        } else {
+            evaluatePointGradients(job, thread, batch->points, batch->values,
+                                   batch->gradients, activeCount);
+        }
+        evaluations += activeCount;
+        int remaining = 0;
+        for (int k = 0; k < activeCount; k++) {
+            int i = batch->active[k];
+            // The gradient at the last point evaluated is the normal, which
+            // is within EDGE_TOLERANCE of the final position.
+            glm_vec3_copy(batch->gradients[k], edges[i]->normal);
+            vec3 direction;
+            glm_vec3_sub(batch->b[i], batch->a[i], direction);
+            float slope = glm_vec3_dot(batch->gradients[k], direction);
+            float value = batch->values[k] - gen->threshold;
+            if (!stepEdgeSearch(batch, i, value, slope)) {
+                batch->active[remaining++] = i;
+            }
+        }
+        activeCount = remaining;
+    }
+
+    for (int i = 0; i < count; i++) {
+        glm_vec3_lerp(batch->a[i], batch->b[i], batch->t[i],
+                      edges[i]->position);
+        if (sampled) {
+            glm_vec3_lerp(batch->gradientA[i], batch->gradientB[i],
+                          batch->t[i], edges[i]->normal);
+        }
+        float length = glm_vec3_norm(edges[i]->normal);
+        if (length > 0 && isfinite(length)) {
+            glm_vec3_divs(edges[i]->normal, length, edges[i]->normal);
+            continue;
+        }
+        // The gradient is flat or undefined here, so approximate the normal
+        // by sampling at arbitrarily small offsets instead.
+        float value = evaluateSDF(gen, thread, edges[i]->position);
+        for (int j = 0; j < 3; j++) {
+            vec3 offset;
+            glm_vec3_copy(edges[i]->position, offset);
+            offset[j] += VEC_DELTA;
+            edges[i]->normal[j] = evaluateSDF(gen, thread, offset) - value;
+        }
+        glm_vec3_normalize(edges[i]->normal);
+        evaluations += 4;
+    }
+    return evaluations;
+}
+
+// The state of a single edge search in double precision, as for a batch.
+typedef struct {
+    double lo, hi;
+    double valueLo, valueHi;
+    double t;
+    int side;
+} EdgeSearchDouble;
+
+// The same step as stepEdgeSearch, in double precision.
+bool stepEdgeSearchDouble(EdgeSearchDouble *search, double value,
+                          double slope) {
+    double t = search->t;
+    if ((value > 0) == (search->valueLo > 0)) {
+        search->lo = t;
+        search->valueLo = value;
+        if (search->side < 0) search->valueHi *= 0.5;
+        search->side = -1;
+    } else {
+        search->hi = t;
+        search->valueHi = value;
+        if (search->side > 0) search->valueLo *= 0.5;
+        search->side = 1;
+    }
+    double lo = search->lo, hi = search->hi;
+    double next = t - value / slope;
+    if (!(next > lo && next < hi)) {
+        next = lo - search->valueLo * (hi - lo) /
+                        (search->valueHi - search->valueLo);
+    }
+    if (!isfinite(next)) next = (lo + hi) / 2;
+    search->t = next;
+    return value == 0 || fabs(next - t) < EDGE_TOLERANCE ||
+           hi - lo < EDGE_TOLERANCE;
+}
+
+// Find a zero along an edge in double precision, with the same search as
+// refineEdgeBatch. Only the starting values come from the float samples,
+// everything after that is evaluated in double, along with the gradient
+// unless normals are sampled. Returns the number of evaluations made.
+int generateOneEdgeDouble(Generator *gen, int thread, int x, int y, int z,
+                          EdgeDir dir, Edge *edge) {
+    bool sampled = gen->normalMode == NORMALS_SAMPLED;
+    dvec3 a, b, direction;
+    int offset[] = {dir == DIR_X, dir == DIR_Y, dir == DIR_Z};
+    getSampleVectorDouble(gen, x, y, z, a);
+    getSampleVectorDouble(gen, x + offset[0], y + offset[1], z + offset[2], b);
+    for (int i = 0; i < 3; i++) direction[i] = b[i] - a[i];
+    vec3 gradientA, gradientB;
+    if (sampled) {
+        getSampleGradient(gen, x, y, z, gradientA);
+        getSampleGradient(gen, x + offset[0], y + offset[1], z + offset[2],
+                          gradientB);
+    }
+    double threshold = gen->threshold;
+    EdgeSearchDouble search;
+    search.valueLo = gen->samples[sampleIndex(gen, x, y, z)] - threshold;
+    search.valueHi = gen->samples[sampleIndex(gen, x + offset[0],
+                                              y + offset[1], z + offset[2])] -
+                     threshold;
+    search.lo = 0;
+    search.hi = 1;
+    search.t = search.valueLo / (search.valueLo - search.valueHi);
+    search.side = 0;
+
+    int evaluations = 0;
+    dvec3 gradient = {0, 0, 0};
+    for (int iteration = 0; iteration < EDGE_ITERATIONS; iteration++) {
+        dvec3 point;
+        lerpDouble(a, b, search.t, point);
+        double value;
+        if (sampled) {
+            value = evaluateSDFDouble(gen, thread, point);
+            for (int i = 0; i < 3; i++) {
+                gradient[i] = gradientA[i] +
+                              (gradientB[i] - gradientA[i]) * search.t;
+            }
+        } else {
+            value = evaluateSDFGradientDouble(gen, thread, point, gradient);
+        }
+        evaluations++;
+        double slope = gradient[0] * direction[0] +
+                       gradient[1] * direction[1] + gradient[2] * direction[2];
+        if (stepEdgeSearchDouble(&search, value - threshold, slope)) break;
+    }
+
+    dvec3 position;
+    lerpDouble(a, b, search.t, position);
+    for (int i = 0; i < 3; i++) {
+        edge->position[i] = position[i];
+    }
+    if (sampled) {
+        getSampledNormal(gen, x, y, z, dir, search.t, edge->normal);
+        return evaluations;
+    }
+    // The gradient at the last point evaluated is the normal, as for a batch.
+    double length = sqrt(gradient[0] * gradient[0] +
+                         gradient[1] * gradient[1] + gradient[2] * gradient[2]);
+    if (length > 0 && isfinite(length)) {
+        for (int i = 0; i < 3; i++) edge->normal[i] = gradient[i] / length;
+        return evaluations;
+    }
+    generateApproxNormalDouble(gen, thread, position, edge->normal,
+                               VEC_DELTA);
+    return evaluations + 4;
+}
+
+// Find the Hermite data for the crossing edges of a band, in batches. Mixed
+// precision evaluates in double, which has no batched form, so its edges are
+// refined one at a time.
+void refineBandEdges(SlabJob *job, int thread, EdgeBand *band, int yStart) {
+    Generator *gen = job->gen;
+    int z = job->z;
+    EdgeBatch batch;
+    Edge *edges[EDGE_BATCH];
+    int count = 0;
+    int row = 0;
+    size_t evaluations = 0;
+    for (size_t i = 0; i < band->count; i++) {
+        while (i >= band->rowStart[row + 1]) row++;
+        Edge *edge = &band->edges[i];
+        int x = edge->x, y = yStart + row;
+        if (gen->precision == PRECISION_MIXED) {
+            evaluations +=
+                generateOneEdgeDouble(gen, thread, x, y, z, edge->dir, edge);
+            continue;
+        }
+        int offset[] = {edge->dir == DIR_X, edge->dir == DIR_Y,
+                        edge->dir == DIR_Z};
+        getSampleVector(gen, x, y, z, batch.a[count]);
+        getSampleVector(gen, x + offset[0], y + offset[1], z + offset[2],
+                        batch.b[count]);
+        batch.valueLo[count] = gen->samples[sampleIndex(gen, x, y, z)];
+        batch.valueHi[count] = gen->samples[sampleIndex(
+            gen, x + offset[0], y + offset[1], z + offset[2])];
+        if (gen->normalMode == NORMALS_SAMPLED) {
+            getSampleGradient(gen, x, y, z, batch.gradientA[count]);
+            getSampleGradient(gen, x + offset[0], y + offset[1],
+                              z + offset[2], batch.gradientB[count]);
+        }
+        edges[count++] = edge;
+        if (count == EDGE_BATCH) {
+            evaluations += refineEdgeBatch(job, thread, &batch, edges, count);
+            count = 0;
+        }
+    }
+    if (count > 0) {
+        evaluations += refineEdgeBatch(job, thread, &batch, edges, count);
+    }
+    atomic_fetch_add(&job->edgeCount, band->count);
+    atomic_fetch_add(&job->edgeEvaluations, evaluations);
+}
+
+// Measure the angle between the sampled normal of each edge in a band and the
+// normal from the evaluated gradient, for the verbose report.
+void compareSampledNormals(SlabJob *job, EdgeBand *band, int task) {
+    for (size_t i = 0; i < band->count; i++) {
+        Edge *edge = &band->edges[i];
+        vec3 gradient;
+        evaluateExpressionGradient(job->gen->sdfExpr, edge->position,
+                                   gradient);
+        glm_vec3_normalize(gradient);
+        double angle =
+            acos(glm_clamp(glm_vec3_dot(gradient, edge->normal), -1, 1));
+        job->bandNormalError[task] += angle;
+        if (angle > job->bandNormalErrorMax[task]) {
+            job->bandNormalErrorMax[task] = angle;
+        }
+    }
+}
+
+// Empties a layer of edges, for the top layer which is always external.
+void clearEdgeLayer(Generator *gen, int z) {
+    for (int band = 0; band < gen->bandCount; band++) {
+        EdgeBand *edgeBand = getEdgeBand(gen, band, z);
+        edgeBand->count = 0;
+        memset(edgeBand->rowStart, 0, sizeof(edgeBand->rowStart));
     }
-    faceError /= cell->intersectionCount;
-    float massError = glm_vec3_distance2(point, cell->massPoint);
-    return faceError + massError * MASS_BIAS;
 }
 
-void descentStep(vec3 point, Cell *cell, float delta, vec3 stepDir) {
-    float value = vertexError(point, cell);
-    vec3 temp;
-    glm_vec3_add(point, (vec3){delta, 0, 0}, temp);
-    stepDir[0] = vertexError(temp, cell) - value;
-    glm_vec3_add(point, (vec3){0, delta, 0}, temp);
-    stepDir[1] = vertexError(temp, cell) - value;
-    glm_vec3_add(point, (vec3){0, 0, delta}, temp);
-    stepDir[2] = vertexError(temp, cell) - value;
-    glm_vec3_divs(stepDir, -delta, stepDir);
+// Each task finds the edges of one band of cells. Cells near the surface cost
+// far more than empty ones, which the pool balances by stealing bands.
+void generateEdgesTask(void *data, int task, int thread) {
+    SlabJob *job = data;
+    Generator *gen = job->gen;
+    int z = job->z;
+    int yStart, yEnd;
+    getBandRows(gen, task, &yStart, &yEnd);
+    EdgeBand *band = getEdgeBand(gen, task, z);
+    band->count = 0;
+    for (int y = yStart; y < yEnd; y++) {
+        band->rowStart[y - yStart] = band->count;
+        uint64_t *row = getSignRow(gen, y, z);
+        uint64_t *rowY = getSignRow(gen, y + 1, z);
+        uint64_t *rowZ = getSignRow(gen, y, z + 1);
+        // Edges cross wherever the signs at either end differ, which is found
+        // for 64 edges at once. Edges on the lower faces of the grid are
+        // always external.
+        for (int word = 0; word < getCellWords(gen); word++) {
+            uint64_t signs = row[word];
+            uint64_t cells = getCellMask(gen, word);
+            uint64_t innerCells = word == 0 ? cells & ~(uint64_t)1 : cells;
+            uint64_t crossX = signs ^ getNextSigns(gen, row, word);
+            uint64_t crossY = signs ^ rowY[word];
+            uint64_t crossZ = signs ^ rowZ[word];
+            crossX &= y > 0 && z > 0 ? cells : 0;
+            crossY &= z > 0 ? innerCells : 0;
+            crossZ &= y > 0 ? innerCells : 0;
+            uint64_t crossAny = crossX | crossY | crossZ;
+            while (crossAny) {
+                int bit = findLowestBit(crossAny);
+                crossAny &= crossAny - 1;
+                int x = word * 64 + bit;
+                // Edges starting above the threshold go downwards.
+                IntersectType intersectType =
+                    signs >> bit & 1 ? INTERSECT_NEG : INTERSECT_POS;
+                if (crossX >> bit & 1) addEdge(band, x, DIR_X, intersectType);
+                if (crossY >> bit & 1) addEdge(band, x, DIR_Y, intersectType);
+                if (crossZ >> bit & 1) addEdge(band, x, DIR_Z, intersectType);
+            }
+        }
+    }
+    band->rowStart[yEnd - yStart] = band->count;
+    refineBandEdges(job, thread, band, yStart);
+    if (job->bandNormalError) compareSampledNormals(job, band, task);
+}
+
+// Finds the edges of layer z, which needs the samples of layers z and z + 1,
+// and with sampled normals the layers either side of those too.
+void generateEdgeLayer(SlabJob *job, int z) {
+    job->z = z;
+    runGeneratorTasks(job->gen, getBandCount(job->gen), generateEdgesTask,
+                      job);
 }
 
 // Add an intersection to a cell.
@@ -271,139 +1657,1032 @@ void pushCellIntersection(Cell *cell, Edge *intersection) {
     cell->intersectionCount++;
 }
 
-// Calculate the mass point of a cell.
-void calculateMassPoint(Cell *cell) {
-    glm_vec3_zero(cell->massPoint);
+// Accumulate A^T A, A^T b and b^T b for a cell, where each row of A is the
+// normal of an intersection and b is its offset from the mass point.
+void buildQef(Cell *cell, Qef *qef) {
+    memset(qef, 0, sizeof(Qef));
+    qef->count = cell->intersectionCount;
+    for (int i = 0; i < cell->intersectionCount; i++) {
+        for (int j = 0; j < 3; j++) {
+            qef->massPoint[j] += cell->intersections[i]->position[j];
+        }
+    }
+    for (int j = 0; j < 3; j++) {
+        qef->massPoint[j] /= cell->intersectionCount;
+    }
     for (int i = 0; i < cell->intersectionCount; i++) {
         Edge *intersection = cell->intersections[i];
-        glm_vec3_add(cell->massPoint, intersection->position, cell->massPoint);
-    }
-    glm_vec3_divs(cell->massPoint, cell->intersectionCount, cell->massPoint);
-}
-
-void generateOneVertex(Generator *gen, int x, int y, int z, float minMove) {
-    // The most efficient method of checking all edges here is to simply list
-    // out their indices, then scan through checking which are intersections.
-    int indices[] = {
-        edgeIndex(gen, x, y, z, DIR_X),
-        edgeIndex(gen, x, y, z + 1, DIR_X),
-        edgeIndex(gen, x, y + 1, z, DIR_X),
-        edgeIndex(gen, x, y + 1, z + 1, DIR_X),
-        edgeIndex(gen, x, y, z, DIR_Y),
-        edgeIndex(gen, x, y, z + 1, DIR_Y),
-        edgeIndex(gen, x + 1, y, z, DIR_Y),
-        edgeIndex(gen, x + 1, y, z + 1, DIR_Y),
-        edgeIndex(gen, x, y, z, DIR_Z),
-        edgeIndex(gen, x, y + 1, z, DIR_Z),
-        edgeIndex(gen, x + 1, y, z, DIR_Z),
-        edgeIndex(gen, x + 1, y + 1, z, DIR_Z),
-    };
+        double b = 0.0;
+        for (int j = 0; j < 3; j++) {
+            b += intersection->normal[j] *
+                 (intersection->position[j] - qef->massPoint[j]);
+        }
+        for (int j = 0; j < 3; j++) {
+            for (int k = 0; k < 3; k++) {
+                qef->ata[j][k] +=
+                    intersection->normal[j] * intersection->normal[k];
+            }
+            qef->atb[j] += intersection->normal[j] * b;
+        }
+        qef->btb += b * b;
+    }
+}
+
+// Diagonalise a symmetric 3x3 matrix with a fixed number of Jacobi sweeps,
+// leaving the eigenvalues on its diagonal and eigenvectors in columns of v.
+void diagonalizeSymmetric(double a[3][3], double v[3][3]) {
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            v[i][j] = i == j;
+        }
+    }
+    const int pairs[3][2] = {{0, 1}, {0, 2}, {1, 2}};
+    for (int sweep = 0; sweep < QEF_SWEEPS; sweep++) {
+        for (int pair = 0; pair < 3; pair++) {
+            int p = pairs[pair][0], q = pairs[pair][1];
+            if (fabs(a[p][q]) < 1e-30) continue;
+            // Rotate in the p-q plane so that a[p][q] becomes zero.
+            double theta = (a[q][q] - a[p][p]) / (2.0 * a[p][q]);
+            double t = (theta >= 0 ? 1.0 : -1.0) /
+                       (fabs(theta) + sqrt(theta * theta + 1.0));
+            double c = 1.0 / sqrt(t * t + 1.0);
+            double s = t * c;
+            for (int k = 0; k < 3; k++) {
+                double akp = a[k][p], akq = a[k][q];
+                a[k][p] = c * akp - s * akq;
+                a[k][q] = s * akp + c * akq;
+            }
+            for (int k = 0; k < 3; k++) {
+                double apk = a[p][k], aqk = a[q][k];
+                a[p][k] = c * apk - s * aqk;
+                a[q][k] = s * apk + c * aqk;
+            }
+            for (int k = 0; k < 3; k++) {
+                double vkp = v[k][p], vkq = v[k][q];
+                v[k][p] = c * vkp - s * vkq;
+                v[k][q] = s * vkp + c * vkq;
+            }
+        }
+    }
+}
+
+// Find the point minimising a QEF, with a pseudo-inverse of A^T A. Directions
+// the intersections barely constrain, such as along a flat surface, have
+// their eigenvalues truncated, leaving the point at the mass point in them.
+void solveQef(Qef *qef, dvec3 out) {
+    double a[3][3], v[3][3];
+    memcpy(a, qef->ata, sizeof(a));
+    diagonalizeSymmetric(a, v);
+    double largest = fmax(fabs(a[0][0]), fmax(fabs(a[1][1]), fabs(a[2][2])));
+    for (int j = 0; j < 3; j++) {
+        out[j] = qef->massPoint[j];
+    }
+    for (int i = 0; i < 3; i++) {
+        double eigenvalue = a[i][i];
+        if (eigenvalue <= largest * QEF_TRUNCATION * QEF_TRUNCATION) continue;
+        double projection = 0.0;
+        for (int j = 0; j < 3; j++) {
+            projection += v[j][i] * qef->atb[j];
+        }
+        for (int j = 0; j < 3; j++) {
+            out[j] += v[j][i] * projection / eigenvalue;
+        }
+    }
+}
+
+// Moves a QEF to be relative to a new mass point, without changing the error
+// it gives anywhere, so that it can be added to others.
+void shiftQef(Qef *qef, dvec3 massPoint) {
+    double d[3], ad[3];
+    for (int j = 0; j < 3; j++) {
+        d[j] = massPoint[j] - qef->massPoint[j];
+    }
+    double dad = 0.0, db = 0.0;
+    for (int j = 0; j < 3; j++) {
+        ad[j] = 0.0;
+        for (int k = 0; k < 3; k++) {
+            ad[j] += qef->ata[j][k] * d[k];
+        }
+        dad += d[j] * ad[j];
+        db += d[j] * qef->atb[j];
+    }
+    for (int j = 0; j < 3; j++) {
+        qef->atb[j] -= ad[j];
+        qef->massPoint[j] = massPoint[j];
+    }
+    qef->btb += dad - 2.0 * db;
+}
+
+// Find the error of a QEF at a point, the sum of its squared distances to
+// the planes of the intersections.
+double getQefError(Qef *qef, dvec3 point) {
+    double y[3];
+    for (int j = 0; j < 3; j++) {
+        y[j] = point[j] - qef->massPoint[j];
+    }
+    double error = qef->btb;
+    for (int j = 0; j < 3; j++) {
+        double ay = 0.0;
+        for (int k = 0; k < 3; k++) {
+            ay += qef->ata[j][k] * y[k];
+        }
+        error += y[j] * ay - 2.0 * y[j] * qef->atb[j];
+    }
+    return error;
+}
+
+// Finds the point of the box from min to max with the least error, for a QEF
+// whose minimum lies outside it. The minimum is then on the surface of the
+// box, so its faces, then edges, then corners are tried in turn, solving for
+// the coordinates each leaves free. Of points with equal error, the first
+// found is kept, which is the one that fixes the fewest coordinates.
+void solveQefInBox(Qef *qef, dvec3 min, dvec3 max, dvec3 out) {
+    double size = 0.0;
+    for (int j = 0; j < 3; j++) size = fmax(size, max[j] - min[j]);
+    double margin = size * QEF_BOX_TOLERANCE;
+    double bestError = INFINITY;
+    for (int fixedCount = 1; fixedCount <= 3; fixedCount++) {
+        // Each coordinate is either free, or fixed to the min or max of the
+        // box.
+        for (int choice = 0; choice < 27; choice++) {
+            int modes[3] = {choice % 3, choice / 3 % 3, choice / 9};
+            if ((modes[0] > 0) + (modes[1] > 0) + (modes[2] > 0) !=
+                fixedCount) {
+                continue;
+            }
+            dvec3 origin;
+            for (int j = 0; j < 3; j++) {
+                origin[j] = modes[j] == 0   ? qef->massPoint[j]
+                            : modes[j] == 1 ? min[j]
+                                            : max[j];
+            }
+            // Moving the QEF to the fixed coordinates and dropping their rows
+            // leaves their eigenvalues at zero, so solveQef does not move
+            // them.
+            Qef reduced = *qef;
+            shiftQef(&reduced, origin);
+            for (int j = 0; j < 3; j++) {
+                if (modes[j] == 0) continue;
+                for (int k = 0; k < 3; k++) {
+                    reduced.ata[j][k] = reduced.ata[k][j] = 0.0;
+                }
+                reduced.atb[j] = 0.0;
+            }
+            dvec3 point;
+            solveQef(&reduced, point);
+            bool inside = true;
+            for (int j = 0; j < 3; j++) {
+                if (point[j] < min[j] - margin || point[j] > max[j] + margin) {
+                    inside = false;
+                }
+            }
+            if (!inside) continue;
+            double error = getQefError(qef, point);
+            if (error < bestError - margin * size) {
+                bestError = error;
+                memcpy(out, point, sizeof(dvec3));
+            }
+        }
+    }
+}
+
+// rows holds the edges in the four rows around the cell, in corner order,
+// which are scanned along with x. The cell's QEF is left in qef.
+void generateOneVertex(Generator *gen, int x, int y, int z, int config,
+                       EdgeRow rows[4], Qef *qef) {
+    for (int i = 0; i < 4; i++) {
+        advanceEdgeRow(&rows[i], x);
+    }
     Cell cell;
     cell.intersectionCount = 0;
     for (int i = 0; i < 12; i++) {
-        if (gen->edges[indices[i]].intersectType != INTERSECT_NONE) {
-            pushCellIntersection(&cell, &gen->edges[indices[i]]);
+        // Only edges with corners on either side of the surface are looked
+        // up. They may still be missing, if they are on the grid boundary.
+        const CellEdge *cellEdge = &CELL_EDGES[i];
+        if ((config >> cellEdge->cornerA & 1) ==
+            (config >> cellEdge->cornerB & 1)) {
+            continue;
+        }
+        Edge *edge = findEdge(&rows[cellEdge->cornerA >> 1],
+                              x + (cellEdge->cornerA & 1), cellEdge->dir);
+        if (edge) {
+            pushCellIntersection(&cell, edge);
         }
     }
     if (cell.intersectionCount == 0) {
+        memset(qef, 0, sizeof(Qef));
         return;
     }
-    calculateMassPoint(&cell);
 
+    buildQef(&cell, qef);
+    dvec3 position;
+    solveQef(qef, position);
+    // The minimum of the QEF can lie outside the cell, beyond a feature that
+    // the cell only sees some of the planes of, or where the planes are close
+    // to parallel. The vertex is then kept to the best point in the cell.
+    dvec3 corner, opposite, min, max;
+    getSampleVectorDouble(gen, x, y, z, corner);
+    getSampleVectorDouble(gen, x + 1, y + 1, z + 1, opposite);
+    bool inside = true;
+    for (int j = 0; j < 3; j++) {
+        min[j] = fmin(corner[j], opposite[j]);
+        max[j] = fmax(corner[j], opposite[j]);
+        double margin = (max[j] - min[j]) * QEF_BOX_TOLERANCE;
+        if (position[j] < min[j] - margin || position[j] > max[j] + margin) {
+            inside = false;
+        }
+    }
+    if (!inside) solveQefInBox(qef, min, max, position);
     vec3 *vertex = &gen->vertices[vertexIndex(gen, x, y, z)];
-    glm_vec3_copy(cell.massPoint, *vertex);
-    int iterations = 0;
-    vec3 stepDir;
-    do {
-        descentStep(*vertex, &cell, VEC_DELTA, stepDir);
-        glm_vec3_muladds(stepDir, STEP_SIZE, *vertex);
-        iterations++;
-    } while (iterations < 10 && glm_vec3_norm2(stepDir) > minMove * minMove);
+    for (int j = 0; j < 3; j++) {
+        (*vertex)[j] = position[j];
+    }
 }
 
-void generateVertices(Generator *gen) {
-    vec3 windowExtent;
-    glm_vec3_sub(gen->window.max, gen->window.min, windowExtent);
-    float diagonalLength = glm_vec3_norm(windowExtent);
-    float cellDiagonalLength = diagonalLength / gen->subdivisions;
-    float minMove = cellDiagonalLength * MIN_MOVE_FRAC;
-    // This pass iterates through each internal cell, the number of which is
-    // specified by subdivisions.
-    int sideLength = gen->subdivisions;
-    for (int z = 0; z < sideLength; z++) {
-        for (int y = 0; y < sideLength; y++) {
-            for (int x = 0; x < sideLength; x++) {
-                generateOneVertex(gen, x, y, z, minMove);
+// Find the active cells in row y of layer z, writing them to out unless it is
+// NULL. Returns the number of active cells.
+size_t findActiveCells(Generator *gen, int y, int z, ActiveCell *out) {
+    uint64_t *signRows[] = {
+        getSignRow(gen, y, z),
+        getSignRow(gen, y + 1, z),
+        getSignRow(gen, y, z + 1),
+        getSignRow(gen, y + 1, z + 1),
+    };
+    size_t count = 0;
+    for (int word = 0; word < getCellWords(gen); word++) {
+        // Cells with every corner on the same side of the surface have no
+        // vertex, and are rejected 64 at a time.
+        uint64_t corners[8];
+        uint64_t allAbove = ~(uint64_t)0, anyAbove = 0;
+        for (int i = 0; i < 4; i++) {
+            corners[i * 2] = signRows[i][word];
+            corners[i * 2 + 1] = getNextSigns(gen, signRows[i], word);
+            allAbove &= corners[i * 2] & corners[i * 2 + 1];
+            anyAbove |= corners[i * 2] | corners[i * 2 + 1];
+        }
+        uint64_t mixed = anyAbove & ~allAbove & getCellMask(gen, word);
+        if (!out) {
+            count += countBits(mixed);
+            continue;
+        }
+        while (mixed) {
+            int bit = findLowestBit(mixed);
+            mixed &= mixed - 1;
+            ActiveCell *cell = &out[count++];
+            cell->x = word * 64 + bit;
+            cell->y = y;
+            cell->config = 0;
+            for (int i = 0; i < 8; i++) {
+                cell->config |= (int)(corners[i] >> bit & 1) << i;
             }
         }
     }
+    return count;
 }
 
-void generateFaces(Generator *gen, Mesh *mesh, bool invertNormals) {
-    clearMesh(mesh);
-    int sideLength = gen->subdivisions;
+void countActiveCellsTask(void *data, int task, int thread) {
+    SlabJob *job = data;
+    int yStart, yEnd;
+    getBandRows(job->gen, task, &yStart, &yEnd);
+    job->bandCells[task] = 0;
+    for (int y = yStart; y < yEnd; y++) {
+        job->bandCells[task] += findActiveCells(job->gen, y, job->z, NULL);
+    }
+}
+
+void writeActiveCellsTask(void *data, int task, int thread) {
+    SlabJob *job = data;
+    int yStart, yEnd;
+    getBandRows(job->gen, task, &yStart, &yEnd);
+    ActiveCell *out = &job->gen->activeCells[job->bandCells[task]];
+    for (int y = yStart; y < yEnd; y++) {
+        out += findActiveCells(job->gen, y, job->z, out);
+    }
+}
+
+// Compacts the active cells of layer z into one list, so that placing
+// vertices costs in proportion to the surface rather than the volume. Like
+// the faces, bands are counted, given ranges by a prefix sum, then written
+// in parallel. Needs the signs of layers z and z + 1.
+void compactCellLayer(SlabJob *job, int z) {
+    Generator *gen = job->gen;
+    job->z = z;
+    runGeneratorTasks(gen, gen->bandCount, countActiveCellsTask, job);
+    job->cellCount = 0;
+    for (int band = 0; band < gen->bandCount; band++) {
+        size_t bandCells = job->bandCells[band];
+        job->bandCells[band] = job->cellCount;
+        job->cellCount += bandCells;
+    }
+    if (job->cellCount > gen->activeCellCapacity) {
+        gen->activeCellCapacity = job->cellCount;
+        gen->activeCells = realloc(gen->activeCells,
+                                   job->cellCount * sizeof(ActiveCell));
+    }
+    runGeneratorTasks(gen, gen->bandCount, writeActiveCellsTask, job);
+}
+
+// Each task places the vertices of a chunk of the active cells. Cells with
+// more intersections cost more, which the pool balances by stealing chunks.
+void generateVerticesTask(void *data, int task, int thread) {
+    SlabJob *job = data;
+    Generator *gen = job->gen;
+    int z = job->z;
+    size_t start = (size_t)task * CELL_CHUNK;
+    size_t end = start + CELL_CHUNK;
+    if (end > job->cellCount) end = job->cellCount;
+    int rowY = -1;
+    EdgeRow rows[4];
+    for (size_t i = start; i < end; i++) {
+        ActiveCell *cell = &gen->activeCells[i];
+        // Cells are in scan order, so the edge rows only change with y.
+        if (cell->y != rowY) {
+            rowY = cell->y;
+            rows[0] = getEdgeRow(gen, rowY, z);
+            rows[1] = getEdgeRow(gen, rowY + 1, z);
+            rows[2] = getEdgeRow(gen, rowY, z + 1);
+            rows[3] = getEdgeRow(gen, rowY + 1, z + 1);
+        }
+        if (gen->simplifyTolerance > 0) {
+            // Leaves keep their QEF and vertex for simplifying later.
+            OctreeNode *leaf = &gen->octreeNodes[cell->node];
+            generateOneVertex(gen, cell->x, cell->y, z, cell->config, rows,
+                              &leaf->qef);
+            glm_vec3_copy(gen->vertices[vertexIndex(gen, cell->x, cell->y, z)],
+                          leaf->vertex);
+        } else {
+            Qef qef;
+            generateOneVertex(gen, cell->x, cell->y, z, cell->config, rows,
+                              &qef);
+        }
+    }
+}
+
+// Places the vertices of layer z, which needs the edges of layers z and z + 1,
+// and its active cells.
+void generateVertexLayer(SlabJob *job, int z) {
+    job->z = z;
+    int taskCount = (job->cellCount + CELL_CHUNK - 1) / CELL_CHUNK;
+    runGeneratorTasks(job->gen, taskCount, generateVerticesTask, job);
+}
+
+// Writes the quad around a crossing edge in row y of layer z to the mesh.
+void generateEdgeFace(Generator *gen, Edge *edge, int y, int z, Mesh *mesh,
+                      size_t index, bool invertNormals) {
+    int x = edge->x;
     vec3 *vertexA, *vertexB, *vertexC, *vertexD;
-    for (int z = 0; z < sideLength; z++) {
-        for (int y = 0; y < sideLength; y++) {
-            for (int x = 0; x < sideLength; x++) {
-                Edge *edgeX = &gen->edges[edgeIndex(gen, x, y, z, DIR_X)];
-                Edge *edgeY = &gen->edges[edgeIndex(gen, x, y, z, DIR_Y)];
-                Edge *edgeZ = &gen->edges[edgeIndex(gen, x, y, z, DIR_Z)];
-                if (edgeX->intersectType == INTERSECT_POS) {
-                    vertexA = &gen->vertices[vertexIndex(gen, x, y - 1, z - 1)];
-                    vertexB = &gen->vertices[vertexIndex(gen, x, y, z - 1)];
-                    vertexC = &gen->vertices[vertexIndex(gen, x, y, z)];
-                    vertexD = &gen->vertices[vertexIndex(gen, x, y - 1, z)];
-                    addQuad(mesh, *vertexA, *vertexB, *vertexC, *vertexD,
-                            invertNormals);
-                } else if (edgeX->intersectType == INTERSECT_NEG) {
-                    vertexA = &gen->vertices[vertexIndex(gen, x, y - 1, z - 1)];
-                    vertexB = &gen->vertices[vertexIndex(gen, x, y - 1, z)];
-                    vertexC = &gen->vertices[vertexIndex(gen, x, y, z)];
-                    vertexD = &gen->vertices[vertexIndex(gen, x, y, z - 1)];
-                    addQuad(mesh, *vertexA, *vertexB, *vertexC, *vertexD,
-                            invertNormals);
-                }
-                if (edgeY->intersectType == INTERSECT_POS) {
-                    vertexA = &gen->vertices[vertexIndex(gen, x - 1, y, z - 1)];
-                    vertexB = &gen->vertices[vertexIndex(gen, x - 1, y, z)];
-                    vertexC = &gen->vertices[vertexIndex(gen, x, y, z)];
-                    vertexD = &gen->vertices[vertexIndex(gen, x, y, z - 1)];
-                    addQuad(mesh, *vertexA, *vertexB, *vertexC, *vertexD,
-                            invertNormals);
-                } else if (edgeY->intersectType == INTERSECT_NEG) {
-                    vertexA = &gen->vertices[vertexIndex(gen, x - 1, y, z - 1)];
-                    vertexB = &gen->vertices[vertexIndex(gen, x, y, z - 1)];
-                    vertexC = &gen->vertices[vertexIndex(gen, x, y, z)];
-                    vertexD = &gen->vertices[vertexIndex(gen, x - 1, y, z)];
-                    addQuad(mesh, *vertexA, *vertexB, *vertexC, *vertexD,
-                            invertNormals);
-                }
-                if (edgeZ->intersectType == INTERSECT_POS) {
-                    vertexA = &gen->vertices[vertexIndex(gen, x - 1, y - 1, z)];
-                    vertexB = &gen->vertices[vertexIndex(gen, x, y - 1, z)];
-                    vertexC = &gen->vertices[vertexIndex(gen, x, y, z)];
-                    vertexD = &gen->vertices[vertexIndex(gen, x - 1, y, z)];
-                    addQuad(mesh, *vertexA, *vertexB, *vertexC, *vertexD,
-                            invertNormals);
-                } else if (edgeZ->intersectType == INTERSECT_NEG) {
-                    vertexA = &gen->vertices[vertexIndex(gen, x - 1, y - 1, z)];
-                    vertexB = &gen->vertices[vertexIndex(gen, x - 1, y, z)];
-                    vertexC = &gen->vertices[vertexIndex(gen, x, y, z)];
-                    vertexD = &gen->vertices[vertexIndex(gen, x, y - 1, z)];
-                    addQuad(mesh, *vertexA, *vertexB, *vertexC, *vertexD,
-                            invertNormals);
-                }
+    switch (edge->dir) {
+        case DIR_X:
+            vertexA = &gen->vertices[vertexIndex(gen, x, y - 1, z - 1)];
+            vertexB = &gen->vertices[vertexIndex(gen, x, y, z - 1)];
+            vertexD = &gen->vertices[vertexIndex(gen, x, y - 1, z)];
+            break;
+        case DIR_Y:
+            vertexA = &gen->vertices[vertexIndex(gen, x - 1, y, z - 1)];
+            vertexB = &gen->vertices[vertexIndex(gen, x - 1, y, z)];
+            vertexD = &gen->vertices[vertexIndex(gen, x, y, z - 1)];
+            break;
+        // Edges only run along the three axes, so anything else is DIR_Z,
+        // which also tells the compiler that every pointer is set.
+        case DIR_Z:
+        default:
+            vertexA = &gen->vertices[vertexIndex(gen, x - 1, y - 1, z)];
+            vertexB = &gen->vertices[vertexIndex(gen, x, y - 1, z)];
+            vertexD = &gen->vertices[vertexIndex(gen, x - 1, y, z)];
+            break;
+    }
+    vertexC = &gen->vertices[vertexIndex(gen, x, y, z)];
+    // Edges going from outside to inside face the other way.
+    if (edge->intersectType == INTERSECT_NEG) {
+        vec3 *temp = vertexB;
+        vertexB = vertexD;
+        vertexD = temp;
+    }
+    setQuad(mesh, index, *vertexA, *vertexB, *vertexC, *vertexD,
+            invertNormals);
+}
+
+// Each task writes the quads of one band, starting from its own index.
+void writeFacesTask(void *data, int task, int thread) {
+    SlabJob *job = data;
+    EdgeBand *band = getEdgeBand(job->gen, task, job->z);
+    int yStart, yEnd;
+    getBandRows(job->gen, task, &yStart, &yEnd);
+    size_t index = job->bandQuads[task];
+    for (int y = yStart; y < yEnd; y++) {
+        int row = y - yStart;
+        for (size_t i = band->rowStart[row]; i < band->rowStart[row + 1]; i++) {
+            generateEdgeFace(job->gen, &band->edges[i], y, job->z, job->mesh,
+                             index++, job->invertNormals);
+        }
+    }
+}
+
+// Every stored edge crosses the surface and has one quad, so a prefix sum of
+// the band sizes gives each band its own range of the mesh, which can be
+// filled in without locking. Bands are in the same order as a serial scan,
+// so the output does not depend on the number of threads.
+// Emitting the faces of layer z needs the vertices of layers z - 1 and z.
+void generateFaceLayer(SlabJob *job, int z) {
+    job->z = z;
+    for (int band = 0; band < job->gen->bandCount; band++) {
+        job->bandQuads[band] = job->quadCount;
+        job->quadCount += getEdgeBand(job->gen, band, z)->count;
+    }
+    resizeMeshQuads(job->mesh, job->quadCount);
+    runGeneratorTasks(job->gen, job->gen->bandCount, writeFacesTask, job);
+}
+
+// Adds a node to the octree, returning its index. This may move the nodes, so
+// pointers to them must be looked up again afterwards.
+int pushOctreeNode(Generator *gen, int x, int y, int z, int size) {
+    if (gen->octreeNodeCount == gen->octreeNodeCapacity) {
+        gen->octreeNodeCapacity =
+            gen->octreeNodeCapacity ? gen->octreeNodeCapacity * 2 : 1024;
+        gen->octreeNodes = realloc(
+            gen->octreeNodes, gen->octreeNodeCapacity * sizeof(OctreeNode));
+    }
+    OctreeNode *node = &gen->octreeNodes[gen->octreeNodeCount];
+    memset(node, 0, sizeof(OctreeNode));
+    node->x = x;
+    node->y = y;
+    node->z = z;
+    node->size = size;
+    for (int i = 0; i < 8; i++) {
+        node->children[i] = -1;
+    }
+    return gen->octreeNodeCount++;
+}
+
+// Empties the octree, leaving a root large enough to cover the grid.
+void resetOctree(Generator *gen) {
+    gen->octreeSize = 1;
+    while (gen->octreeSize < gen->subdivisions) {
+        gen->octreeSize *= 2;
+    }
+    gen->octreeNodeCount = 0;
+    pushOctreeNode(gen, 0, 0, 0, gen->octreeSize);
+}
+
+// Adds the active cells of layer z to the octree as leaves, and records the
+// leaf of each cell for the vertex tasks to fill in. This runs serially, as
+// it creates nodes.
+void insertOctreeLayer(SlabJob *job, int z) {
+    Generator *gen = job->gen;
+    for (size_t i = 0; i < job->cellCount; i++) {
+        ActiveCell *cell = &gen->activeCells[i];
+        int index = 0;
+        for (int size = gen->octreeSize; size > 1; size /= 2) {
+            OctreeNode *node = &gen->octreeNodes[index];
+            int half = size / 2;
+            int child = (cell->x - node->x >= half) |
+                        (cell->y - node->y >= half) << 1 |
+                        (z - node->z >= half) << 2;
+            if (node->children[child] < 0) {
+                int created = pushOctreeNode(
+                    gen, node->x + (child & 1) * half,
+                    node->y + (child >> 1 & 1) * half,
+                    node->z + (child >> 2 & 1) * half, half);
+                gen->octreeNodes[index].children[child] = created;
             }
+            index = gen->octreeNodes[index].children[child];
         }
+        gen->octreeNodes[index].leaf = true;
+        gen->octreeNodes[index].config = cell->config;
+        cell->node = index;
     }
 }
 
-void generateMesh(Generator *gen, Mesh *mesh, bool invertNormals) {
-    generateSamples(gen);
-    generateEdges(gen);
-    generateVertices(gen);
-    generateFaces(gen, mesh, invertNormals);
+// Checks that collapsing a node keeps the topology of the surface, with the
+// test of Ju et al.: the sign at the middle of each edge and face of the
+// node, and at its centre, must match the sign of a corner around it. The
+// signs are the corners of the children, on a 3x3x3 lattice. An empty child
+// lies wholly on one side of the surface, that of the centre, which every
+// child touches. The node's own corner signs are written to config.
+bool checkNodeTopology(Generator *gen, OctreeNode *node, int *config) {
+    int lattice[27];
+    for (int p = 0; p < 27; p++) {
+        lattice[p] = -1;
+    }
+    for (int i = 0; i < 8; i++) {
+        if (node->children[i] < 0) continue;
+        OctreeNode *child = &gen->octreeNodes[node->children[i]];
+        for (int corner = 0; corner < 8; corner++) {
+            int p = ((i & 1) + (corner & 1)) +
+                    ((i >> 1 & 1) + (corner >> 1 & 1)) * 3 +
+                    ((i >> 2 & 1) + (corner >> 2 & 1)) * 9;
+            lattice[p] = child->config >> corner & 1;
+        }
+    }
+    for (int p = 0; p < 27; p++) {
+        if (lattice[p] < 0) lattice[p] = lattice[13];
+    }
+    const int stride[] = {1, 3, 9};
+    for (int p = 0; p < 27; p++) {
+        int coords[] = {p % 3, p / 3 % 3, p / 9};
+        bool matched = false;
+        // Move each coordinate in the middle of the lattice to either end.
+        for (int corner = 0; corner < 8 && !matched; corner++) {
+            int q = 0;
+            bool valid = true;
+            for (int axis = 0; axis < 3; axis++) {
+                int bit = corner >> axis & 1;
+                if (coords[axis] != 1 && bit) valid = false;
+                q += (coords[axis] == 1 ? bit * 2 : coords[axis]) *
+                     stride[axis];
+            }
+            matched = valid && lattice[q] == lattice[p];
+        }
+        if (!matched) return false;
+    }
+    *config = 0;
+    for (int corner = 0; corner < 8; corner++) {
+        int p = (corner & 1) * 2 + (corner >> 1 & 1) * 6 +
+                (corner >> 2 & 1) * 18;
+        *config |= lattice[p] << corner;
+    }
+    return true;
 }
 
-void destroyGenerator(Generator *gen) { free(gen); }
\ No newline at end of file
+// Collapses the children of a node into it, if they are all leaves or
+// collapsed, the topology check passes, and the vertex of the merged QEF is
+// inside the node, within the tolerance of the planes of its intersections as
+// an RMS distance. Returns true if the node is now a leaf itself.
+bool simplifyOctreeNode(Generator *gen, int index) {
+    OctreeNode *node = &gen->octreeNodes[index];
+    if (node->leaf) return true;
+    // Once cancelled, the rest of the tree is left as it is.
+    if (isGeneratorCancelled(gen)) return false;
+    bool collapsible = true, empty = true;
+    for (int i = 0; i < 8; i++) {
+        if (node->children[i] < 0) continue;
+        empty = false;
+        if (!simplifyOctreeNode(gen, node->children[i])) collapsible = false;
+    }
+    // Only the root can be empty, where there is no surface at all.
+    if (!collapsible || empty) return false;
+    // Nodes reaching past the grid have corners without samples.
+    int n = gen->subdivisions;
+    if (node->x + node->size > n || node->y + node->size > n ||
+        node->z + node->size > n) {
+        return false;
+    }
+    int config;
+    if (!checkNodeTopology(gen, node, &config)) return false;
+
+    Qef merged;
+    memset(&merged, 0, sizeof(Qef));
+    for (int i = 0; i < 8; i++) {
+        if (node->children[i] < 0) continue;
+        Qef *qef = &gen->octreeNodes[node->children[i]].qef;
+        merged.count += qef->count;
+        for (int j = 0; j < 3; j++) {
+            merged.massPoint[j] += qef->massPoint[j] * qef->count;
+        }
+    }
+    if (merged.count == 0) return false;
+    for (int j = 0; j < 3; j++) {
+        merged.massPoint[j] /= merged.count;
+    }
+    for (int i = 0; i < 8; i++) {
+        if (node->children[i] < 0) continue;
+        Qef qef = gen->octreeNodes[node->children[i]].qef;
+        shiftQef(&qef, merged.massPoint);
+        for (int j = 0; j < 3; j++) {
+            for (int k = 0; k < 3; k++) {
+                merged.ata[j][k] += qef.ata[j][k];
+            }
+            merged.atb[j] += qef.atb[j];
+        }
+        merged.btb += qef.btb;
+    }
+    dvec3 position;
+    solveQef(&merged, position);
+    double tolerance = gen->simplifyTolerance;
+    if (getQefError(&merged, position) >
+        tolerance * tolerance * merged.count) {
+        return false;
+    }
+    vec3 min, max;
+    getSampleVector(gen, node->x, node->y, node->z, min);
+    getSampleVector(gen, node->x + node->size, node->y + node->size,
+                    node->z + node->size, max);
+    for (int j = 0; j < 3; j++) {
+        if (position[j] < fmin(min[j], max[j]) ||
+            position[j] > fmax(min[j], max[j])) {
+            return false;
+        }
+    }
+
+    node->leaf = true;
+    node->config = config;
+    node->qef = merged;
+    for (int j = 0; j < 3; j++) {
+        node->vertex[j] = position[j];
+    }
+    return true;
+}
+
+// Counts the leaves and collapsed nodes of the octree, for logging.
+size_t countOctreeLeaves(Generator *gen, int index) {
+    OctreeNode *node = &gen->octreeNodes[index];
+    if (node->leaf) return 1;
+    size_t count = 0;
+    for (int i = 0; i < 8; i++) {
+        if (node->children[i] >= 0) {
+            count += countOctreeLeaves(gen, node->children[i]);
+        }
+    }
+    return count;
+}
+
+// Gets a child of a node, or the node itself if it is a leaf, so that the
+// procedures below can walk down to the smaller of two neighbours.
+int getOctreeChild(Generator *gen, int index, int child) {
+    OctreeNode *node = &gen->octreeNodes[index];
+    return node->leaf ? index : node->children[child];
+}
+
+// Writes the face around an edge shared by four leaves, if the smallest of
+// them has a sign change along it. The leaves are ordered as in contourEdge,
+// and their vertices are used in the same order as generateEdgeFace, so an
+// octree that has not been simplified gives the same faces as the grid.
+void contourLeafEdge(SlabJob *job, int nodes[4], int dir) {
+    OctreeNode *leaves[4];
+    int smallest = 0;
+    for (int k = 0; k < 4; k++) {
+        leaves[k] = &job->gen->octreeNodes[nodes[k]];
+        if (leaves[k]->size < leaves[smallest]->size) smallest = k;
+    }
+    int corner = (1 - (smallest & 1)) << (dir + 1) % 3 |
+                 (1 - (smallest >> 1)) << (dir + 2) % 3;
+    int signA = leaves[smallest]->config >> corner & 1;
+    int signB = leaves[smallest]->config >> (corner | 1 << dir) & 1;
+    if (signA == signB) return;
+    // Where a large leaf meets smaller ones, it appears twice in a row,
+    // leaving a triangle. Leaves only ever repeat next to each other.
+    int distinct = 4 - (nodes[0] == nodes[1]) - (nodes[1] == nodes[3]) -
+                   (nodes[3] == nodes[2]) - (nodes[2] == nodes[0]);
+    if (distinct < 3) return;
+    OctreeNode *vertexB = leaves[1], *vertexD = leaves[2];
+    // Edges going from outside to inside face the other way.
+    if (signA) {
+        vertexB = leaves[2];
+        vertexD = leaves[1];
+    }
+    addQuad(job->mesh, leaves[0]->vertex, vertexB->vertex, leaves[3]->vertex,
+            vertexD->vertex, job->invertNormals);
+    job->quadCount++;
+}
+
+// The edge procedure, for an edge along axis dir shared by four nodes. Node k
+// is on side k & 1 of the edge along axis dir + 1, and side k >> 1 along axis
+// dir + 2. Recurses into both halves of the edge until all four are leaves.
+void contourEdge(SlabJob *job, int nodes[4], int dir) {
+    bool leaves = true;
+    for (int k = 0; k < 4; k++) {
+        if (nodes[k] < 0) return;
+        leaves = leaves && job->gen->octreeNodes[nodes[k]].leaf;
+    }
+    if (leaves) {
+        contourLeafEdge(job, nodes, dir);
+        return;
+    }
+    for (int half = 0; half < 2; half++) {
+        int children[4];
+        for (int k = 0; k < 4; k++) {
+            // The child of each node touching the edge.
+            int child = half << dir | (1 - (k & 1)) << (dir + 1) % 3 |
+                        (1 - (k >> 1)) << (dir + 2) % 3;
+            children[k] = getOctreeChild(job->gen, nodes[k], child);
+        }
+        contourEdge(job, children, dir);
+    }
+}
+
+// The face procedure, for the face between nodes[0] and nodes[1] above it
+// along axis dir. Recurses into the four quarters of the face and the four
+// edges between them.
+void contourFace(SlabJob *job, int nodes[2], int dir) {
+    if (nodes[0] < 0 || nodes[1] < 0) return;
+    Generator *gen = job->gen;
+    if (gen->octreeNodes[nodes[0]].leaf && gen->octreeNodes[nodes[1]].leaf) {
+        return;
+    }
+    for (int i = 0; i < 4; i++) {
+        int offset = (i & 1) << (dir + 1) % 3 | (i >> 1) << (dir + 2) % 3;
+        int children[] = {
+            getOctreeChild(gen, nodes[0], offset | 1 << dir),
+            getOctreeChild(gen, nodes[1], offset),
+        };
+        contourFace(job, children, dir);
+    }
+    for (int i = 1; i <= 2; i++) {
+        int edgeDir = (dir + i) % 3;
+        for (int half = 0; half < 2; half++) {
+            int children[4];
+            for (int k = 0; k < 4; k++) {
+                int bits[3];
+                bits[edgeDir] = half;
+                bits[(edgeDir + 1) % 3] = k & 1;
+                bits[(edgeDir + 2) % 3] = k >> 1;
+                // The side of the face picks the node, and the child is the
+                // one touching the face.
+                int side = bits[dir];
+                bits[dir] = 1 - side;
+                children[k] = getOctreeChild(
+                    gen, nodes[side], bits[0] | bits[1] << 1 | bits[2] << 2);
+            }
+            contourEdge(job, children, edgeDir);
+        }
+    }
+}
+
+// The cell procedure, which recurses into the children of a node, the twelve
+// faces between them and the six edges through its centre.
+void contourCell(SlabJob *job, int index) {
+    if (index < 0 || job->gen->octreeNodes[index].leaf) return;
+    if (isGeneratorCancelled(job->gen)) return;
+    int children[8];
+    memcpy(children, job->gen->octreeNodes[index].children, sizeof(children));
+    for (int i = 0; i < 8; i++) {
+        contourCell(job, children[i]);
+    }
+    for (int dir = 0; dir < 3; dir++) {
+        for (int i = 0; i < 8; i++) {
+            if (i >> dir & 1) continue;
+            int faceNodes[] = {children[i], children[i | 1 << dir]};
+            contourFace(job, faceNodes, dir);
+        }
+    }
+    for (int dir = 0; dir < 3; dir++) {
+        for (int half = 0; half < 2; half++) {
+            int edgeNodes[4];
+            for (int k = 0; k < 4; k++) {
+                edgeNodes[k] = children[half << dir | (k & 1) << (dir + 1) % 3 |
+                                        (k >> 1) << (dir + 2) % 3];
+            }
+            contourEdge(job, edgeNodes, dir);
+        }
+    }
+}
+
+// Simplifies the octree once every leaf is in it, then walks its dual to
+// write the faces of the mesh.
+void generateOctreeFaces(SlabJob *job) {
+    Generator *gen = job->gen;
+    double startTime = getTimeSeconds();
+    simplifyOctreeNode(gen, 0);
+    contourCell(job, 0);
+    if (gen->verbose) {
+        fprintf(stderr,
+                "Simplified %zu cells to %zu octree leaves, writing %zu quads "
+                "in %.2f ms\n",
+                job->leafCount, countOctreeLeaves(gen, 0), job->quadCount,
+                (getTimeSeconds() - startTime) * 1e3);
+    }
+}
+
+// Rather than running each stage over the whole grid, the pipeline advances
+// one layer at a time, so that the working set stays in cache and edges and
+// vertices only need to be kept for the layers around it. Each step samples
+// the layer above, finds the edges of the current layer, then places the
+// vertices and emits the faces of the layer below, which has all of its edges
+// by then.
+// Progress is reported as each stage finishes a layer. Cancellation is checked
+// before each layer and after its samples, and while building the faces of
+// the octree, returning false with the mesh left incomplete.
+bool generateLayers(SlabJob *job, bool simplify) {
+    Generator *gen = job->gen;
+    int sideLength = gen->subdivisions;
+    // The narrow band takes the place of bounds when both are enabled, and a
+    // usable guide turns it on for previews.
+    job->narrowBand =
+        gen->bandMargin > 0 || (gen->progressive && isGuideUsable(gen));
+    gen->blocksCulled = job->narrowBand || gen->culling;
+    if (job->narrowBand) {
+        findNarrowBand(job);
+    } else if (gen->culling) {
+        cullBlocks(job);
+    }
+
+    for (int z = 0; z < SAMPLE_LOOKAHEAD && z <= sideLength; z++) {
+        if (isGeneratorCancelled(gen)) return false;
+        generateSampleLayer(job, z);
+        reportProgress(gen, STAGE_SAMPLES, z + 1, sideLength + 1);
+    }
+    for (int z = 0; z <= sideLength; z++) {
+        if (isGeneratorCancelled(gen)) return false;
+        if (z + SAMPLE_LOOKAHEAD <= sideLength) {
+            generateSampleLayer(job, z + SAMPLE_LOOKAHEAD);
+            reportProgress(gen, STAGE_SAMPLES, z + SAMPLE_LOOKAHEAD + 1,
+                           sideLength + 1);
+            if (isGeneratorCancelled(gen)) return false;
+        }
+        if (z < sideLength) {
+            generateEdgeLayer(job, z);
+            reportProgress(gen, STAGE_EDGES, z + 1, sideLength);
+        } else {
+            // The top layer of edges is always external.
+            clearEdgeLayer(gen, z);
+        }
+        if (z > 0) {
+            compactCellLayer(job, z - 1);
+            if (simplify) {
+                insertOctreeLayer(job, z - 1);
+                job->leafCount += job->cellCount;
+            }
+            generateVertexLayer(job, z - 1);
+            reportProgress(gen, STAGE_VERTICES, z, sideLength);
+            if (!simplify) {
+                generateFaceLayer(job, z - 1);
+                reportProgress(gen, STAGE_FACES, z, sideLength);
+            }
+        }
+    }
+    // Faces can only be found once the octree is complete.
+    if (simplify) {
+        if (isGeneratorCancelled(gen)) return false;
+        generateOctreeFaces(job);
+        if (isGeneratorCancelled(gen)) return false;
+        reportProgress(gen, STAGE_FACES, sideLength, sideLength);
+    }
+    return true;
+}
+
+GenStatus generateMesh(Generator *gen, Mesh *mesh, bool invertNormals) {
+    // An unchanged mesh wanted in a different Mesh is copied across, and
+    // inverting its normals only needs its winding flipped.
+    if (!gen->meshDirty && mesh != gen->lastMesh) {
+        copyMesh(mesh, gen->lastMesh);
+        gen->lastMesh = mesh;
+        if (invertNormals != gen->lastInvertNormals) invertMeshNormals(mesh);
+        gen->lastInvertNormals = invertNormals;
+        return GEN_UPDATED;
+    }
+    if (!gen->meshDirty) {
+        if (invertNormals == gen->lastInvertNormals) return GEN_UNCHANGED;
+        invertMeshNormals(mesh);
+        gen->lastInvertNormals = invertNormals;
+        return GEN_UPDATED;
+    }
+    int sideLength = gen->subdivisions;
+    double sampleCount = (double)(sideLength + 1) * (sideLength + 1) *
+                         (sideLength + 1);
+    // Sampled normals are compared against evaluated ones when verbose.
+    bool compareNormals = gen->verbose && gen->normalMode == NORMALS_SAMPLED;
+    SlabJob job = {
+        .gen = gen,
+        .backend = getSampleBackend(gen, sampleCount),
+        .mesh = mesh,
+        .invertNormals = invertNormals,
+        .bandCells = malloc(gen->bandCount * sizeof(size_t)),
+        .bandQuads = malloc(gen->bandCount * sizeof(size_t)),
+        .quadCount = 0,
+        .leafCount = 0,
+        .culledSamples = 0,
+        .bandMisses = 0,
+        .keptSamples = 0,
+        .narrowBand = false,
+        .guided = false,
+        .intervalCount = 0,
+        .cullTime = 0.0,
+        .sampleTime = 0.0,
+        .edgeCount = 0,
+        .edgeEvaluations = 0,
+        .bandNormalError =
+            compareNormals ? calloc(gen->bandCount, sizeof(double)) : NULL,
+        .bandNormalErrorMax =
+            compareNormals ? calloc(gen->bandCount, sizeof(double)) : NULL,
+    };
+    clearMesh(mesh);
+    // Profiles must see every sample evaluated.
+    if (gen->profile) gen->samplesKept = false;
+    // Without kept samples, the grid is laid out afresh on the window.
+    if (!gen->samplesKept) {
+        gen->grid = gen->window;
+        for (int axis = 0; axis < 3; axis++) gen->gridShift[axis] = 0;
+    }
+    bool simplify = gen->simplifyTolerance > 0;
+    if (simplify) resetOctree(gen);
+    if (!generateLayers(&job, simplify)) {
+        // Whatever was sampled is incomplete, so nothing is kept, and the
+        // next call starts again from scratch.
+        clearMesh(mesh);
+        gen->samplesKept = false;
+        free(job.bandCells);
+        free(job.bandQuads);
+        free(job.bandNormalError);
+        free(job.bandNormalErrorMax);
+        return GEN_CANCELLED;
+    }
+    // Keep the samples, with the fill they were sampled with, for the next
+    // mesh.
+    gen->samplesKept = !gen->streaming;
+    for (int axis = 0; axis < 3; axis++) {
+        gen->keptLo[axis] = 0;
+        gen->keptHi[axis] = sideLength + 1;
+        gen->keptShift[axis] = 0;
+    }
+    gen->keptCulled = gen->blocksCulled;
+    float *keptFill = gen->keptFill;
+    gen->keptFill = gen->blockFill;
+    gen->blockFill = keptFill;
+    free(job.bandCells);
+    free(job.bandQuads);
+
+    if (gen->verbose) {
+        // Rows are independent, so the work should divide evenly.
+        double estimate =
+            estimateExpressionTime(gen->sdfExpr, job.backend, sampleCount) /
+            getThreadPoolSize(gen->pool);
+        fprintf(stderr,
+                "Sampled %.0f points with the %s backend on %d threads: "
+                "estimated %.2f ms, actual %.2f ms\n",
+                sampleCount, getBackendName(job.backend),
+                getThreadPoolSize(gen->pool), estimate * 1e-6,
+                job.sampleTime * 1e3);
+        double kept = atomic_load(&job.keptSamples);
+        if (kept > 0) {
+            fprintf(stderr, "Reused %.1f%% of the samples of the last mesh\n",
+                    kept / sampleCount * 100);
+        }
+        // Culled samples would have cost about as much as the others.
+        double culled = atomic_load(&job.culledSamples);
+        double saved = estimateExpressionTime(gen->sdfExpr, job.backend,
+                                              culled) /
+                           getThreadPoolSize(gen->pool) * 1e-9 -
+                       job.cullTime;
+        if (job.guided) {
+            fprintf(stderr,
+                    "Narrow band guided by the %d^3 mesh skipped %.1f%% of the "
+                    "volume in %.2f ms, saving an estimated %.2f ms\n",
+                    gen->guideSubdivisions, culled / sampleCount * 100,
+                    job.cullTime * 1e3, saved * 1e3);
+        } else if (gen->bandMargin > 0) {
+            double coarseSide = gen->cullBlocks + 1;
+            fprintf(stderr,
+                    "Narrow band skipped %.1f%% of the volume with %.0f "
+                    "coarse samples in %.2f ms, saving an estimated %.2f ms\n",
+                    culled / sampleCount * 100,
+                    coarseSide * coarseSide * coarseSide, job.cullTime * 1e3,
+                    saved * 1e3);
+        } else if (gen->culling) {
+            fprintf(stderr,
+                    "Culled %.1f%% of the volume with %d interval "
+                    "evaluations in %.2f ms, saving an estimated %.2f ms\n",
+                    culled / sampleCount * 100, job.intervalCount,
+                    job.cullTime * 1e3, saved * 1e3);
+        }
+        size_t edgeCount = atomic_load(&job.edgeCount);
+        fprintf(stderr, "Refined %zu edges with %.2f evaluations per edge\n",
+                edgeCount,
+                edgeCount ? (double)atomic_load(&job.edgeEvaluations) /
+                                edgeCount
+                          : 0.0);
+    }
+    if (compareNormals) {
+        double total = 0.0, max = 0.0;
+        for (int band = 0; band < gen->bandCount; band++) {
+            total += job.bandNormalError[band];
+            max = fmax(max, job.bandNormalErrorMax[band]);
+        }
+        size_t edgeCount = atomic_load(&job.edgeCount);
+        fprintf(stderr,
+                "Sampled normals are %.3f degrees from evaluated normals on "
+                "average, %.3f at most\n",
+                edgeCount ? glm_deg(total / edgeCount) : 0.0, glm_deg(max));
+    }
+    free(job.bandNormalError);
+    free(job.bandNormalErrorMax);
+    // Misses mean the surface may have been lost elsewhere outside the band,
+    // so they are always reported.
+    size_t bandMisses = atomic_load(&job.bandMisses);
+    if (bandMisses > 0) {
+        fprintf(stderr,
+                "Warning: the surface crossed %zu samples outside the narrow "
+                "band, which may have missed parts of it; try a larger "
+                "margin\n",
+                bandMisses);
+    }
+    gen->meshDirty = false;
+    gen->lastMesh = mesh;
+    gen->lastInvertNormals = invertNormals;
+    return GEN_UPDATED;
+}
+
+void destroyGenerator(Generator *gen) {
+    destroyThreadPool(gen->pool);
+    free(gen->samples);
+    free(gen->signs);
+    free(gen->blockFill);
+    free(gen->keptFill);
+    free(gen->coarseSamples);
+    free(gen->blockSides);
+    free(gen->guideSamples);
+    freeEdgeBands(gen);
+    free(gen->activeCells);
+    free(gen->vertices);
+    free(gen->octreeNodes);
+    free(gen);
+}
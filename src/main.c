@@ -1,12 +1,15 @@
 #include "expr.h"
+#include "expr_cache.h"
 #include "loaders.h"
 #include "mesh.h"
 #include "generator.h"
+#include "gen_worker.h"
 #include "gui.h"
 #include "user_data.h"
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #define CGLM_DEFINE_PRINTS
 #include <cglm/cglm.h>
 #include <glad/glad.h>
@@ -20,6 +23,62 @@
 const double MOVE_SPEED = 2.0;
 const double MOUSE_SENSITIVITY = 0.003;
 const double MAX_PITCH = M_PI / 2.0 - 0.01;
+// The pan buttons move the window by this fraction of its size, rounded to
+// whole cells.
+const int PAN_FRACTION = 16;
+
+/// Everything the generated mesh depends on, compared between frames to find
+/// edits.
+typedef struct {
+    char sdfExpression[512];
+    int subdivisions;
+    Window window;
+    float threshold;
+    bool invertNormals, mixedPrecision, sampledNormals, streaming, culling;
+    bool progressive;
+    float bandMargin, simplifyTolerance;
+    int backend;
+} GenSettings;
+
+/// Whether two sets of settings would generate the same mesh.
+bool genSettingsEqual(GenSettings *a, GenSettings *b) {
+    // Window is only floats, so it has no padding to compare.
+    return strcmp(a->sdfExpression, b->sdfExpression) == 0 &&
+           a->subdivisions == b->subdivisions &&
+           memcmp(&a->window, &b->window, sizeof(Window)) == 0 &&
+           a->threshold == b->threshold &&
+           a->invertNormals == b->invertNormals &&
+           a->mixedPrecision == b->mixedPrecision &&
+           a->sampledNormals == b->sampledNormals &&
+           a->streaming == b->streaming && a->culling == b->culling &&
+           a->progressive == b->progressive &&
+           a->bandMargin == b->bandMargin &&
+           a->simplifyTolerance == b->simplifyTolerance &&
+           a->backend == b->backend;
+}
+
+/// Creates a job to generate a mesh with the given settings, taking over the
+/// caller's reference to sdf.
+GenJob createGenJob(GenSettings *settings, CompiledExpr *sdf) {
+    return (GenJob){
+        .sdf = sdf,
+        .subdivisions = settings->subdivisions,
+        .window = settings->window,
+        .threshold = settings->threshold,
+        .invertNormals = settings->invertNormals,
+        .precision =
+            settings->mixedPrecision ? PRECISION_MIXED : PRECISION_FLOAT,
+        .normalMode =
+            settings->sampledNormals ? NORMALS_SAMPLED : NORMALS_EVALUATED,
+        .backend = settings->backend,
+        .streaming = settings->streaming,
+        .culling = settings->culling,
+        .progressive = settings->progressive,
+        .bandMargin = settings->bandMargin,
+        .simplifyTolerance = settings->simplifyTolerance,
+        .profile = NULL,
+    };
+}
 
 /// Creates a GLFW window with the necessary OpenGL context.
 GLFWwindow *createWindow(AppUserData *userData) {
@@ -76,19 +135,45 @@ int main() {
 
     double lastTime = glfwGetTime();
 
-    Mesh *genMesh = createMesh(shaderProgram);
-    Generator *gen = createGenerator();
+    // Meshes are generated in the background into a back mesh, which is
+    // swapped in as genMesh when it is done, so that the GUI stays
+    // responsive.
+    Mesh *frontMesh = createMesh(shaderProgram);
+    Mesh *backMesh = createMesh(shaderProgram);
+    Mesh *genMesh = frontMesh;
+    GenWorker *worker = createGenWorker(frontMesh, backMesh);
+    ExprCache *exprCache = createExpressionCache(16);
+    // The expression being profiled, as token positions in the report refer
+    // to it.
+    char profiledExpression[512] = "";
 
     bool autoUpdate = true;
+    bool progressive = true;
+    // The settings of the last mesh, zeroed so that the first frame
+    // generates one.
+    GenSettings generated;
+    memset(&generated, 0, sizeof(GenSettings));
+    // The last expression that failed to compile, which auto update skips
+    // until it is edited, rather than parsing it again every frame.
+    char failedExpression[512] = "";
 
     int subdivisions = 32;
     Window genWindow = {{-1.5, -1.5, -1.5}, {1.5, 1.5, 1.5}};
     float threshold = 1.5;
     bool invertNormals = false;
+    bool mixedPrecision = false;
+    bool sampledNormals = false;
+    bool streaming = false;
+    bool culling = true;
+    float bandMargin = 0.0;
+    float simplifyTolerance = 0.0;
+    int backend = BACKEND_AUTO;
+    const char *backendNames[] = {"Auto Backend", "Interpreter", "Batch"};
     char sdfExpression[512] = "x^2 + y^2 + z^2 + noise(x, y, z)";
     char errMsg[128] = "";
 
     char exportFilename[64] = "sdf_export.obj";
+    char programFilename[64] = "sdf_program.sdfp";
 
     while (!glfwWindowShouldClose(window)) {
         double delta = glfwGetTime() - lastTime;
@@ -96,6 +181,25 @@ int main() {
 
         glfwPollEvents();
 
+        // Finished meshes are uploaded here, as only this thread may use GL.
+        ExprProfile *profile;
+        if (takeGenResult(worker, &genMesh, &profile)) {
+            updateMeshBuffer(genMesh);
+            if (profile) {
+                writeProfileReport(profile, profiledExpression, stdout);
+                FILE *file = fopen("sdf_profile.json", "w");
+                if (file) {
+                    writeProfileReportJSON(profile, profiledExpression, file);
+                    fclose(file);
+                } else {
+                    strcpy(errMsg,
+                           "Error: could not open sdf_profile.json for "
+                           "writing.");
+                }
+                destroyExpressionProfile(profile);
+            }
+        }
+
         if (glfwGetKey(window, GLFW_KEY_ESCAPE) == GLFW_PRESS) {
             glfwSetWindowShouldClose(window, GLFW_TRUE);
         }
@@ -190,23 +294,46 @@ int main() {
                 nuklear, "Mesh Generator",
                 nk_rect(10, 10, 400, logicalHeight - 20),
                 NK_WINDOW_TITLE | NK_WINDOW_BORDER | NK_WINDOW_MINIMIZABLE)) {
+            GenSettings current;
+            strcpy(current.sdfExpression, sdfExpression);
+            current.subdivisions = subdivisions;
+            current.window = genWindow;
+            current.threshold = threshold;
+            current.invertNormals = invertNormals;
+            current.mixedPrecision = mixedPrecision;
+            current.sampledNormals = sampledNormals;
+            current.streaming = streaming;
+            current.culling = culling;
+            current.progressive = progressive;
+            current.bandMargin = bandMargin;
+            current.simplifyTolerance = simplifyTolerance;
+            current.backend = backend;
+            bool edited = !genSettingsEqual(&current, &generated) &&
+                          strcmp(sdfExpression, failedExpression) != 0;
+
             nk_layout_row_dynamic(nuklear, 60, 1);
-            if (nk_button_label(nuklear, "Generate Mesh") || autoUpdate) {
-                Token sdfParsed[512];
-                if (parseExpression(sdfExpression, sdfParsed, 512, errMsg) &&
-                    validateExpression(sdfParsed, errMsg)) {
+            if (nk_button_label(nuklear, "Generate Mesh") ||
+                (autoUpdate && edited)) {
+                CompiledExpr *compiled = acquireExpression(
+                    exprCache, sdfExpression, EXPR_OPTIMIZE, errMsg);
+                if (compiled) {
                     errMsg[0] = 0;
-                    setGeneratorSize(gen, subdivisions);
-                    setGeneratorSDF(gen, sdfParsed);
-                    setGeneratorWindow(gen, genWindow);
-                    setGeneratorThreshold(gen, threshold);
-                    generateMesh(gen, genMesh, invertNormals);
-                    updateMeshBuffer(genMesh);
+                    failedExpression[0] = 0;
+                    generated = current;
+                    submitGenJob(worker, createGenJob(&current, compiled));
+                } else {
+                    strcpy(failedExpression, sdfExpression);
                 }
             }
+            if (isGenWorkerBusy(worker)) {
+                nk_layout_row_dynamic(nuklear, 20, 1);
+                nk_size progress = getGenWorkerProgress(worker) * 1000;
+                nk_prog(nuklear, progress, 1000, nk_false);
+            }
             nk_layout_row_dynamic(nuklear, 30, 1);
-            autoUpdate = nk_check_label(
-                nuklear, "Auto Update (subdivisions < 64)", autoUpdate);
+            autoUpdate = nk_check_label(nuklear, "Auto Update", autoUpdate);
+            progressive =
+                nk_check_label(nuklear, "Progressive Preview", progressive);
             const float ratio[] = {0.2, 0.8};
             nk_layout_row(nuklear, NK_DYNAMIC, 120, 2, ratio);
             nk_label(nuklear, "SDF: ", NK_TEXT_RIGHT);
@@ -221,14 +348,24 @@ int main() {
                               0.01);
             invertNormals =
                 nk_check_label(nuklear, "Invert Normals", invertNormals);
+            mixedPrecision =
+                nk_check_label(nuklear, "Mixed Precision", mixedPrecision);
+            sampledNormals = nk_check_label(
+                nuklear, "Fast Normals (preview)", sampledNormals);
+            culling = nk_check_label(nuklear, "Cull Empty Space", culling);
+            nk_property_float(nuklear, "Narrow Band Margin", 0, &bandMargin,
+                              1000, 0.1, 0.01);
+            nk_property_float(nuklear, "Simplify Tolerance", 0,
+                              &simplifyTolerance, 1, 0.001, 0.0001);
+            backend = nk_combo(nuklear, backendNames, 3, backend, 25,
+                               nk_vec2(200, 100));
             if (nk_tree_push(nuklear, NK_TREE_TAB, "SDF Window",
                              NK_MAXIMIZED)) {
                 nk_layout_row_dynamic(nuklear, 30, 1);
-                nk_property_int(nuklear, "Subdivisions", 2, &subdivisions, 128,
+                nk_property_int(nuklear, "Subdivisions", 2, &subdivisions, 4096,
                                 1, 0.5);
-                if (subdivisions > 64) {
-                    autoUpdate = false;
-                }
+                streaming = nk_check_label(
+                    nuklear, "Stream Samples (low memory)", streaming);
                 nk_layout_row_dynamic(nuklear, 30, 2);
                 nk_property_float(nuklear, "X Min", -1000, &genWindow.min[0],
                                   1000, 1, 0.01);
@@ -242,14 +379,50 @@ int main() {
                                   1000, 1, 0.01);
                 nk_property_float(nuklear, "Z Max", -1000, &genWindow.max[2],
                                   1000, 1, 0.01);
+                // Panning moves the window by whole cells, so that most of
+                // the samples can be kept.
+                nk_layout_row_dynamic(nuklear, 30, 6);
+                const char *panLabels[] = {"-X", "+X", "-Y", "+Y", "-Z", "+Z"};
+                for (int i = 0; i < 6; i++) {
+                    if (!nk_button_label(nuklear, panLabels[i])) continue;
+                    int axis = i / 2;
+                    float extent = genWindow.max[axis] - genWindow.min[axis];
+                    int cells = subdivisions / PAN_FRACTION;
+                    if (cells < 1) cells = 1;
+                    float offset = extent / subdivisions * cells;
+                    if (i % 2 == 0) offset = -offset;
+                    genWindow.min[axis] += offset;
+                    genWindow.max[axis] += offset;
+                }
                 nk_tree_pop(nuklear);
             }
             if (nk_tree_push(nuklear, NK_TREE_TAB, "Export", NK_MAXIMIZED)) {
                 nk_layout_row_dynamic(nuklear, 60, 1);
                 if (nk_button_label(nuklear, "Export Model")) {
                     FILE *file = fopen(exportFilename, "w");
-                    exportMesh(genMesh, file);
-                    fclose(file);
+                    if (file) {
+                        exportMesh(genMesh, file);
+                        fclose(file);
+                        errMsg[0] = 0;
+                    } else {
+                        strcpy(errMsg, "Error: could not open the export file "
+                                       "for writing.");
+                    }
+                }
+                if (nk_button_label(nuklear, "Profile SDF")) {
+                    // Generates the mesh once with profiling enabled, writing
+                    // a text report to stdout and a JSON report beside it
+                    // when it is done. The expression is compiled as written,
+                    // rather than optimized or shared through the cache.
+                    CompiledExpr *compiled =
+                        compileExpressionText(sdfExpression, 0, errMsg);
+                    if (compiled) {
+                        strcpy(profiledExpression, sdfExpression);
+                        GenJob job = createGenJob(&current, compiled);
+                        job.profile = createExpressionProfile(
+                            getExpressionTokens(compiled));
+                        submitGenJob(worker, job);
+                    }
                 }
                 const float ratio[] = {0.2, 0.8};
                 nk_layout_row(nuklear, NK_DYNAMIC, 30, 2, ratio);
@@ -257,6 +430,34 @@ int main() {
                 nk_edit_string_zero_terminated(nuklear, NK_EDIT_FIELD,
                                                exportFilename, 64,
                                                nk_filter_default);
+                // Programs are saved optimized, and a loaded program is
+                // shown until the settings are next edited.
+                nk_layout_row_dynamic(nuklear, 30, 2);
+                if (nk_button_label(nuklear, "Save Program")) {
+                    CompiledExpr *compiled = acquireExpression(
+                        exprCache, sdfExpression, EXPR_OPTIMIZE, errMsg);
+                    if (compiled) {
+                        if (saveExpression(getExpressionTokens(compiled),
+                                           programFilename, errMsg)) {
+                            errMsg[0] = 0;
+                        }
+                        releaseExpression(compiled);
+                    }
+                }
+                if (nk_button_label(nuklear, "Load Program")) {
+                    CompiledExpr *compiled =
+                        loadCompiledExpression(programFilename, errMsg);
+                    if (compiled) {
+                        errMsg[0] = 0;
+                        generated = current;
+                        submitGenJob(worker, createGenJob(&current, compiled));
+                    }
+                }
+                nk_layout_row(nuklear, NK_DYNAMIC, 30, 2, ratio);
+                nk_label(nuklear, "Program: ", NK_TEXT_RIGHT);
+                nk_edit_string_zero_terminated(nuklear, NK_EDIT_FIELD,
+                                               programFilename, 64,
+                                               nk_filter_default);
                 nk_tree_pop(nuklear);
             }
         }
@@ -267,8 +468,10 @@ int main() {
         glfwSwapBuffers(window);
     }
 
-    destroyGenerator(gen);
-    destroyMesh(genMesh);
+    destroyGenWorker(worker);
+    destroyExpressionCache(exprCache);
+    destroyMesh(frontMesh);
+    destroyMesh(backMesh);
     glDeleteProgram(shaderProgram);
 
     destroyGUI(gui);
@@ -66,16 +66,14 @@ void expandVertices(Mesh *mesh) {
         realloc(mesh->vertices, mesh->vertex_capacity * sizeof(Vertex));
 }
 
-void pushVertex(Mesh *mesh, vec3 pos, vec3 normal) {
-    if (mesh->vertex_length >= mesh->vertex_capacity) {
-        expandVertices(mesh);
-    }
-    glm_vec3_copy(pos, mesh->vertices[mesh->vertex_length].pos);
-    glm_vec3_copy(normal, mesh->vertices[mesh->vertex_length].normal);
-    mesh->vertex_length++;
+void setVertex(Vertex *vertex, vec3 pos, vec3 normal) {
+    glm_vec3_copy(pos, vertex->pos);
+    glm_vec3_copy(normal, vertex->normal);
 }
 
-void addQuad(Mesh *mesh, vec3 a, vec3 b, vec3 c, vec3 d, bool invertNormals) {
+/// Writes the six vertices of a quad to out.
+void writeQuad(Vertex *out, vec3 a, vec3 b, vec3 c, vec3 d,
+               bool invertNormals) {
     // Calculate edge vectors
     vec3 ab, bc, cd, da;
     glm_vec3_sub(b, a, ab);
@@ -90,6 +88,19 @@ void addQuad(Mesh *mesh, vec3 a, vec3 b, vec3 c, vec3 d, bool invertNormals) {
     glm_vec3_cross(bc, cd, normalC);
     glm_vec3_cross(cd, da, normalD);
 
+    // Where two corners meet, as in the triangles of simplified meshes, their
+    // normals vanish, so they take the normal of the whole quad instead.
+    vec3 quadNormal;
+    glm_vec3_add(normalA, normalB, quadNormal);
+    glm_vec3_add(quadNormal, normalC, quadNormal);
+    glm_vec3_add(quadNormal, normalD, quadNormal);
+    vec3 *normals[] = {&normalA, &normalB, &normalC, &normalD};
+    for (int i = 0; i < 4; i++) {
+        if (glm_vec3_norm2(*normals[i]) == 0) {
+            glm_vec3_copy(quadNormal, *normals[i]);
+        }
+    }
+
     if (invertNormals) {
         glm_vec3_negate(normalA);
         glm_vec3_negate(normalB);
@@ -97,21 +108,67 @@ void addQuad(Mesh *mesh, vec3 a, vec3 b, vec3 c, vec3 d, bool invertNormals) {
         glm_vec3_negate(normalD);
     }
 
-    // Push all vertices, with correct winding
+    // Write all vertices, with correct winding
     if (!invertNormals) {
-        pushVertex(mesh, a, normalA);
-        pushVertex(mesh, b, normalB);
-        pushVertex(mesh, d, normalD);
-        pushVertex(mesh, d, normalD);
-        pushVertex(mesh, b, normalB);
-        pushVertex(mesh, c, normalC);
+        setVertex(&out[0], a, normalA);
+        setVertex(&out[1], b, normalB);
+        setVertex(&out[2], d, normalD);
+        setVertex(&out[3], d, normalD);
+        setVertex(&out[4], b, normalB);
+        setVertex(&out[5], c, normalC);
     } else {
-        pushVertex(mesh, a, normalA);
-        pushVertex(mesh, d, normalD);
-        pushVertex(mesh, b, normalB);
-        pushVertex(mesh, b, normalB);
-        pushVertex(mesh, d, normalD);
-        pushVertex(mesh, c, normalC);
+        setVertex(&out[0], a, normalA);
+        setVertex(&out[1], d, normalD);
+        setVertex(&out[2], b, normalB);
+        setVertex(&out[3], b, normalB);
+        setVertex(&out[4], d, normalD);
+        setVertex(&out[5], c, normalC);
+    }
+}
+
+void addQuad(Mesh *mesh, vec3 a, vec3 b, vec3 c, vec3 d, bool invertNormals) {
+    while (mesh->vertex_length + 6 > mesh->vertex_capacity) {
+        expandVertices(mesh);
+    }
+    writeQuad(&mesh->vertices[mesh->vertex_length], a, b, c, d, invertNormals);
+    mesh->vertex_length += 6;
+}
+
+void resizeMeshQuads(Mesh *mesh, size_t quadCount) {
+    mesh->vertex_length = quadCount * 6;
+    while (mesh->vertex_length > mesh->vertex_capacity) {
+        expandVertices(mesh);
+    }
+}
+
+void setQuad(Mesh *mesh, size_t index, vec3 a, vec3 b, vec3 c, vec3 d,
+             bool invertNormals) {
+    writeQuad(&mesh->vertices[index * 6], a, b, c, d, invertNormals);
+}
+
+void copyMesh(Mesh *mesh, Mesh *source) {
+    mesh->vertex_length = source->vertex_length;
+    while (mesh->vertex_length > mesh->vertex_capacity) {
+        expandVertices(mesh);
+    }
+    memcpy(mesh->vertices, source->vertices,
+           mesh->vertex_length * sizeof(Vertex));
+}
+
+void invertMeshNormals(Mesh *mesh) {
+    for (size_t i = 0; i < mesh->vertex_length; i += 6) {
+        // Quads are written as a, b, d, d, b, c, or a, d, b, b, d, c when
+        // inverted, so swapping the middle pairs switches between the two.
+        Vertex *quad = &mesh->vertices[i];
+        Vertex temp = quad[1];
+        quad[1] = quad[2];
+        quad[2] = temp;
+        temp = quad[3];
+        quad[3] = quad[4];
+        quad[4] = temp;
+        for (int j = 0; j < 6; j++) {
+            glm_vec3_negate(quad[j].normal);
+        }
     }
 }
 
@@ -144,20 +201,27 @@ void outputVertex(vec3 pos, FILE *file) {
 }
 
 void exportMesh(Mesh *mesh, FILE *file) {
-    int vertIndex = 1;
-    for (int i = 0; i < mesh->vertex_length; i += 6) {
+    size_t vertIndex = 1;
+    for (size_t i = 0; i < mesh->vertex_length; i += 6) {
         outputVertex(mesh->vertices[i].pos, file);
         outputVertex(mesh->vertices[i + 1].pos, file);
         outputVertex(mesh->vertices[i + 5].pos, file);
         outputVertex(mesh->vertices[i + 2].pos, file);
         fprintf(file, "f");
         for (int j = 0; j < 4; j++) {
-            fprintf(file, " %d", vertIndex++);
+            fprintf(file, " %zu", vertIndex++);
         }
         fprintf(file, "\n");
     }
 }
 
+size_t getMeshVertexCount(Mesh *mesh) { return mesh->vertex_length; }
+
+void getMeshVertex(Mesh *mesh, size_t index, vec3 pos, vec3 normal) {
+    glm_vec3_copy(mesh->vertices[index].pos, pos);
+    glm_vec3_copy(mesh->vertices[index].normal, normal);
+}
+
 void destroyMesh(Mesh *mesh) {
     glDeleteVertexArrays(1, &mesh->VAO);
     glDeleteBuffers(1, &mesh->VBO);
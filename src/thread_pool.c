@@ -0,0 +1,191 @@
+#include "thread_pool.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+
+// Tasks waiting to run on one thread, as a range from begin to end. The owner
+// takes tasks from the front, and other threads steal from the back.
+typedef struct {
+    pthread_mutex_t lock;
+    int begin, end;
+    // Keep each deque on its own cache line, so locking one does not slow
+    // down its neighbours.
+    char padding[64];
+} TaskDeque;
+
+typedef struct {
+    ThreadPool *pool;
+    int index;
+} Worker;
+
+struct ThreadPool {
+    int threadCount;
+    pthread_t *threads;
+    Worker *workers;
+    pthread_mutex_t lock;
+    pthread_cond_t jobReady;
+    pthread_cond_t jobDone;
+    // The current job. Each new job increments generation, which wakes the
+    // workers.
+    unsigned long generation;
+    bool stopping;
+    TaskFunction function;
+    void *data;
+    int taskCount;
+    TaskDeque *deques;
+    int activeWorkers;
+};
+
+// Take the next task from the front of a thread's own deque.
+bool popTask(TaskDeque *deque, int *task) {
+    pthread_mutex_lock(&deque->lock);
+    bool found = deque->begin < deque->end;
+    if (found) *task = deque->begin++;
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+// Steal the back half of another thread's tasks into this thread's deque.
+bool stealTasks(ThreadPool *pool, int thread) {
+    for (int i = 1; i < pool->threadCount; i++) {
+        TaskDeque *victim = &pool->deques[(thread + i) % pool->threadCount];
+        pthread_mutex_lock(&victim->lock);
+        int remaining = victim->end - victim->begin;
+        int begin = victim->end - (remaining + 1) / 2;
+        int end = victim->end;
+        if (remaining > 0) victim->end = begin;
+        pthread_mutex_unlock(&victim->lock);
+        if (remaining > 0) {
+            TaskDeque *deque = &pool->deques[thread];
+            pthread_mutex_lock(&deque->lock);
+            deque->begin = begin;
+            deque->end = end;
+            pthread_mutex_unlock(&deque->lock);
+            return true;
+        }
+    }
+    return false;
+}
+
+// Run tasks until every deque is empty. Tasks are only ever moved between
+// deques, never added, so once a thread finds them all empty, any remaining
+// tasks are held by a thread that will run them itself.
+void runClaimedTasks(ThreadPool *pool, int thread) {
+    int task;
+    do {
+        while (popTask(&pool->deques[thread], &task)) {
+            pool->function(pool->data, task, thread);
+        }
+    } while (stealTasks(pool, thread));
+}
+
+void *workerMain(void *arg) {
+    Worker *worker = arg;
+    ThreadPool *pool = worker->pool;
+    unsigned long seenGeneration = 0;
+    pthread_mutex_lock(&pool->lock);
+    while (true) {
+        while (!pool->stopping && pool->generation == seenGeneration) {
+            pthread_cond_wait(&pool->jobReady, &pool->lock);
+        }
+        if (pool->stopping) break;
+        seenGeneration = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
+
+        runClaimedTasks(pool, worker->index);
+
+        pthread_mutex_lock(&pool->lock);
+        pool->activeWorkers--;
+        if (pool->activeWorkers == 0) pthread_cond_signal(&pool->jobDone);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+ThreadPool *createThreadPool(int threadCount) {
+    if (threadCount <= 0) threadCount = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threadCount <= 0) threadCount = 1;
+    ThreadPool *pool = malloc(sizeof(ThreadPool));
+    pool->threadCount = threadCount;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->jobReady, NULL);
+    pthread_cond_init(&pool->jobDone, NULL);
+    pool->generation = 0;
+    pool->stopping = false;
+    pool->taskCount = 0;
+    pool->activeWorkers = 0;
+    pool->deques = malloc(threadCount * sizeof(TaskDeque));
+    for (int i = 0; i < threadCount; i++) {
+        pthread_mutex_init(&pool->deques[i].lock, NULL);
+        pool->deques[i].begin = 0;
+        pool->deques[i].end = 0;
+    }
+
+    // The calling thread is thread 0, so only threadCount - 1 are started.
+    pool->threads = malloc(threadCount * sizeof(pthread_t));
+    pool->workers = malloc(threadCount * sizeof(Worker));
+    for (int i = 1; i < threadCount; i++) {
+        pool->workers[i] = (Worker){pool, i};
+        pthread_create(&pool->threads[i], NULL, workerMain, &pool->workers[i]);
+    }
+    return pool;
+}
+
+int getThreadPoolSize(ThreadPool *pool) { return pool->threadCount; }
+
+void runTasks(ThreadPool *pool, int taskCount, TaskFunction function,
+              void *data) {
+    // Small jobs are not worth waking the workers for.
+    if (pool->threadCount == 1 || taskCount <= 1) {
+        for (int task = 0; task < taskCount; task++) {
+            function(data, task, 0);
+        }
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->function = function;
+    pool->data = data;
+    pool->taskCount = taskCount;
+    // Each thread starts with a contiguous share of the tasks, so neighbouring
+    // tasks tend to run on the same thread until stealing is needed.
+    for (int i = 0; i < pool->threadCount; i++) {
+        pool->deques[i].begin = (long)taskCount * i / pool->threadCount;
+        pool->deques[i].end = (long)taskCount * (i + 1) / pool->threadCount;
+    }
+    pool->activeWorkers = pool->threadCount - 1;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->jobReady);
+    pthread_mutex_unlock(&pool->lock);
+
+    runClaimedTasks(pool, 0);
+
+    // Workers may still be finishing their last task.
+    pthread_mutex_lock(&pool->lock);
+    while (pool->activeWorkers > 0) {
+        pthread_cond_wait(&pool->jobDone, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void destroyThreadPool(ThreadPool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = true;
+    pthread_cond_broadcast(&pool->jobReady);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 1; i < pool->threadCount; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->jobReady);
+    pthread_cond_destroy(&pool->jobDone);
+    for (int i = 0; i < pool->threadCount; i++) {
+        pthread_mutex_destroy(&pool->deques[i].lock);
+    }
+    free(pool->deques);
+    free(pool->threads);
+    free(pool->workers);
+    free(pool);
+}
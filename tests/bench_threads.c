@@ -0,0 +1,71 @@
+// Measures how generation scales with the number of threads in the pool, on
+// a noise-heavy SDF. Each thread count is timed over a few runs, keeping the
+// fastest, and must give the same mesh as a single thread.
+//
+// Usage: bench_threads [subdivisions] [max threads]
+#include "test_support.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define BENCH_RUNS 3
+
+char benchSDF[] = "x^2 + y^2 + z^2 + noise(x * 4, y * 4, z * 4) * 0.5 + "
+                  "noise(x * 9, y * 9, z * 9) * 0.25 + "
+                  "noise(x * 17, y * 17, z * 17) * 0.125";
+
+// The fastest of several generations, in seconds.
+double timeGeneration(Generator *gen, Mesh *mesh) {
+    double best = 0;
+    for (int run = 0; run < BENCH_RUNS; run++) {
+        // Samples are kept between meshes, so drop them to time a full
+        // generation.
+        resetGeneratorSamples(gen);
+        double start = getTestTime();
+        generateMesh(gen, mesh, false);
+        double elapsed = getTestTime() - start;
+        if (run == 0 || elapsed < best) best = elapsed;
+    }
+    return best;
+}
+
+int main(int argc, char **argv) {
+    stubMeshGL();
+    int subdivisions = argc > 1 ? atoi(argv[1]) : 128;
+    int maxThreads = argc > 2 ? atoi(argv[2]) : sysconf(_SC_NPROCESSORS_ONLN);
+    if (maxThreads < 1) maxThreads = 1;
+
+    Token sdf[TEST_MAX_TOKENS];
+    parseTestExpression(benchSDF, sdf);
+    Generator *gen = createTestGenerator(sdf, subdivisions, 1.5, 1.5);
+    // The interpreter is the backend whose cost is dominated by evaluation,
+    // so it shows the scaling of the pool most clearly.
+    setGeneratorBackend(gen, BACKEND_INTERPRETER);
+    Mesh *serialMesh = createMesh(0);
+    Mesh *mesh = createMesh(0);
+
+    printf("%d^3 samples, %d processors online\n", subdivisions,
+           (int)sysconf(_SC_NPROCESSORS_ONLN));
+    printf("%8s %10s %8s %10s\n", "threads", "time (ms)", "speedup",
+           "efficiency");
+    setGeneratorThreads(gen, 1);
+    double serialTime = timeGeneration(gen, serialMesh);
+    printf("%8d %10.1f %8.2f %9.0f%%\n", 1, serialTime * 1e3, 1.0, 100.0);
+    // Powers of two up to the limit, then the limit itself.
+    for (int threads = 2; threads <= maxThreads; threads *= 2) {
+        if (threads * 2 > maxThreads) threads = maxThreads;
+        setGeneratorThreads(gen, threads);
+        double time = timeGeneration(gen, mesh);
+        double speedup = serialTime / time;
+        printf("%8d %10.1f %8.2f %9.0f%%\n", threads, time * 1e3, speedup,
+               100.0 * speedup / threads);
+        CHECK(meshesEqual(mesh, serialMesh));
+        if (threads == maxThreads) break;
+    }
+
+    destroyMesh(mesh);
+    destroyMesh(serialMesh);
+    destroyGenerator(gen);
+    return finishTest();
+}
@@ -0,0 +1,78 @@
+// Checks that cancelling generation part way through each stage leaves the
+// mesh empty, and that the next mesh matches one generated from scratch.
+#include "test_support.h"
+
+#include <stdatomic.h>
+
+char cancelSDF[] = "x^2 + y^2 + z^2 + noise(x * 4, y * 4, z * 4) * 0.5";
+
+// Where to raise the cancellation flag from the progress function.
+typedef struct {
+    atomic_bool cancel;
+    GenStage stage;
+    int layer;
+} CancelPoint;
+
+void cancelAtLayer(void *data, GenStage stage, int done, int total) {
+    CancelPoint *point = data;
+    if (stage == point->stage && done == point->layer) {
+        atomic_store(&point->cancel, true);
+    }
+}
+
+// Generates with the flag raised once stage has finished layer, then again
+// with it lowered, checking the result against reference.
+void checkCancel(Generator *gen, GenStage stage, int layer, Mesh *reference) {
+    CancelPoint point = {.stage = stage, .layer = layer};
+    atomic_init(&point.cancel, false);
+    setGeneratorCancel(gen, &point.cancel);
+    setGeneratorProgress(gen, cancelAtLayer, &point);
+    Mesh *mesh = createMesh(0);
+    CHECK(generateMesh(gen, mesh, false) == GEN_CANCELLED);
+    CHECK(getMeshVertexCount(mesh) == 0);
+
+    setGeneratorProgress(gen, NULL, NULL);
+    atomic_store(&point.cancel, false);
+    CHECK(generateMesh(gen, mesh, false) == GEN_UPDATED);
+    CHECK(meshesEqual(mesh, reference));
+    CHECK(generateMesh(gen, mesh, false) == GEN_UNCHANGED);
+    setGeneratorCancel(gen, NULL);
+    destroyMesh(mesh);
+}
+
+int main(void) {
+    stubMeshGL();
+    Token sdf[TEST_MAX_TOKENS];
+    parseTestExpression(cancelSDF, sdf);
+
+    for (int simplify = 0; simplify < 2; simplify++) {
+        Generator *gen = createTestGenerator(sdf, 48, 1.5, 1.0);
+        setGeneratorSimplification(gen, simplify ? 1e-3 : 0.0);
+        Mesh *reference = createMesh(0);
+        CHECK(generateMesh(gen, reference, false) == GEN_UPDATED);
+
+        // The samples are kept otherwise, so the next mesh would be
+        // unchanged without being generated at all.
+        resetGeneratorSamples(gen);
+        checkCancel(gen, STAGE_SAMPLES, 1, reference);
+        resetGeneratorSamples(gen);
+        checkCancel(gen, STAGE_EDGES, 24, reference);
+        resetGeneratorSamples(gen);
+        // When simplifying, the octree is built once the last layer of
+        // vertices is placed, which is otherwise followed by its faces.
+        checkCancel(gen, STAGE_VERTICES, simplify ? 48 : 47, reference);
+        // A flag raised before generation starts is seen too.
+        resetGeneratorSamples(gen);
+        atomic_bool cancel;
+        atomic_init(&cancel, true);
+        setGeneratorCancel(gen, &cancel);
+        Mesh *mesh = createMesh(0);
+        CHECK(generateMesh(gen, mesh, false) == GEN_CANCELLED);
+        setGeneratorCancel(gen, NULL);
+        destroyMesh(mesh);
+
+        destroyMesh(reference);
+        destroyGenerator(gen);
+    }
+    return finishTest();
+}
@@ -0,0 +1,78 @@
+// Checks that skipping samples does not change the mesh: interval culling
+// and a narrow band with a safe margin must give exactly the mesh of sampling
+// everything, as must the final level of a progressive preview.
+#include "test_support.h"
+
+#define SUBDIVISIONS 64
+
+char cullingSDF[] = "x^2 + y^2 + z^2 + noise(x * 4, y * 4, z * 4) * 0.5";
+
+// Generates a mesh with every sample taken, for comparison.
+Mesh *generateReference(Token *sdf, Precision precision) {
+    Generator *gen = createTestGenerator(sdf, SUBDIVISIONS, 1.5, 1.0);
+    setGeneratorCulling(gen, false);
+    setGeneratorPrecision(gen, precision);
+    Mesh *mesh = createMesh(0);
+    generateMesh(gen, mesh, false);
+    destroyGenerator(gen);
+    return mesh;
+}
+
+void checkCulling(Token *sdf, Precision precision, Mesh *reference) {
+    Generator *gen = createTestGenerator(sdf, SUBDIVISIONS, 1.5, 1.0);
+    setGeneratorPrecision(gen, precision);
+    Mesh *mesh = createMesh(0);
+    generateMesh(gen, mesh, false);
+    CHECK(getMeshVertexCount(mesh) > 0);
+    CHECK(meshesEqual(mesh, reference));
+    destroyMesh(mesh);
+    destroyGenerator(gen);
+}
+
+// With this margin, and the blocks around the band sampled too, every block
+// the surface of this field passes through is sampled.
+void checkNarrowBand(Token *sdf, Precision precision, Mesh *reference) {
+    Generator *gen = createTestGenerator(sdf, SUBDIVISIONS, 1.5, 1.0);
+    setGeneratorPrecision(gen, precision);
+    setGeneratorNarrowBand(gen, 0.5);
+    Mesh *mesh = createMesh(0);
+    generateMesh(gen, mesh, false);
+    CHECK(meshesEqual(mesh, reference));
+    destroyMesh(mesh);
+    destroyGenerator(gen);
+}
+
+// Generates the levels of a progressive preview, each guided by the last,
+// before the target, which must not be.
+void checkProgressive(Token *sdf, Precision precision, Mesh *reference) {
+    Generator *gen = createTestGenerator(sdf, 16, 1.5, 1.0);
+    setGeneratorPrecision(gen, precision);
+    setGeneratorProgressive(gen, true);
+    setGeneratorPreview(gen, true);
+    Mesh *mesh = createMesh(0);
+    for (int size = 16; size < SUBDIVISIONS; size *= 2) {
+        setGeneratorSize(gen, size);
+        generateMesh(gen, mesh, false);
+    }
+    setGeneratorSize(gen, SUBDIVISIONS);
+    setGeneratorPreview(gen, false);
+    generateMesh(gen, mesh, false);
+    CHECK(meshesEqual(mesh, reference));
+    destroyMesh(mesh);
+    destroyGenerator(gen);
+}
+
+int main(void) {
+    stubMeshGL();
+    Token sdf[TEST_MAX_TOKENS];
+    parseTestExpression(cullingSDF, sdf);
+    Precision precisions[] = {PRECISION_FLOAT, PRECISION_MIXED};
+    for (int i = 0; i < 2; i++) {
+        Mesh *reference = generateReference(sdf, precisions[i]);
+        checkCulling(sdf, precisions[i], reference);
+        checkNarrowBand(sdf, precisions[i], reference);
+        checkProgressive(sdf, precisions[i], reference);
+        destroyMesh(reference);
+    }
+    return finishTest();
+}
@@ -0,0 +1,98 @@
+// Checks that the double precision evaluator used by mixed precision mode
+// agrees with the float one, for every function, and that meshes generated in
+// both modes are close.
+#include "test_support.h"
+
+#include <math.h>
+
+#define POINTS_PER_AXIS 9
+// Float evaluations are compared to double ones relative to the size of the
+// result, or of 1 for small results.
+#define VALUE_TOLERANCE 1e-4
+// Mixed precision vertices may move by this fraction of a cell.
+#define VERTEX_TOLERANCE 0.1
+
+char *precisionSDFs[] = {
+    "x^2 + y^2 + z^2",
+    "abs(x) + min(y, z) - max(x, -z) + floor(x * 3) / 3",
+    "sin(x * 3) * cos(y * 2) + tan(z * 0.5)",
+    "asin(x / 3) + acos(y / 3) + atan(z) + atan2(x, y + 3)",
+    "ln(x^2 + 1) + log(2, y^2 + 2) + sqrt(z^2 + 0.5) + nroot(3, x^2 + 1)",
+    "x * y / (z^2 + 1) - pi * e",
+    "noise(x * 4, y * 4, z * 4) * 0.5 + x^2 + y^2 + z^2",
+};
+
+// Whether a float result is within tolerance of a double one.
+bool agrees(float value, double expected) {
+    return fabs(value - expected) <= VALUE_TOLERANCE * fmax(1, fabs(expected));
+}
+
+void checkEvaluators(Token *sdf) {
+    bool valuesAgree = true, gradientsAgree = true;
+    int side = POINTS_PER_AXIS;
+    for (int i = 0; i < side * side * side; i++) {
+        // Points from -2 to 2, nudged off the lattice of the noise.
+        int index[] = {i % side, i / side % side, i / (side * side)};
+        vec3 point;
+        dvec3 pointDouble;
+        for (int axis = 0; axis < 3; axis++) {
+            point[axis] = index[axis] * 4.0f / (side - 1) - 2.0f +
+                          0.0123f * (axis + 1);
+            pointDouble[axis] = point[axis];
+        }
+        vec3 gradient;
+        dvec3 gradientDouble;
+        float value = evaluateExpressionGradient(sdf, point, gradient);
+        double valueDouble =
+            evaluateExpressionGradientDouble(sdf, pointDouble, gradientDouble);
+        valuesAgree &= agrees(evaluateExpression(sdf, point),
+                              evaluateExpressionDouble(sdf, pointDouble));
+        valuesAgree &= agrees(value, valueDouble);
+        for (int axis = 0; axis < 3; axis++) {
+            gradientsAgree &= agrees(gradient[axis], gradientDouble[axis]);
+        }
+    }
+    CHECK(valuesAgree);
+    CHECK(gradientsAgree);
+}
+
+// Every vertex of the mixed precision mesh must be close to the float one.
+void checkMeshes(Token *sdf) {
+    Generator *gen = createTestGenerator(sdf, 32, 1.5, 1.0);
+    Mesh *floatMesh = createMesh(0), *mixedMesh = createMesh(0);
+    generateMesh(gen, floatMesh, false);
+    setGeneratorPrecision(gen, PRECISION_MIXED);
+    generateMesh(gen, mixedMesh, false);
+
+    size_t count = getMeshVertexCount(floatMesh);
+    CHECK(count > 0);
+    CHECK(getMeshVertexCount(mixedMesh) == count);
+    if (getMeshVertexCount(mixedMesh) == count) {
+        float cell = 3.0f / 32, largest = 0;
+        for (size_t i = 0; i < count; i++) {
+            vec3 floatPos, mixedPos, normal;
+            getMeshVertex(floatMesh, i, floatPos, normal);
+            getMeshVertex(mixedMesh, i, mixedPos, normal);
+            largest = fmaxf(largest, glm_vec3_distance(floatPos, mixedPos));
+        }
+        CHECK(largest <= VERTEX_TOLERANCE * cell);
+    }
+
+    destroyMesh(mixedMesh);
+    destroyMesh(floatMesh);
+    destroyGenerator(gen);
+}
+
+int main(void) {
+    stubMeshGL();
+    int count = sizeof(precisionSDFs) / sizeof(precisionSDFs[0]);
+    for (int i = 0; i < count; i++) {
+        Token sdf[TEST_MAX_TOKENS];
+        parseTestExpression(precisionSDFs[i], sdf);
+        checkEvaluators(sdf);
+    }
+    Token sdf[TEST_MAX_TOKENS];
+    parseTestExpression(precisionSDFs[count - 1], sdf);
+    checkMeshes(sdf);
+    return finishTest();
+}
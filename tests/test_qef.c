@@ -0,0 +1,127 @@
+// Checks how closely the vertices placed by the QEF solve follow surfaces
+// with sharp features: they must land on flat faces and on the corners and
+// creases the grid sees, and stay close to the rest.
+#include "test_support.h"
+
+#include <math.h>
+
+#define SUBDIVISIONS 24
+#define EXTENT 1.3f
+#define CELL (2 * EXTENT / SUBDIVISIONS)
+#define HALF_SIZE 0.77
+
+// Rotations of the second cube, about z and then y.
+#define YAW 0.5
+#define PITCH 0.3
+
+char alignedCubeSDF[] = "max(max(abs(x), abs(y)), abs(z))";
+char rotatedCubeSDF[] =
+    "max(max(abs((x * 0.87758256 - y * 0.47942554) * 0.95533649 + "
+    "z * 0.29552021), abs(x * 0.47942554 + y * 0.87758256)), "
+    "abs(z * 0.95533649 - (x * 0.87758256 - y * 0.47942554) * 0.29552021))";
+// Two planes meeting at a shallow angle, whose crease is only seen when
+// small singular values of the QEF are kept.
+char creaseSDF[] = "y + 0.2 * abs(x)";
+
+// The distance from a point to the surface of a cube of HALF_SIZE at the
+// origin.
+double getCubeDistance(double point[3]) {
+    double outside = 0.0, inside = -INFINITY;
+    for (int axis = 0; axis < 3; axis++) {
+        double offset = fabs(point[axis]) - HALF_SIZE;
+        outside += offset > 0 ? offset * offset : 0.0;
+        inside = fmax(inside, offset);
+    }
+    return fabs(sqrt(outside) + fmin(inside, 0.0));
+}
+
+// Rotates a point into the frame of the rotated cube.
+void rotateToCube(vec3 point, double out[3]) {
+    double u = point[0] * cos(YAW) - point[1] * sin(YAW);
+    double w = point[0] * sin(YAW) + point[1] * cos(YAW);
+    out[0] = u * cos(PITCH) + point[2] * sin(PITCH);
+    out[1] = w;
+    out[2] = -u * sin(PITCH) + point[2] * cos(PITCH);
+}
+
+Mesh *generateTestMesh(char *text, float threshold) {
+    Token sdf[TEST_MAX_TOKENS];
+    parseTestExpression(text, sdf);
+    Generator *gen = createTestGenerator(sdf, SUBDIVISIONS, EXTENT, threshold);
+    Mesh *mesh = createMesh(0);
+    generateMesh(gen, mesh, false);
+    destroyGenerator(gen);
+    return mesh;
+}
+
+void checkAlignedCube(void) {
+    Mesh *mesh = generateTestMesh(alignedCubeSDF, HALF_SIZE);
+    size_t count = getMeshVertexCount(mesh);
+    double largest = 0.0, corners[8];
+    for (int i = 0; i < 8; i++) corners[i] = INFINITY;
+    for (size_t i = 0; i < count; i++) {
+        vec3 pos, normal;
+        getMeshVertex(mesh, i, pos, normal);
+        double point[] = {pos[0], pos[1], pos[2]};
+        largest = fmax(largest, getCubeDistance(point));
+        for (int corner = 0; corner < 8; corner++) {
+            double distance = 0.0;
+            for (int axis = 0; axis < 3; axis++) {
+                double target = corner >> axis & 1 ? HALF_SIZE : -HALF_SIZE;
+                distance += (point[axis] - target) * (point[axis] - target);
+            }
+            corners[corner] = fmin(corners[corner], sqrt(distance));
+        }
+    }
+    CHECK(count > 0);
+    CHECK(largest < 1e-4 * CELL);
+    for (int corner = 0; corner < 8; corner++) {
+        CHECK(corners[corner] < 1e-4 * CELL);
+    }
+    destroyMesh(mesh);
+}
+
+void checkRotatedCube(void) {
+    Mesh *mesh = generateTestMesh(rotatedCubeSDF, HALF_SIZE);
+    size_t count = getMeshVertexCount(mesh);
+    double largest = 0.0, total = 0.0;
+    for (size_t i = 0; i < count; i++) {
+        vec3 pos, normal;
+        getMeshVertex(mesh, i, pos, normal);
+        double point[3];
+        rotateToCube(pos, point);
+        double distance = getCubeDistance(point);
+        largest = fmax(largest, distance);
+        total += distance;
+    }
+    // Cells that only see some of the planes at a corner can only place the
+    // vertex on the part of the feature inside them.
+    CHECK(count > 0);
+    CHECK(largest < 0.5 * CELL);
+    CHECK(total / count < 0.005 * CELL);
+    destroyMesh(mesh);
+}
+
+void checkCrease(void) {
+    Mesh *mesh = generateTestMesh(creaseSDF, 0.0);
+    size_t count = getMeshVertexCount(mesh);
+    double largest = 0.0;
+    for (size_t i = 0; i < count; i++) {
+        vec3 pos, normal;
+        getMeshVertex(mesh, i, pos, normal);
+        double distance =
+            fabs(pos[1] + 0.2 * fabs(pos[0])) / sqrt(1 + 0.2 * 0.2);
+        largest = fmax(largest, distance);
+    }
+    CHECK(count > 0);
+    CHECK(largest < 1e-4 * CELL);
+    destroyMesh(mesh);
+}
+
+int main(void) {
+    stubMeshGL();
+    checkAlignedCube();
+    checkRotatedCube();
+    checkCrease();
+    return finishTest();
+}
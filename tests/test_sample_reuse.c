@@ -0,0 +1,70 @@
+// Checks that samples kept while the window pans give the same mesh as
+// sampling afresh. The window is a power of two across, so that the grid of
+// a window moved by whole cells has exactly the same positions.
+#include "test_support.h"
+
+#define SUBDIVISIONS 64
+#define EXTENT 2.0f
+
+char reuseSDF[] = "x^2 + y^2 + z^2 + noise(x * 4, y * 4, z * 4) * 0.5";
+
+// The test window, moved by the given number of cells along each axis.
+Window getPannedWindow(float cells[3]) {
+    Window window;
+    for (int axis = 0; axis < 3; axis++) {
+        float offset = cells[axis] * 2 * EXTENT / SUBDIVISIONS;
+        window.min[axis] = -EXTENT + offset;
+        window.max[axis] = EXTENT + offset;
+    }
+    return window;
+}
+
+// Pans gen to the window moved by cells, and checks its mesh against a
+// generation from scratch with the window moved by exact.
+void checkPan(Generator *gen, Token *sdf, Precision precision, float cells[3],
+              float exact[3]) {
+    setGeneratorWindow(gen, getPannedWindow(cells));
+    CHECK(hasGeneratorKeptSamples(gen));
+    Mesh *mesh = createMesh(0);
+    generateMesh(gen, mesh, false);
+
+    Generator *fresh = createTestGenerator(sdf, SUBDIVISIONS, EXTENT, 1.0);
+    setGeneratorWindow(fresh, getPannedWindow(exact));
+    setGeneratorPrecision(fresh, precision);
+    Mesh *freshMesh = createMesh(0);
+    generateMesh(fresh, freshMesh, false);
+    CHECK(meshesEqual(mesh, freshMesh));
+
+    destroyMesh(freshMesh);
+    destroyGenerator(fresh);
+    destroyMesh(mesh);
+}
+
+int main(void) {
+    stubMeshGL();
+    Token sdf[TEST_MAX_TOKENS];
+    parseTestExpression(reuseSDF, sdf);
+
+    Precision precisions[] = {PRECISION_FLOAT, PRECISION_MIXED};
+    for (int i = 0; i < 2; i++) {
+        Precision precision = precisions[i];
+        Generator *gen = createTestGenerator(sdf, SUBDIVISIONS, EXTENT, 1.0);
+        setGeneratorPrecision(gen, precision);
+        Mesh *mesh = createMesh(0);
+        generateMesh(gen, mesh, false);
+        // Whole cells, then a pan that is only close to whole cells, which
+        // must stay on the grid of the kept samples.
+        checkPan(gen, sdf, precision, (float[]){3, -2, 5},
+                 (float[]){3, -2, 5});
+        checkPan(gen, sdf, precision, (float[]){4.0002f, -1.0003f, 1.0001f},
+                 (float[]){4, -1, 1});
+        checkPan(gen, sdf, precision, (float[]){-6, 2, 0},
+                 (float[]){-6, 2, 0});
+        // Moving by part of a cell drops the samples.
+        setGeneratorWindow(gen, getPannedWindow((float[]){-5.5f, 2, 0}));
+        CHECK(!hasGeneratorKeptSamples(gen));
+        destroyMesh(mesh);
+        destroyGenerator(gen);
+    }
+    return finishTest();
+}
@@ -0,0 +1,97 @@
+#include "test_support.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <glad/glad.h>
+
+int checkCount = 0, failureCount = 0;
+
+void APIENTRY stubGenObjects(GLsizei count, GLuint *objects) {
+    for (GLsizei i = 0; i < count; i++) objects[i] = i + 1;
+}
+
+void APIENTRY stubDeleteObjects(GLsizei count, const GLuint *objects) {}
+
+void APIENTRY stubBindVertexArray(GLuint array) {}
+
+void APIENTRY stubBindBuffer(GLenum target, GLuint buffer) {}
+
+void APIENTRY stubVertexAttribPointer(GLuint index, GLint size, GLenum type,
+                                      GLboolean normalized, GLsizei stride,
+                                      const void *pointer) {}
+
+void APIENTRY stubEnableVertexAttribArray(GLuint index) {}
+
+void APIENTRY stubBufferData(GLenum target, GLsizeiptr size, const void *data,
+                             GLenum usage) {}
+
+void stubMeshGL(void) {
+    glad_glGenVertexArrays = stubGenObjects;
+    glad_glGenBuffers = stubGenObjects;
+    glad_glDeleteVertexArrays = stubDeleteObjects;
+    glad_glDeleteBuffers = stubDeleteObjects;
+    glad_glBindVertexArray = stubBindVertexArray;
+    glad_glBindBuffer = stubBindBuffer;
+    glad_glVertexAttribPointer = stubVertexAttribPointer;
+    glad_glEnableVertexAttribArray = stubEnableVertexAttribArray;
+    glad_glBufferData = stubBufferData;
+}
+
+bool checkTest(bool passed, const char *description, const char *file,
+               int line) {
+    checkCount++;
+    if (!passed) {
+        failureCount++;
+        fprintf(stderr, "%s:%d: check failed: %s\n", file, line, description);
+    }
+    return passed;
+}
+
+int finishTest(void) {
+    printf("%d of %d checks passed\n", checkCount - failureCount, checkCount);
+    return failureCount > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+void parseTestExpression(char *text, Token *tokens) {
+    char errMsg[128];
+    if (!parseExpression(text, tokens, TEST_MAX_TOKENS, errMsg) ||
+        !validateExpression(tokens, errMsg)) {
+        fprintf(stderr, "%s: %s\n", text, errMsg);
+        exit(EXIT_FAILURE);
+    }
+    optimizeExpression(tokens);
+}
+
+Generator *createTestGenerator(Token *expr, int subdivisions, float extent,
+                               float threshold) {
+    Generator *gen = createGenerator();
+    setGeneratorSDF(gen, expr);
+    setGeneratorSize(gen, subdivisions);
+    setGeneratorWindow(gen, (Window){{-extent, -extent, -extent},
+                                     {extent, extent, extent}});
+    setGeneratorThreshold(gen, threshold);
+    return gen;
+}
+
+bool meshesEqual(Mesh *a, Mesh *b) {
+    size_t count = getMeshVertexCount(a);
+    if (count != getMeshVertexCount(b)) return false;
+    for (size_t i = 0; i < count; i++) {
+        vec3 posA, normalA, posB, normalB;
+        getMeshVertex(a, i, posA, normalA);
+        getMeshVertex(b, i, posB, normalB);
+        if (memcmp(posA, posB, sizeof(vec3)) != 0 ||
+            memcmp(normalA, normalB, sizeof(vec3)) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+double getTestTime(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
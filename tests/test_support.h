@@ -0,0 +1,35 @@
+#ifndef TEST_SUPPORT_H
+#define TEST_SUPPORT_H
+
+#include "expr.h"
+#include "generator.h"
+#include "mesh.h"
+
+#include <stdbool.h>
+
+#define TEST_MAX_TOKENS 512
+
+/// Records a check, printing it with its location if it failed.
+#define CHECK(COND) checkTest((COND), #COND, __FILE__, __LINE__)
+
+/// Replaces the GL functions used by meshes with ones that do nothing, so
+/// that meshes can be created and generated into without a context.
+void stubMeshGL(void);
+/// Records the result of a check, printing it if it failed. Returns passed.
+bool checkTest(bool passed, const char *description, const char *file,
+               int line);
+/// Prints a summary of the checks, and returns the exit status of the test.
+int finishTest(void);
+/// Parses, validates and optimizes an expression into tokens, which must hold
+/// TEST_MAX_TOKENS, exiting if it is invalid.
+void parseTestExpression(char *text, Token *tokens);
+/// Creates a generator for the cube from -extent to extent, with the given
+/// SDF, which must outlive it.
+Generator *createTestGenerator(Token *expr, int subdivisions, float extent,
+                               float threshold);
+/// Whether two meshes hold the same vertices, bit for bit.
+bool meshesEqual(Mesh *a, Mesh *b);
+/// Gets the current time in seconds, for benchmarks.
+double getTestTime(void);
+
+#endif